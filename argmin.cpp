@@ -0,0 +1,264 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Split-point minimization of the matrix chain DP: for a cell (i, j) the
+// plain GEMM cost of splitting at k is m(i, k) + m(k + 1, j) +
+// 2 * p[i - 1] * p[k] * p[j], a min-reduction over three contiguous arrays
+// once m is also kept column-major. The kernels return the first minimum so
+// that every version picks the same split as the scalar loop. The k-best DP
+// also filters the splits whose cost is under a bound, in the same pass.
+
+#include "chain.h"
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_CHAIN_X86 1
+#endif
+
+using namespace details;
+
+static size_t findMinSplitScalar(const long *left, const long *right,
+                                 const long *dims, long factor, size_t size,
+                                 long &best) {
+  size_t split = 0;
+  best = std::numeric_limits<long>::max();
+  for (size_t t = 0; t < size; t++) {
+    long q = left[t] + right[t] + factor * dims[t];
+    if (q < best) {
+      best = q;
+      split = t;
+    }
+  }
+  return split;
+}
+
+static size_t findSplitsBelowScalar(const long *left, const long *right,
+                                    const long *dims, long factor,
+                                    size_t size, long bound, size_t *splits) {
+  size_t count = 0;
+  for (size_t t = 0; t < size; t++)
+    if (left[t] + right[t] + factor * dims[t] <= bound)
+      splits[count++] = t;
+  return count;
+}
+
+/// Reduce per-lane minima (each lane holds its first minimum), then scan the
+/// tail serially.
+static size_t reduceLanes(const long *values, const long *indices,
+                          size_t lanes, const long *left, const long *right,
+                          const long *dims, long factor, size_t tail,
+                          size_t size, long &best) {
+  size_t split = 0;
+  best = std::numeric_limits<long>::max();
+  for (size_t lane = 0; lane < lanes; lane++) {
+    if (values[lane] < best ||
+        (values[lane] == best && size_t(indices[lane]) < split)) {
+      best = values[lane];
+      split = indices[lane];
+    }
+  }
+  for (size_t t = tail; t < size; t++) {
+    long q = left[t] + right[t] + factor * dims[t];
+    if (q < best) {
+      best = q;
+      split = t;
+    }
+  }
+  return split;
+}
+
+#if MATRIX_CHAIN_X86
+/// Low 64 bits of a 64 x 64 bit product, AVX2 only multiplies 32-bit halves.
+__attribute__((target("avx2"))) static inline __m256i mullo64(__m256i a,
+                                                              __m256i b) {
+  __m256i low = _mm256_mul_epu32(a, b);
+  __m256i cross =
+      _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                       _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2"))) static size_t
+findMinSplitAVX2(const long *left, const long *right, const long *dims,
+                 long factor, size_t size, long &best) {
+  const size_t lanes = 4;
+  if (size < lanes)
+    return findMinSplitScalar(left, right, dims, factor, size, best);
+  __m256i bestValues = _mm256_set1_epi64x(std::numeric_limits<long>::max());
+  __m256i bestIndices = _mm256_setzero_si256();
+  __m256i indices = _mm256_set_epi64x(3, 2, 1, 0);
+  const __m256i step = _mm256_set1_epi64x(lanes);
+  const __m256i factors = _mm256_set1_epi64x(factor);
+  size_t t = 0;
+  for (; t + lanes <= size; t += lanes) {
+    __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(left + t));
+    __m256i r =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(right + t));
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dims + t));
+    __m256i q = _mm256_add_epi64(_mm256_add_epi64(l, r), mullo64(factors, d));
+    __m256i less = _mm256_cmpgt_epi64(bestValues, q);
+    bestValues = _mm256_blendv_epi8(bestValues, q, less);
+    bestIndices = _mm256_blendv_epi8(bestIndices, indices, less);
+    indices = _mm256_add_epi64(indices, step);
+  }
+  alignas(32) long values[lanes];
+  alignas(32) long splits[lanes];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(values), bestValues);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(splits), bestIndices);
+  return reduceLanes(values, splits, lanes, left, right, dims, factor, t, size,
+                     best);
+}
+
+__attribute__((target("avx2"))) static size_t
+findSplitsBelowAVX2(const long *left, const long *right, const long *dims,
+                    long factor, size_t size, long bound, size_t *splits) {
+  const size_t lanes = 4;
+  const __m256i factors = _mm256_set1_epi64x(factor);
+  const __m256i bounds = _mm256_set1_epi64x(bound);
+  size_t count = 0, t = 0;
+  for (; t + lanes <= size; t += lanes) {
+    __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(left + t));
+    __m256i r =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(right + t));
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dims + t));
+    __m256i q = _mm256_add_epi64(_mm256_add_epi64(l, r), mullo64(factors, d));
+    // one bit per lane above the bound.
+    unsigned above = _mm256_movemask_pd(
+        _mm256_castsi256_pd(_mm256_cmpgt_epi64(q, bounds)));
+    for (unsigned mask = ~above & 0xf; mask; mask &= mask - 1)
+      splits[count++] = t + __builtin_ctz(mask);
+  }
+  for (; t < size; t++)
+    if (left[t] + right[t] + factor * dims[t] <= bound)
+      splits[count++] = t;
+  return count;
+}
+
+__attribute__((target("avx512f,avx512dq"))) static size_t
+findMinSplitAVX512(const long *left, const long *right, const long *dims,
+                   long factor, size_t size, long &best) {
+  const size_t lanes = 8;
+  if (size < lanes)
+    return findMinSplitAVX2(left, right, dims, factor, size, best);
+  __m512i bestValues = _mm512_set1_epi64(std::numeric_limits<long>::max());
+  __m512i bestIndices = _mm512_setzero_si512();
+  __m512i indices = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+  const __m512i step = _mm512_set1_epi64(lanes);
+  const __m512i factors = _mm512_set1_epi64(factor);
+  size_t t = 0;
+  for (; t + lanes <= size; t += lanes) {
+    __m512i l = _mm512_loadu_si512(left + t);
+    __m512i r = _mm512_loadu_si512(right + t);
+    __m512i d = _mm512_loadu_si512(dims + t);
+    __m512i q = _mm512_add_epi64(_mm512_add_epi64(l, r),
+                                 _mm512_mullo_epi64(factors, d));
+    __mmask8 less = _mm512_cmplt_epi64_mask(q, bestValues);
+    bestValues = _mm512_mask_blend_epi64(less, bestValues, q);
+    bestIndices = _mm512_mask_blend_epi64(less, bestIndices, indices);
+    indices = _mm512_add_epi64(indices, step);
+  }
+  alignas(64) long values[lanes];
+  alignas(64) long splits[lanes];
+  _mm512_store_si512(values, bestValues);
+  _mm512_store_si512(splits, bestIndices);
+  return reduceLanes(values, splits, lanes, left, right, dims, factor, t, size,
+                     best);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static size_t
+findSplitsBelowAVX512(const long *left, const long *right, const long *dims,
+                      long factor, size_t size, long bound, size_t *splits) {
+  const size_t lanes = 8;
+  const __m512i factors = _mm512_set1_epi64(factor);
+  const __m512i bounds = _mm512_set1_epi64(bound);
+  size_t count = 0, t = 0;
+  for (; t + lanes <= size; t += lanes) {
+    __m512i l = _mm512_loadu_si512(left + t);
+    __m512i r = _mm512_loadu_si512(right + t);
+    __m512i d = _mm512_loadu_si512(dims + t);
+    __m512i q = _mm512_add_epi64(_mm512_add_epi64(l, r),
+                                 _mm512_mullo_epi64(factors, d));
+    for (unsigned mask = _mm512_cmple_epi64_mask(q, bounds); mask;
+         mask &= mask - 1)
+      splits[count++] = t + __builtin_ctz(mask);
+  }
+  for (; t < size; t++)
+    if (left[t] + right[t] + factor * dims[t] <= bound)
+      splits[count++] = t;
+  return count;
+}
+#endif
+
+SIMDLevel details::getSIMDLevel() {
+#if MATRIX_CHAIN_X86
+  static const SIMDLevel level = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512dq"))
+      return SIMDLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+      return SIMDLevel::AVX2;
+    return SIMDLevel::SCALAR;
+  }();
+  return level;
+#else
+  return SIMDLevel::SCALAR;
+#endif
+}
+
+size_t details::findMinSplit(const long *left, const long *right,
+                             const long *dims, long factor, size_t size,
+                             long &best, SIMDLevel level) {
+  assert(level <= getSIMDLevel() && "instruction set not supported");
+  switch (level) {
+#if MATRIX_CHAIN_X86
+  case SIMDLevel::AVX512:
+    return findMinSplitAVX512(left, right, dims, factor, size, best);
+  case SIMDLevel::AVX2:
+    return findMinSplitAVX2(left, right, dims, factor, size, best);
+#endif
+  default:
+    return findMinSplitScalar(left, right, dims, factor, size, best);
+  }
+}
+
+size_t details::findSplitsBelow(const long *left, const long *right,
+                                const long *dims, long factor, size_t size,
+                                long bound, size_t *splits,
+                                SIMDLevel level) {
+  assert(level <= getSIMDLevel() && "instruction set not supported");
+  switch (level) {
+#if MATRIX_CHAIN_X86
+  case SIMDLevel::AVX512:
+    return findSplitsBelowAVX512(left, right, dims, factor, size, bound,
+                                 splits);
+  case SIMDLevel::AVX2:
+    return findSplitsBelowAVX2(left, right, dims, factor, size, bound,
+                               splits);
+#endif
+  default:
+    return findSplitsBelowScalar(left, right, dims, factor, size, bound,
+                                 splits);
+  }
+}
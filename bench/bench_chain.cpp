@@ -0,0 +1,258 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chain.h"
+#include "benchmark/benchmark.h"
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+using namespace std;
+using namespace matrixchain;
+
+// Optimizer hot paths over chain length, shape distribution and property
+// mix. Every benchmark reports the heap allocations and bytes per iteration
+// and the peak of live heap bytes during the run, counted by the global
+// operator new below. Use --benchmark_out=<file> --benchmark_out_format=json
+// (or the bench-chain-json target) to keep results around.
+
+// ----------------------------------------------------------------------
+// Allocation counting.
+// ----------------------------------------------------------------------
+
+static std::atomic<size_t> allocations(0);
+static std::atomic<size_t> allocatedBytes(0);
+static std::atomic<size_t> liveBytes(0);
+static std::atomic<size_t> peakBytes(0);
+
+// keeps the payload aligned like malloc.
+static const size_t headerSize = 16;
+
+// not inlined, so that the compiler does not pair our free with the
+// caller's new.
+__attribute__((noinline)) void *operator new(size_t size) {
+  char *raw = static_cast<char *>(std::malloc(size + headerSize));
+  if (!raw)
+    throw std::bad_alloc();
+  *reinterpret_cast<size_t *>(raw) = size;
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  size_t live = liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+  size_t peak = peakBytes.load(std::memory_order_relaxed);
+  while (live > peak && !peakBytes.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed))
+    ;
+  return raw + headerSize;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  if (!ptr)
+    return;
+  char *raw = static_cast<char *>(ptr) - headerSize;
+  liveBytes.fetch_sub(*reinterpret_cast<size_t *>(raw),
+                      std::memory_order_relaxed);
+  std::free(raw);
+}
+
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+
+/// Counts the allocations of the timed loop of a benchmark.
+class AllocationCounter {
+public:
+  AllocationCounter()
+      : startAllocations(allocations.load()),
+        startBytes(allocatedBytes.load()), baseline(liveBytes.load()) {
+    peakBytes.store(baseline);
+  }
+
+  void report(benchmark::State &state) const {
+    double iterations = state.iterations() ? state.iterations() : 1;
+    state.counters["allocs"] =
+        (allocations.load() - startAllocations) / iterations;
+    state.counters["allocBytes"] =
+        (allocatedBytes.load() - startBytes) / iterations;
+    state.counters["peakBytes"] = peakBytes.load() - baseline;
+  }
+
+private:
+  size_t startAllocations;
+  size_t startBytes;
+  size_t baseline;
+};
+
+// ----------------------------------------------------------------------
+// Chain generators.
+// ----------------------------------------------------------------------
+
+enum class Shape { UNIFORM, SKEWED, SQUARE, VECTOR_ENDED };
+enum class Properties { NONE, TRIANGULAR, SYMMETRIC };
+
+/// Dimensions p0, ..., pn of a random chain.
+static vector<int> getDims(size_t n, Shape shape, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> unit(0, 1);
+  vector<int> p(n + 1);
+  for (auto &dim : p) {
+    switch (shape) {
+    case Shape::UNIFORM:
+      dim = 1 + rng() % 1000;
+      break;
+    case Shape::SKEWED:
+      // mostly small with a few large dimensions.
+      dim = 1 + int(1000 * std::pow(unit(rng), 4));
+      break;
+    case Shape::SQUARE:
+      dim = 500;
+      break;
+    case Shape::VECTOR_ENDED:
+      dim = 1 + rng() % 1000;
+      break;
+    }
+  }
+  if (shape == Shape::VECTOR_ENDED)
+    p.front() = p.back() = 1;
+  return p;
+}
+
+/// Random chain of n operands. With properties, every third operand is made
+/// square and gets them.
+static Expr *getChain(size_t n, Shape shape, Properties properties,
+                      unsigned seed = 0) {
+  std::mt19937 rng(seed + n);
+  vector<int> p = getDims(n, shape, rng);
+  vector<Expr *> operands;
+  for (size_t i = 0; i < n; i++) {
+    bool withProperties = properties != Properties::NONE && i % 3 == 1;
+    if (withProperties)
+      p[i + 1] = p[i];
+    auto *operand = new Operand("A", {p[i], p[i + 1]});
+    if (withProperties && properties == Properties::TRIANGULAR)
+      operand->setProperties({rng() % 2
+                                  ? Expr::ExprProperty::LOWER_TRIANGULAR
+                                  : Expr::ExprProperty::UPPER_TRIANGULAR});
+    if (withProperties && properties == Properties::SYMMETRIC)
+      operand->setProperties({Expr::ExprProperty::SYMMETRIC});
+    operands.push_back(operand);
+  }
+  return details::binaryMul(operands);
+}
+
+/// Lengths up to `maxLength`, property mixes only up to `maxWithProperties`.
+static void chainArgs(benchmark::internal::Benchmark *b, long maxLength,
+                      long maxWithProperties) {
+  b->ArgNames({"n", "shape", "props"});
+  for (long n : {10, 50, 100, 500, 1000, 2000, 5000})
+    for (long shape = 0; shape < 4; shape++)
+      for (long props = 0; props < 3; props++)
+        if (n <= (props ? maxWithProperties : maxLength))
+          b->Args({n, shape, props});
+}
+
+// ----------------------------------------------------------------------
+// Benchmarks.
+// ----------------------------------------------------------------------
+
+// Full runMCP: operand walk, O(n^3) DP and tree construction. Longer chains
+// take seconds per iteration, see BM_RunMCPHuShing for those.
+static void BM_RunMCP(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getChain(state.range(0), Shape(state.range(1)),
+                         Properties(state.range(2)));
+  AllocationCounter counter;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(runMCP(chain).getOptimalCost());
+  counter.report(state);
+}
+
+BENCHMARK(BM_RunMCP)
+    ->Apply([](benchmark::internal::Benchmark *b) { chainArgs(b, 1000, 1000); })
+    ->Unit(benchmark::kMillisecond);
+
+// runMCP with the Hu-Shing engine, up to 5000 factors. Chains with
+// properties fall back to the DP, so they stop at 1000 factors.
+static void BM_RunMCPHuShing(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getChain(state.range(0), Shape(state.range(1)),
+                         Properties(state.range(2)));
+  MCPOptions options;
+  options.engine = MCPEngine::HU_SHING;
+  AllocationCounter counter;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(runMCP(chain, options).getOptimalCost());
+  counter.report(state);
+}
+
+BENCHMARK(BM_RunMCPHuShing)
+    ->Apply([](benchmark::internal::Benchmark *b) { chainArgs(b, 5000, 1000); })
+    ->Unit(benchmark::kMillisecond);
+
+// binaryMul flattening a left-deep chain of n operands.
+static void BM_BinaryMul(benchmark::State &state) {
+  ScopedContext ctx;
+  size_t n = state.range(0);
+  vector<Expr *> operands;
+  for (size_t i = 0; i < n; i++)
+    operands.push_back(new Operand("A", {10, 10}));
+  AllocationCounter counter;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(details::binaryMul(operands));
+  counter.report(state);
+}
+
+BENCHMARK(BM_BinaryMul)->RangeMultiplier(10)->Range(10, 10000);
+
+static void BM_CollectOperands(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getChain(state.range(0), Shape::UNIFORM, Properties::NONE);
+  AllocationCounter counter;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(details::collectOperands(chain));
+  counter.report(state);
+}
+
+BENCHMARK(BM_CollectOperands)->RangeMultiplier(10)->Range(10, 10000);
+
+// Destruction of a context holding n operands, their chain and a left-deep
+// product tree over them; building them is not timed.
+static void BM_ContextTeardown(benchmark::State &state) {
+  size_t n = state.range(0);
+  AllocationCounter counter;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto *ctx = new ScopedContext();
+    vector<Expr *> operands =
+        details::collectOperands(getChain(n, Shape::UNIFORM, Properties::NONE));
+    Expr *tree = operands[0];
+    for (size_t i = 1; i < n; i++)
+      tree = details::binaryMul({tree, operands[i]}, true);
+    benchmark::DoNotOptimize(tree);
+    state.ResumeTiming();
+    delete ctx;
+  }
+  counter.report(state);
+}
+
+BENCHMARK(BM_ContextTeardown)
+    ->RangeMultiplier(10)
+    ->Range(10, 10000)
+    ->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,74 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.c om>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chain.h"
+#include "benchmark/benchmark.h"
+#include <sys/resource.h>
+
+using namespace std;
+using namespace matrixchain;
+
+// Node creation through `new` (heap + std::set registration) against
+// `ScopedContext::create` (arena). Each iteration builds `range(0)` operands
+// and as many binary muls, then tears down the context. The maxRSS counter is
+// the process high-water mark: run one benchmark per process (i.e.,
+// --benchmark_filter=BM_New) to compare peak memory.
+
+static void setCounters(benchmark::State &state, long nodes) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  state.counters["maxRSS_KB"] = usage.ru_maxrss;
+  state.SetItemsProcessed(state.iterations() * nodes);
+}
+
+static void BM_New(benchmark::State &state) {
+  const int n = state.range(0);
+  for (auto _ : state) {
+    ScopedContext ctx;
+    Expr *prev = new Operand("A", {10, 10});
+    for (int i = 1; i < n; i++) {
+      Expr *operand = new Operand("A", {10, 10});
+      prev = new NaryOp({prev, operand}, NaryOp::NaryOpKind::MUL);
+    }
+    benchmark::DoNotOptimize(prev);
+  }
+  setCounters(state, 2 * n - 1);
+}
+
+static void BM_Create(benchmark::State &state) {
+  const int n = state.range(0);
+  for (auto _ : state) {
+    ScopedContext ctx;
+    Expr *prev = ctx.create<Operand>("A", vector<int>{10, 10});
+    for (int i = 1; i < n; i++) {
+      Expr *operand = ctx.create<Operand>("A", vector<int>{10, 10});
+      prev = ctx.create<NaryOp>(vector<Expr *>{prev, operand},
+                                NaryOp::NaryOpKind::MUL);
+    }
+    benchmark::DoNotOptimize(prev);
+  }
+  setCounters(state, 2 * n - 1);
+}
+
+BENCHMARK(BM_New)->RangeMultiplier(10)->Range(100, 1000000);
+BENCHMARK(BM_Create)->RangeMultiplier(10)->Range(100, 1000000);
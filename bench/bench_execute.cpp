@@ -0,0 +1,299 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chain.h"
+#include "costmodel.h"
+#include "execute.h"
+#include "kernels.h"
+#include "benchmark/benchmark.h"
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+
+using namespace std;
+using namespace matrixchain;
+
+// Heap allocations, to check that evaluation does not allocate.
+static std::atomic<size_t> allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+
+static vector<double> getRandomMatrix(long rows, long cols, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> dist(-1, 1);
+  vector<double> matrix(rows * cols);
+  for (auto &value : matrix)
+    value = dist(rng);
+  return matrix;
+}
+
+/// The chain of random matrices of dimensions `p`, bound to buffers
+/// appended to `buffers`.
+static Expr *getRandomChain(const vector<int> &p, std::mt19937 &rng,
+                            vector<vector<double>> &buffers,
+                            Bindings &bindings) {
+  vector<Expr *> operands;
+  for (size_t i = 0; i + 1 < p.size(); i++) {
+    auto *operand = new Operand("A", {p[i], p[i + 1]});
+    buffers.push_back(getRandomMatrix(p[i], p[i + 1], rng));
+    bindings[operand] = buffers.back().data();
+    operands.push_back(operand);
+  }
+  return details::binaryMul(operands);
+}
+
+static void setFlops(benchmark::State &state, double flops) {
+  state.counters["GFLOP"] = benchmark::Counter(
+      flops * 1e-9, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+// Square n x n products: triple loop against the blocked kernel.
+static void BM_GemmNaive(benchmark::State &state) {
+  long n = state.range(0);
+  std::mt19937 rng(n);
+  vector<double> a = getRandomMatrix(n, n, rng), b = getRandomMatrix(n, n, rng);
+  vector<double> c(n * n);
+  for (auto _ : state) {
+    std::fill(c.begin(), c.end(), 0.0);
+    for (long i = 0; i < n; i++)
+      for (long k = 0; k < n; k++)
+        for (long j = 0; j < n; j++)
+          c[i * n + j] += a[i * n + k] * b[k * n + j];
+    benchmark::DoNotOptimize(c.data());
+  }
+  setFlops(state, 2.0 * n * n * n);
+}
+
+static void BM_Gemm(benchmark::State &state) {
+  long n = state.range(0);
+  std::mt19937 rng(n);
+  vector<double> a = getRandomMatrix(n, n, rng), b = getRandomMatrix(n, n, rng);
+  vector<double> c(n * n);
+  for (auto _ : state) {
+    details::gemm(details::getRowMajor(a.data(), n, n),
+                  details::getRowMajor(b.data(), n, n), c.data(), n);
+    benchmark::DoNotOptimize(c.data());
+  }
+  setFlops(state, 2.0 * n * n * n);
+}
+
+BENCHMARK(BM_GemmNaive)->RangeMultiplier(2)->Range(64, 512);
+BENCHMARK(BM_Gemm)->RangeMultiplier(2)->Range(64, 1024);
+
+// The kernels for property-carrying operands against gemm on the same
+// n x n operands. GFLOP is the gemm-equivalent rate (2 n^3 flops), so the
+// ratio to kernel 0 is the speedup: the cost model expects 2x for trmm,
+// syrk and trsm; symm does the flops of gemm. The solves posv and gesv
+// (factorization included) expect 6/7 and 3/4 of gemm, the explicit inverse
+// (gesv on the identity) the same as gesv.
+static void BM_PropertyKernel(benchmark::State &state) {
+  long n = state.range(0);
+  long kernel = state.range(1);
+  std::mt19937 rng(n);
+  vector<double> a = getRandomMatrix(n, n, rng), b = getRandomMatrix(n, n, rng);
+  vector<double> c(n * n), workspace(n * n);
+  // diagonally dominant, for the solves.
+  for (long i = 0; i < n; i++)
+    a[i * n + i] += n;
+  auto lhs = details::getRowMajor(a.data(), n, n);
+  auto rhs = details::getRowMajor(b.data(), n, n);
+  for (auto _ : state) {
+    switch (kernel) {
+    case 0:
+      details::gemm(lhs, rhs, c.data(), n);
+      break;
+    case 1:
+      details::trmm(details::Triangle::LOWER, lhs, rhs, c.data(), n);
+      break;
+    case 2:
+      details::symm(lhs, rhs, c.data(), n);
+      break;
+    case 3:
+      details::syrk(lhs, c.data(), n);
+      break;
+    case 4:
+      details::trsm(details::Triangle::LOWER, lhs, rhs, c.data(), n);
+      break;
+    case 5:
+      details::posv(lhs, rhs, c.data(), n, workspace.data());
+      break;
+    case 6:
+      details::gesv(lhs, rhs, c.data(), n, workspace.data());
+      break;
+    case 7:
+      details::invert(lhs, c.data(), workspace.data());
+      break;
+    }
+    benchmark::DoNotOptimize(c.data());
+  }
+  setFlops(state, 2.0 * n * n * n);
+  const char *names[] = {"gemm", "trmm", "symm", "syrk",
+                         "trsm", "posv", "gesv", "invert"};
+  state.SetLabel(names[kernel]);
+}
+
+BENCHMARK(BM_PropertyKernel)
+    ->ArgNames({"n", "kernel"})
+    ->ArgsProduct({{256, 512, 1024}, {0, 1, 2, 3, 4, 5, 6, 7}});
+
+// A random chain of n matrices with dimensions in [10, 400], evaluated in
+// the optimal order and left to right. Reports the planned peak bytes of
+// the intermediates and the heap allocations per evaluation.
+static void BM_Evaluate(benchmark::State &state) {
+  ScopedContext ctx;
+  long n = state.range(0);
+  bool optimal = state.range(1);
+  std::mt19937 rng(n);
+  vector<int> p(n + 1);
+  for (auto &dim : p)
+    dim = 10 + rng() % 391;
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  Expr *chain = getRandomChain(p, rng, buffers, bindings);
+  ResultMCP plan = runMCP(chain);
+  long flops = plan.getOptimalCost();
+  if (!optimal) {
+    // ((A1 A2) A3) ...
+    flops = 0;
+    for (long j = 2; j <= n; j++) {
+      plan.getSplits()(1, j) = j - 1;
+      flops += 2l * p[0] * p[j - 1] * p[j];
+    }
+  }
+  vector<double> out(p[0] * p[n]);
+  PreparedChain prepared(chain, plan);
+  size_t start = allocations.load();
+  for (auto _ : state)
+    prepared.run(bindings, out.data());
+  setFlops(state, flops);
+  state.counters["flops"] = prepared.getFlops();
+  state.counters["peakBytes"] = prepared.getPeakBytes();
+  state.counters["allocs"] = benchmark::Counter(
+      allocations.load() - start, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_Evaluate)
+    ->ArgNames({"n", "optimal"})
+    ->Ranges({{4, 16}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// The optimal plan of a chain of 16 matrices with dimensions in [200, 800]
+// evaluated on a pool of `threads` threads. Wall-clock time: the speedup is
+// the time of threads:1 over the time of the other runs.
+static void BM_EvaluateThreads(benchmark::State &state) {
+  ScopedContext ctx;
+  const long n = 16;
+  unsigned threads = state.range(0);
+  std::mt19937 rng(n);
+  vector<int> p(n + 1);
+  for (auto &dim : p)
+    dim = 200 + rng() % 601;
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  Expr *chain = getRandomChain(p, rng, buffers, bindings);
+  ResultMCP plan = runMCP(chain);
+  vector<double> out(p[0] * p[n]);
+  PreparedChain prepared(chain, plan, threads);
+  for (auto _ : state)
+    prepared.run(bindings, out.data());
+  setFlops(state, plan.getOptimalCost());
+}
+
+BENCHMARK(BM_EvaluateThreads)
+    ->ArgName("threads")
+    ->RangeMultiplier(2)
+    ->Range(1, 64)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// The measured model from the file named by MATRIX_CHAIN_COSTS (see the
+// calibrate-costs target), calibrated on the spot otherwise.
+static const MeasuredModel &getMeasuredModel() {
+  static const MeasuredModel model = []() {
+    MeasuredModel loaded;
+    const char *path = std::getenv("MATRIX_CHAIN_COSTS");
+    if (path && loaded.load(path))
+      return loaded;
+    std::cerr << "calibrating the cost model...\n";
+    return MeasuredModel::calibrate();
+  }();
+  return model;
+}
+
+// Skinny chains: n matrices whose dimensions alternate at random between
+// [2, 16] and [256, 1024], evaluated with the plan of the flop count
+// (model 0) or of the measured model (model 1). The counters are the flops
+// of the plan and the runtime the measured model predicts for it.
+static void BM_SkinnyChain(benchmark::State &state) {
+  ScopedContext ctx;
+  long n = state.range(0);
+  bool measured = state.range(1);
+  std::mt19937 rng(n);
+  vector<int> p(n + 1);
+  for (long i = 0; i <= n; i++)
+    p[i] = rng() % 2 ? 2 + rng() % 15 : 256 + rng() % 769;
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  Expr *chain = getRandomChain(p, rng, buffers, bindings);
+  MCPOptions options;
+  options.costModel = &getMeasuredModel();
+  ResultMCP measuredPlan = runMCP(chain, options);
+  options.costModel = nullptr;
+  ResultMCP plan = measured ? measuredPlan : runMCP(chain, options);
+  // the predicted time of the plan, its flops are the ones of getFlops.
+  long picoseconds = 0;
+  std::function<void(size_t, size_t)> price = [&](size_t i, size_t j) {
+    if (i == j)
+      return;
+    size_t k = plan.getSplit(i, j);
+    price(i, k);
+    price(k + 1, j);
+    picoseconds += getMeasuredModel().getCost(KernelKind::GEMM, p[i - 1],
+                                              p[k], p[j]);
+  };
+  price(1, n);
+  vector<double> out(p[0] * p[n]);
+  PreparedChain prepared(chain, plan);
+  for (auto _ : state)
+    prepared.run(bindings, out.data());
+  state.counters["flops"] = prepared.getFlops();
+  state.counters["predictedMs"] = picoseconds * 1e-9;
+}
+
+BENCHMARK(BM_SkinnyChain)
+    ->ArgNames({"n", "model"})
+    ->ArgsProduct({{6, 12, 24}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
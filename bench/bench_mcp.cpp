@@ -0,0 +1,249 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "chain.h"
+#include "plancache.h"
+#include "benchmark/benchmark.h"
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace matrixchain;
+
+static Expr *getRandomChain(int n) {
+  std::mt19937 rng(n);
+  vector<int> p(n + 1);
+  for (auto &dim : p)
+    dim = 1 + rng() % 1000;
+  vector<Expr *> operands;
+  for (int i = 0; i < n; i++)
+    operands.push_back(new Operand("A", {p[i], p[i + 1]}));
+  return details::binaryMul(operands);
+}
+
+// Strong scaling of the wavefront solver: chain length x threads.
+static void BM_MCPThreads(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getRandomChain(state.range(0));
+  MCPOptions options;
+  options.numThreads = state.range(1);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(getMCPFlops(chain, options));
+  state.counters["threads"] = options.numThreads;
+}
+
+static void threadsArgs(benchmark::internal::Benchmark *b) {
+  long maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (long n : {250, 500, 1000, 2000}) {
+    for (long threads = 1; threads < maxThreads; threads *= 2)
+      b->Args({n, threads});
+    b->Args({n, maxThreads});
+  }
+}
+
+BENCHMARK(BM_MCPThreads)
+    ->Apply(threadsArgs)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// DP against Hu-Shing and the approximation over the chain length, to find
+// the crossovers.
+static void BM_MCPEngine(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getRandomChain(state.range(0));
+  MCPOptions options;
+  options.engine = static_cast<MCPEngine>(state.range(1));
+  for (auto _ : state)
+    benchmark::DoNotOptimize(getMCPFlops(chain, options));
+}
+
+BENCHMARK(BM_MCPEngine)
+    ->ArgNames({"n", "engine"})
+    ->RangeMultiplier(2)
+    ->Ranges({{4, 2048}, {0, 2}})
+    ->Unit(benchmark::kMicrosecond);
+
+// Re-optimizing the same chain shape with and without a plan cache.
+static void BM_MCPCache(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getRandomChain(state.range(0));
+  PlanCache cache;
+  MCPOptions options;
+  if (state.range(1))
+    options.cache = &cache;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(getMCPFlops(chain, options));
+}
+
+BENCHMARK(BM_MCPCache)
+    ->ArgNames({"n", "cache"})
+    ->RangeMultiplier(4)
+    ->Ranges({{16, 256}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond);
+
+// A burst of small chains (5 to 30 factors): one getMCPFlops call per chain
+// against runMCPBatch, in chains per second.
+static vector<Expr *> getRandomBurst(size_t count) {
+  std::mt19937 rng(count);
+  vector<Expr *> chains;
+  for (size_t c = 0; c < count; c++) {
+    int n = 5 + rng() % 26;
+    vector<Expr *> operands;
+    int rows = 1 + rng() % 1000;
+    for (int i = 0; i < n; i++) {
+      int cols = 1 + rng() % 1000;
+      operands.push_back(new Operand("A", {rows, cols}));
+      rows = cols;
+    }
+    chains.push_back(details::binaryMul(operands));
+  }
+  return chains;
+}
+
+static void BM_MCPLoop(benchmark::State &state) {
+  ScopedContext ctx;
+  vector<Expr *> chains = getRandomBurst(state.range(0));
+  for (auto _ : state)
+    for (Expr *chain : chains)
+      benchmark::DoNotOptimize(getMCPFlops(chain));
+  state.SetItemsProcessed(state.iterations() * chains.size());
+}
+
+BENCHMARK(BM_MCPLoop)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static void BM_MCPBatch(benchmark::State &state) {
+  ScopedContext ctx;
+  vector<Expr *> chains = getRandomBurst(state.range(0));
+  MCPOptions options;
+  options.numThreads = state.range(1);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(runMCPBatch(chains, options));
+  state.SetItemsProcessed(state.iterations() * chains.size());
+}
+
+static void batchArgs(benchmark::internal::Benchmark *b) {
+  long maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  for (long threads = 1; threads < maxThreads; threads *= 2)
+    b->Args({10000, threads});
+  b->Args({10000, maxThreads});
+}
+
+BENCHMARK(BM_MCPBatch)
+    ->ArgNames({"chains", "threads"})
+    ->Apply(batchArgs)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Serial DP, reported as time per DP cell.
+static void BM_MCPCell(benchmark::State &state) {
+  ScopedContext ctx;
+  long n = state.range(0);
+  Expr *chain = getRandomChain(n);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(getMCPFlops(chain));
+  // inverted rate: seconds per cell, printed with an SI prefix (e.g. 80n).
+  state.counters["time/cell"] = benchmark::Counter(
+      n * (n - 1) / 2, benchmark::Counter::kIsIterationInvariantRate |
+                           benchmark::Counter::kInvert);
+}
+
+BENCHMARK(BM_MCPCell)
+    ->RangeMultiplier(2)
+    ->Range(64, 1024)
+    ->Unit(benchmark::kMillisecond);
+
+// A request stream whose batch dimension (the last one) changes every
+// time: solving the chain from scratch (update 0) against updating an
+// IncrementalMCP, at the end of the chain (1) or in its middle (2).
+static void BM_MCPIncremental(benchmark::State &state) {
+  ScopedContext ctx;
+  const long n = state.range(0);
+  const long update = state.range(1);
+  Expr *chain = getRandomChain(n);
+  IncrementalMCP incremental(chain);
+  const size_t t = update == 2 ? n / 2 : n;
+  const long dim = incremental.getPVector()[t];
+  const long dims[] = {dim, dim / 2 + 1};
+  size_t cells = 0, iteration = 0;
+  for (auto _ : state) {
+    if (update) {
+      incremental.setDimension(t, dims[iteration++ % 2]);
+      cells += incremental.getSolvedCells();
+    } else {
+      benchmark::DoNotOptimize(getMCPFlops(chain));
+      cells += n * (n - 1) / 2;
+    }
+  }
+  state.counters["cells"] = benchmark::Counter(
+      cells, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_MCPIncremental)
+    ->ArgNames({"n", "update"})
+    ->ArgsProduct({{100, 250, 500, 1000, 2000}, {0, 1, 2}})
+    ->Unit(benchmark::kMicrosecond);
+
+// The k cheapest plans against the single best (k = 0 runs runMCP).
+static void BM_MCPTopK(benchmark::State &state) {
+  ScopedContext ctx;
+  Expr *chain = getRandomChain(state.range(0));
+  const size_t count = state.range(1);
+  for (auto _ : state) {
+    if (count)
+      benchmark::DoNotOptimize(runMCPTopK(chain, count));
+    else
+      benchmark::DoNotOptimize(runMCP(chain));
+  }
+}
+
+BENCHMARK(BM_MCPTopK)
+    ->ArgNames({"n", "k"})
+    ->ArgsProduct({{16, 64, 256}, {0, 1, 2, 4, 8}})
+    ->Unit(benchmark::kMicrosecond);
+
+// The split-point kernel alone, one row of length n per iteration.
+static void BM_SplitKernel(benchmark::State &state) {
+  auto level = static_cast<details::SIMDLevel>(state.range(1));
+  if (level > details::getSIMDLevel()) {
+    state.SkipWithError("instruction set not supported");
+    return;
+  }
+  size_t n = state.range(0);
+  std::mt19937 rng(n);
+  vector<long> left(n), right(n), dims(n);
+  for (size_t t = 0; t < n; t++) {
+    left[t] = rng() % 1000000;
+    right[t] = rng() % 1000000;
+    dims[t] = 1 + rng() % 1000;
+  }
+  for (auto _ : state) {
+    long best;
+    benchmark::DoNotOptimize(details::findMinSplit(
+        left.data(), right.data(), dims.data(), 2, n, best, level));
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+BENCHMARK(BM_SplitKernel)
+    ->ArgNames({"n", "simd"})
+    ->Ranges({{16, 4096}, {0, 2}});
@@ -22,41 +22,67 @@ SOFTWARE.
 */
 
 #include "chain.h"
+#include "costmodel.h"
+#include "plancache.h"
+#include "stats.h"
+#include "threadpool.h"
 #include "llvm/Support/Casting.h"
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <numeric>
 
 using namespace matrixchain;
 using namespace details;
 
-void UnaryOp::inferProperties() { return; }
-
-void NaryOp::inferProperties() { return; }
-
 ScopedContext *&ScopedContext::getCurrentScopedContext() {
   thread_local ScopedContext *context = nullptr;
   return context;
 }
 
+Arena::~Arena() {
+  for (auto slab : slabs)
+    ::operator delete(slab);
+}
+
+void *Arena::allocateSlow(size_t size, size_t alignment) {
+  // oversized requests get a dedicated slab.
+  size_t bytes = size + alignment > slabSize ? size + alignment : slabSize;
+  char *slab = static_cast<char *>(::operator new(bytes));
+  slabs.push_back(slab);
+  bytesReserved += bytes;
+  cur = slab;
+  end = slab + bytes;
+  return allocate(size, alignment);
+}
+
 ScopedContext::~ScopedContext() {
   for (auto expr : liveRefs)
     delete expr;
+  // the arena releases the memory, we only need to run the destructors.
+  for (auto expr : arenaRefs)
+    expr->~Expr();
 }
 
 void ScopedContext::print() {
-  cout << "#live refs: " << liveRefs.size() << "\n";
+  cout << "#live refs: " << liveRefs.size() + arenaRefs.size() << "\n";
   int operands = 0;
   int unaries = 0;
   int binaries = 0;
-  for (Expr *expr : liveRefs) {
+  auto count = [&](Expr *expr) {
     if (llvm::isa<Operand>(expr))
       operands++;
     if (llvm::isa<UnaryOp>(expr))
       unaries++;
     if (llvm::isa<NaryOp>(expr))
       binaries++;
-  }
+  };
+  for (Expr *expr : liveRefs)
+    count(expr);
+  for (Expr *expr : arenaRefs)
+    count(expr);
   cout << "#operands : " << operands << "\n";
   cout << "#unaries : " << unaries << "\n";
   cout << "#binaries : " << binaries << "\n";
@@ -143,11 +169,18 @@ void walk(const Expr *node, int level) {
   }
 }
 
+static ScopedContext *getContext() {
+  auto ctx = ScopedContext::getCurrentScopedContext();
+  assert(ctx != nullptr && "ctx not available");
+  return ctx;
+}
+
 /// Multiply two or more expressions.
 Expr *details::binaryMul(vector<Expr *> children, bool binary) {
   if (binary) {
     assert(children.size() == 2 && "expect only two children");
-    return new NaryOp({children[0], children[1]}, NaryOp::NaryOpKind::MUL);
+    return getContext()->intern<NaryOp>(
+        vector<Expr *>{children[0], children[1]}, NaryOp::NaryOpKind::MUL);
   }
   // fold other mul inside.
   vector<Expr *> newChildren;
@@ -160,50 +193,61 @@ Expr *details::binaryMul(vector<Expr *> children, bool binary) {
     } else
       newChildren.insert(newChildren.begin(), children.at(i));
   }
-  return new NaryOp(newChildren, NaryOp::NaryOpKind::MUL);
+  return getContext()->intern<NaryOp>(newChildren, NaryOp::NaryOpKind::MUL);
 }
 
 /// invert an expression.
 Expr *inv(Expr *child) {
   assert(child && "child expr must be non null");
-  return new UnaryOp(child, UnaryOp::UnaryOpKind::INVERSE);
+  return getContext()->intern<UnaryOp>(child, UnaryOp::UnaryOpKind::INVERSE);
 }
 
 /// transpose an expression.
 Expr *trans(Expr *child) {
   assert(child && "child expr must be non null");
-  return new UnaryOp(child, UnaryOp::UnaryOpKind::TRANSPOSE);
+  return getContext()->intern<UnaryOp>(child,
+                                       UnaryOp::UnaryOpKind::TRANSPOSE);
 }
 
-static vector<long> getPVector(vector<Expr *> exprs) {
-  vector<long> pVector;
+/// Rows and columns of the leaf `expr` of a normal form.
+static std::pair<long, long> getLeafShape(Expr *expr) {
+  if (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(expr)) {
+    auto shape = getLeafShape(unaryOp->getChild());
+    if (unaryOp->getKind() == UnaryOp::UnaryOpKind::TRANSPOSE)
+      std::swap(shape.first, shape.second);
+    return shape;
+  }
+  auto operand = llvm::dyn_cast_or_null<Operand>(expr);
+  assert(operand && "must be non null");
+  const auto &shape = operand->getShape();
+  assert(shape.size() == 2 && "must be 2d");
+  return {shape[0], shape[1]};
+}
+
+static void getPVector(const vector<Expr *> &exprs, vector<long> &pVector) {
+  pVector.clear();
   for (auto expr : exprs) {
-    Operand *operand = nullptr;
-    if (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(expr))
-      operand = llvm::dyn_cast_or_null<Operand>(unaryOp->getChild());
-    else
-      operand = llvm::dyn_cast_or_null<Operand>(expr);
-    assert(operand && "must be non null");
-    auto shape = operand->getShape();
-    if (!pVector.size()) {
-      pVector.push_back(shape[0]);
-      pVector.push_back(shape[1]);
-    } else {
-      pVector.push_back(shape[1]);
-    }
+    auto shape = getLeafShape(expr);
+    if (!pVector.size())
+      pVector.push_back(shape.first);
+    pVector.push_back(shape.second);
   }
+}
+
+static vector<long> getPVector(const vector<Expr *> &exprs) {
+  vector<long> pVector;
+  getPVector(exprs, pVector);
   return pVector;
 }
 
-static void printOptimalParens(const vector<vector<long>> &s, size_t i,
+static void printOptimalParens(const TriangularTable<long> &s, size_t i,
                                size_t j, vector<Expr *> operands) {
   if (i == j) {
     cout << " ";
-    Operand *operand = nullptr;
-    if (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(operands[i - 1]))
-      operand = llvm::dyn_cast_or_null<Operand>(unaryOp->getChild());
-    else
-      operand = llvm::dyn_cast_or_null<Operand>(operands[i - 1]);
+    Expr *leaf = operands[i - 1];
+    while (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(leaf))
+      leaf = unaryOp->getChild();
+    Operand *operand = llvm::dyn_cast_or_null<Operand>(leaf);
     assert(operand && "must be non null");
     if (llvm::isa<UnaryOp>(operands[i - 1]))
       cout << "u(" << operand->getName() << ")";
@@ -212,8 +256,8 @@ static void printOptimalParens(const vector<vector<long>> &s, size_t i,
     cout << "  ";
   } else {
     cout << "(";
-    printOptimalParens(s, i, s[i][j], operands);
-    printOptimalParens(s, s[i][j] + 1, j, operands);
+    printOptimalParens(s, i, s(i, j), operands);
+    printOptimalParens(s, s(i, j) + 1, j, operands);
     cout << ")";
   }
 }
@@ -232,87 +276,536 @@ static void collectOperandsImpl(Expr *node, vector<Expr *> &operands) {
   }
 }
 
-static vector<Expr *> collectOperands(Expr *expr) {
+vector<Expr *> details::collectOperands(Expr *expr) {
+  STATS_PHASE(COLLECT_OPERANDS);
   vector<Expr *> operands;
-  collectOperandsImpl(expr, operands);
+  collectOperandsImpl(expr->getNormalForm(), operands);
   return operands;
 }
 
+ResultMCP::ResultMCP(size_t n)
+    : m(n, std::numeric_limits<long>::max()),
+      s(n, std::numeric_limits<long>::max()), tree(nullptr) {}
+
+/// Shape and properties of a sub-chain. This is all we need to price a
+/// product, so the DP does not have to build candidate expressions.
+struct ChainSummary {
+  long rows;
+  long cols;
+  unsigned properties;
+  /// The sub-chain is a leaf with an inverse: a product solves with it when
+  /// it is on the left, and computes it explicitly otherwise.
+  bool inverse;
+};
+
+static bool hasInverse(Expr *leaf) {
+  auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(leaf);
+  if (!unaryOp)
+    return false;
+  return unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE ||
+         hasInverse(unaryOp->getChild());
+}
+
+static unsigned getLeafProperties(Expr *leaf) {
+  unsigned properties = 0;
+  if (leaf->isLowerTriangular())
+    properties |= Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR);
+  if (leaf->isUpperTriangular())
+    properties |= Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  if (leaf->isSymmetric())
+    properties |= Expr::getMask(Expr::ExprProperty::SYMMETRIC);
+  // only tells the solves apart.
+  if (leaf->isSPD())
+    properties |= Expr::getMask(Expr::ExprProperty::SPD);
+  return properties;
+}
+
+/// Summary of the product lhs * rhs. `isSymmetric` is true if lhs is the
+/// transpose of rhs, or if the leaves of the product are mirrored.
+static ChainSummary getProductSummary(const ChainSummary &lhs,
+                                      const ChainSummary &rhs,
+                                      bool isSymmetric) {
+  // the product of two upper (lower) triangular matrices is upper (lower)
+  // triangular.
+  unsigned triangular =
+      Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR) |
+      Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  ChainSummary summary = {lhs.rows, rhs.cols,
+                          lhs.properties & rhs.properties & triangular, false};
+  // a symmetric lhs is multiplied with SYMM, which only saves reading half
+  // of it: the flop count prices it as GEMM.
+  if (isSymmetric)
+    summary.properties |= Expr::getMask(Expr::ExprProperty::SYMMETRIC);
+  return summary;
+}
+
+/// Kernel for lhs * rhs, same rules as getKernelCostImpl. An inverse on the
+/// left is solved with, after the properties of the leaf, which are the
+/// ones of the matrix it inverts.
+static KernelKind getKernelKind(const ChainSummary &lhs) {
+  const unsigned lower = Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR);
+  const unsigned upper = Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  if (lhs.inverse) {
+    if (lhs.properties & (lower | upper))
+      return KernelKind::TRSM;
+    if (lhs.properties & Expr::getMask(Expr::ExprProperty::SPD))
+      return KernelKind::POSV;
+    return KernelKind::GESV;
+  }
+  if (lhs.properties & (lower | upper))
+    return KernelKind::TRMM;
+  if (lhs.properties & Expr::getMask(Expr::ExprProperty::SYMMETRIC))
+    return KernelKind::SYMM;
+  return KernelKind::GEMM;
+}
+
+/// Cost of multiplying by the n x n inverse `leaf` once it is computed
+/// explicitly: the solve on the identity, zero if it is not an inverse.
+static long getInverseCost(const CostModel &model, const ChainSummary &leaf) {
+  if (!leaf.inverse)
+    return 0;
+  return model.getCost(getKernelKind(leaf), leaf.rows, leaf.rows, leaf.rows);
+}
+
+/// Cost of lhs * rhs in `model`, for rhs with `cols` columns, and without
+/// the explicit inverse of rhs.
+static long getProductCost(const CostModel &model, const ChainSummary &lhs,
+                           long cols) {
+  return model.getCost(getKernelKind(lhs), lhs.rows, lhs.cols, cols);
+}
+
+/// Cost of lhs * lhs^T in `model`.
+static long getSyrkCost(const CostModel &model, const ChainSummary &lhs) {
+  return model.getCost(KernelKind::SYRK, lhs.rows, lhs.cols, lhs.rows);
+}
+
+/// Cost of lhs * rhs in `model`.
+static long getKernelCost(const CostModel &model, const ChainSummary &lhs,
+                          const ChainSummary &rhs) {
+  return getProductCost(model, lhs, rhs.cols) + getInverseCost(model, rhs);
+}
+
+/// Summary of the leaf `expr`. A null leaf stands for `product`, a shared
+/// product of runMCPShared priced before its operand is created.
+static ChainSummary getLeafSummary(Expr *leaf,
+                                   const ChainSummary *product = nullptr) {
+  if (!leaf) {
+    assert(product && "expect the summary of the null leaves");
+    return *product;
+  }
+  auto shape = getLeafShape(leaf);
+  return {shape.first, shape.second, getLeafProperties(leaf),
+          hasInverse(leaf)};
+}
+
+// TODO: n-ary how to handle? Do we need to?
+/// Summary of the binary tree `node`, with the flop count of its products
+/// added to `cost` (or only the one of the top product if !fullTree). A
+/// product of a subtree by its transpose is a SYRK, which only computes the
+/// left one.
+static ChainSummary getKernelCostImpl(Expr *node, long &cost,
+                                      bool fullTree) {
+  auto binaryOp = llvm::dyn_cast<NaryOp>(node);
+  if (!binaryOp)
+    return getLeafSummary(node);
+  auto children = binaryOp->getChildren();
+  assert(children.size() == 2 && "expect only two children");
+  bool isSyrk = trans(children[0])->getNormalForm() ==
+                children[1]->getNormalForm();
+  ChainSummary left = getKernelCostImpl(children[0], cost, fullTree);
+  ChainSummary right = {left.cols, left.rows, 0, false};
+  long currentCost;
+  if (isSyrk) {
+    currentCost = getSyrkCost(FlopModel::get(), left);
+  } else {
+    right = getKernelCostImpl(children[1], cost, fullTree);
+    currentCost = getKernelCost(FlopModel::get(), left, right);
+  }
+  if (fullTree)
+    cost += currentCost;
+  else
+    cost = currentCost;
+  return getProductSummary(left, right, isSyrk);
+}
+
+void getKernelCostFullExpr(Expr *node, long &cost) {
+  (void)getKernelCostImpl(node, cost, true);
+}
+
+void getKernelCostTopLevelExpr(Expr *node, long &cost) {
+  (void)getKernelCostImpl(node, cost, false);
+}
+
+static const CostModel &getCostModel(const MCPOptions &options) {
+  if (options.costModel)
+    return *options.costModel;
+  return FlopModel::get();
+}
+
+/// Materialize the optimal parenthesization for the sub-chain i..j.
+static Expr *buildOptimalTree(const TriangularTable<long> &s, size_t i,
+                              size_t j, const vector<Expr *> &operands) {
+  if (i == j)
+    return operands[i - 1];
+  return binaryMul({buildOptimalTree(s, i, s(i, j), operands),
+                    buildOptimalTree(s, s(i, j) + 1, j, operands)},
+                   true);
+}
+
 #if DEBUG
-static void print(vector<vector<Expr *>> &tmps, bool bitLayout = false) {
-  int rows = tmps.size();
-  int cols = tmps[0].size();
-
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      if (tmps[i][j]) {
-        if (bitLayout)
-          cout << "1 ";
-        else
-          walk(tmps[i][j]);
-      } else {
-        if (bitLayout)
-          cout << "0 ";
-      }
+static void print(const TriangularTable<long> &table) {
+  for (size_t i = 1; i <= table.size(); i++) {
+    for (size_t j = 1; j <= table.size(); j++) {
+      if (j < i || table(i, j) == std::numeric_limits<long>::max())
+        cout << "- ";
+      else
+        cout << table(i, j) << " ";
     }
     cout << "\n";
   }
 }
 #endif
 
-// TODO: n-ary how to handle? Do we need to?
-pair<long, long> getKernelCostImpl(Expr *node, long &cost, bool fullTree) {
-  if (node) {
-    if (auto binaryOp = llvm::dyn_cast_or_null<NaryOp>(node)) {
-      auto children = binaryOp->getChildren();
-      // walk(node);
-      assert(children.size() == 2 && "expect only two children");
-      pair<long, long> left = getKernelCostImpl(children[0], cost, fullTree);
-      pair<long, long> right = getKernelCostImpl(children[1], cost, fullTree);
-      // note this cost must be the cost of the top level expr
-      // not the cost of the tree.
-      // GEMM by default adjust later on.
-      auto currentCost = left.first * left.second * right.second * 2;
-      // TRMM TODO: must be square the other?
-      if (children[0]->isLowerTriangular())
-        currentCost >>= 1;
-      // SYMM TODO: must be square the other?
-      else if (children[0]->isSymmetric())
-        currentCost >>= 1;
-
-      if (fullTree)
-        cost += currentCost;
-      else
-        cost = currentCost;
+/// DP tables of runMCP.
+struct MCPTables {
+  TriangularTable<long> &m;
+  TriangularTable<long> &s;
+  // operand i is pVector[i - 1] x pVector[i].
+  const vector<long> &pVector;
+  const CostModel &costModel;
+  // column-major copy of m: the split loop walks row i and column j.
+  TriangularTable<long, true> mColumns;
+  // shape and properties of each sub-chain.
+  TriangularTable<ChainSummary> summaries;
+  // see getMirrorRadius.
+  vector<size_t> mirrorRadius;
+  // some mirrorRadius is not zero.
+  bool hasMirrors;
+};
+
+/// mirrorRadius[c], for the gap between the leaves c and c + 1 (1-based), is
+/// the largest r such that leaf c - t is the transpose of leaf c + 1 + t for
+/// every t < r: the leaves around the gap read the same transposed.
+static void getMirrorRadius(const vector<Expr *> &operands,
+                            vector<size_t> &mirrorRadius) {
+  const size_t n = operands.size();
+  mirrorRadius.assign(n + 1, 0);
+  for (size_t c = 1; c < n; c++) {
+    size_t r = 0;
+    while (r < c && c + r < n && operands[c - 1 - r] &&
+           operands[c - 1 - r]->isTransposeOf(operands[c + r]))
+      r++;
+    mirrorRadius[c] = r;
+  }
+}
+
+/// Set the mirror fields of the tables for the leaves `operands`.
+static void setMirrors(MCPTables &tables, const vector<Expr *> &operands) {
+  getMirrorRadius(operands, tables.mirrorRadius);
+  tables.hasMirrors =
+      std::any_of(tables.mirrorRadius.begin(), tables.mirrorRadius.end(),
+                  [](size_t radius) { return radius > 0; });
+}
 
-      return {left.first, right.second};
+/// Whether the leaves i..j are mirrored (see details::isMirrored), in O(1).
+static bool isMirroredCell(const MCPTables &tables, size_t i, size_t j) {
+  return (j - i) % 2 &&
+         tables.mirrorRadius[(i + j - 1) / 2] >= (j - i + 1) / 2;
+}
+
+/// Whether the split k of i..j is a SYRK: i..j is mirrored and k is its
+/// middle, the right side is then the transpose of the left one and is not
+/// computed.
+static bool isSyrkSplit(const MCPTables &tables, size_t i, size_t k,
+                        size_t j) {
+  return k == (i + j - 1) / 2 && isMirroredCell(tables, i, j);
+}
+
+/// Solve the sub-chain i..j, all the shorter ones must be solved already.
+static void solveCell(MCPTables &tables, size_t i, size_t j) {
+  // the summary does not depend on the split.
+  const bool isMirrored = isMirroredCell(tables, i, j);
+  tables.summaries(i, j) = getProductSummary(
+      tables.summaries(i, i), tables.summaries(i + 1, j), isMirrored);
+  const long *left = tables.m.getRow(i);
+  const long *right = tables.mColumns.getColumn(j);
+  const ChainSummary *leftSummaries = tables.summaries.getRow(i);
+  // the kernels only look at the columns of the right-hand side, which do
+  // not depend on the split. The last split multiplies by leaf j, which
+  // then has to be inverted explicitly if it is an inverse.
+  const long cols = tables.pVector[j];
+  const CostModel &model = tables.costModel;
+  const long inverse = getInverseCost(model, tables.summaries(j, j));
+  const size_t end = inverse ? j - 1 : j;
+  // a mirrored i..j is computed from its left half alone, with SYRK.
+  const size_t middle = isMirrored ? (i + j - 1) / 2 : 0;
+  long best = std::numeric_limits<long>::max();
+  size_t split = 0;
+  auto trySplit = [&](size_t k, long extra) {
+    long q = k == middle
+                 ? left[k - i] + getSyrkCost(model, leftSummaries[k - i])
+                 : left[k - i] + right[k] +
+                       getProductCost(model, leftSummaries[k - i], cols) +
+                       extra;
+    if (q < best) {
+      best = q;
+      split = k;
     }
-    if (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(node)) {
-      return getKernelCostImpl(unaryOp->getChild(), cost, fullTree);
+  };
+  // left[t] is m(i, i + t), right[t] is m(t + 1, j). With the flop count,
+  // splits whose left sub-chain is triangular get a discounted kernel, they
+  // all come first since the product of i..k only loses properties as k
+  // grows (a solve with leaf i is the first split). Mirrored leaves make
+  // SYRK splits anywhere: the chain then prices every split here, as the
+  // other models do.
+  const unsigned triangular =
+      Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR) |
+      Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  const bool isFlopCount = model.isFlopCount() && !tables.hasMirrors;
+  size_t k = i;
+  for (; k < end && (!isFlopCount || k == i ||
+                     (leftSummaries[k - i].properties & triangular));
+       k++)
+    trySplit(k, 0);
+  // the remaining splits all cost 2 * p[i - 1] * p[k] * p[j].
+  if (k < end) {
+    long rest;
+    size_t t = findMinSplit(left + (k - i), right + k, &tables.pVector[k],
+                            2 * tables.pVector[i - 1] * tables.pVector[j],
+                            end - k, rest);
+    if (rest < best) {
+      best = rest;
+      split = k + t;
     }
-    if (auto operand = llvm::dyn_cast_or_null<Operand>(node)) {
-      auto shape = operand->getShape();
-      assert(shape.size() == 2 && "must be 2d");
-      return {shape[0], shape[1]};
+  }
+  if (inverse)
+    trySplit(j - 1, inverse);
+  tables.m(i, j) = best;
+  tables.mColumns(i, j) = best;
+  tables.s(i, j) = split;
+}
+
+/// Solve the diagonals one after the other, splitting the cells of each
+/// diagonal across the pool. Every cell is solved exactly as in the serial
+/// loop, so the tables are identical.
+static void solveWavefront(MCPTables &tables, size_t n, unsigned numThreads) {
+  ThreadPool pool(numThreads);
+  // below this many split evaluations a diagonal is not worth distributing.
+  const size_t minWork = 1 << 14;
+  for (size_t l = 2; l <= n; l++) {
+    size_t cells = n - l + 1;
+    auto body = [&tables, l](size_t first, size_t last) {
+      for (size_t i = first; i < last; i++)
+        solveCell(tables, i, i + l - 1);
+    };
+    if (cells * (l - 1) < minWork) {
+      body(1, cells + 1);
+      continue;
     }
+    // a few chunks per thread so that idle threads have something to steal.
+    size_t grain = std::max<size_t>(1, cells / (4 * numThreads));
+    pool.parallelFor(1, cells + 1, grain, body);
   }
-  return {0, 0};
 }
 
-void getKernelCostFullExpr(Expr *node, long &cost) {
-  (void)getKernelCostImpl(node, cost, true);
+/// Fill the tables along the optimal parenthesization only.
+static void solveTreeCells(MCPTables &tables, size_t i, size_t j) {
+  if (i == j)
+    return;
+  size_t k = tables.s(i, j);
+  solveTreeCells(tables, i, k);
+  solveTreeCells(tables, k + 1, j);
+  tables.summaries(i, j) =
+      getProductSummary(tables.summaries(i, k), tables.summaries(k + 1, j),
+                        isMirroredCell(tables, i, j));
+  if (isSyrkSplit(tables, i, k, j))
+    tables.m(i, j) =
+        tables.m(i, k) + getSyrkCost(tables.costModel, tables.summaries(i, k));
+  else
+    tables.m(i, j) = tables.m(i, k) + tables.m(k + 1, j) +
+                     getKernelCost(tables.costModel, tables.summaries(i, k),
+                                   tables.summaries(k + 1, j));
 }
 
-void getKernelCostTopLevelExpr(Expr *node, long &cost) {
-  (void)getKernelCostImpl(node, cost, false);
+/// True if every product of the chain is priced as a plain GEMM flop count,
+/// which is what the Hu-Shing engine assumes. Null leaves are `product`
+/// (see getLeafSummary).
+static bool hasPlainCosts(const vector<Expr *> &operands,
+                          const MCPOptions &options,
+                          const ChainSummary *product = nullptr) {
+  if (!getCostModel(options).isFlopCount())
+    return false;
+  const unsigned discounted =
+      Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR) |
+      Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  for (size_t i = 0, e = operands.size(); i < e; i++) {
+    ChainSummary leaf = getLeafSummary(operands[i], product);
+    if ((leaf.properties & discounted) || leaf.inverse)
+      return false;
+    if (i + 1 < e && operands[i] &&
+        operands[i]->isTransposeOf(operands[i + 1]))
+      return false;
+  }
+  return true;
 }
 
-struct ResultMCP {
-  vector<vector<long>> m;
-  vector<vector<long>> s;
-};
+/// Chin's O(n) approximate ordering, Hu and Shing showed that its cost is
+/// at most 2 / sqrt(3) times the optimum (about 15.5% more). Same polygon
+/// view as hushing.cpp: rotate so that V0 is the lightest vertex and sweep
+/// the others with a stack. The top Vc, between Va below it and the incoming
+/// Vb, is cut off with the triangle Va Vc Vb as soon as the arc Va Vb beats
+/// the arc V0 Vc in the quadrilateral V0 Va Vc Vb; whatever is left on the
+/// stack is fanned from V0. Fills the splits if `s` is given and returns
+/// the cost.
+static long runChin(const vector<long> &pVector, TriangularTable<long> *s) {
+  const size_t size = pVector.size();
+  const size_t rotation =
+      std::min_element(pVector.begin(), pVector.end()) - pVector.begin();
+  auto getWeight = [&](size_t position) {
+    return pVector[(position + rotation) % size];
+  };
+  long cost = 0;
+  auto addTriangle = [&](size_t a, size_t b, size_t c) {
+    cost += getWeight(a) * getWeight(b) * getWeight(c);
+    if (!s)
+      return;
+    size_t vertices[] = {(a + rotation) % size, (b + rotation) % size,
+                         (c + rotation) % size};
+    std::sort(vertices, vertices + 3);
+    // the triangle under the side (x, z) of the sub-chain x + 1 .. z.
+    (*s)(vertices[0] + 1, vertices[2]) = vertices[1];
+  };
 
-ResultMCP runMCP(Expr *expr) {
+  const long lightest = getWeight(0);
+  vector<size_t> stack = {0, 1};
+  for (size_t b = 2; b < size; b++) {
+    const long wb = getWeight(b);
+    while (stack.size() >= 2) {
+      size_t c = stack.back();
+      size_t a = stack[stack.size() - 2];
+      const long wa = getWeight(a);
+      const long wc = getWeight(c);
+      // Va Vc Vb + V0 Va Vb < V0 Va Vc + V0 Vc Vb.
+      if (wa * wb * (wc + lightest) >= lightest * wc * (wa + wb))
+        break;
+      addTriangle(a, c, b);
+      stack.pop_back();
+    }
+    stack.push_back(b);
+  }
+  for (size_t t = 1; t + 1 < stack.size(); t++)
+    addTriangle(0, stack[t], stack[t + 1]);
+  return cost * 2;
+}
+
+/// Size the tables for the chain and set the leaves, null ones to `product`.
+/// The tables are reset in place, so solving many chains with one MCPTables
+/// reuses its memory.
+static void initTables(MCPTables &tables, const vector<Expr *> &operands,
+                       const ChainSummary *product = nullptr) {
+  const size_t n = operands.size();
+  const vector<long> &pVector = tables.pVector;
+  tables.m.reset(n, std::numeric_limits<long>::max());
+  tables.s.reset(n, std::numeric_limits<long>::max());
+  tables.mColumns.reset(n, 0);
+  tables.summaries.reset(n, ChainSummary());
+  for (size_t i = 1; i <= n; i++) {
+    ChainSummary leaf = getLeafSummary(operands[i - 1], product);
+    tables.summaries(i, i) = {pVector[i - 1], pVector[i], leaf.properties,
+                              leaf.inverse};
+    tables.m(i, i) = 0;
+  }
+  setMirrors(tables, operands);
+}
+
+/// Solve the tables with the engine of `options`.
+static void solveTables(MCPTables &tables, const vector<Expr *> &operands,
+                        const MCPOptions &options,
+                        const ChainSummary *product = nullptr) {
+  STATS_PHASE(SOLVE);
+  const size_t n = operands.size();
+  const bool isPlain = hasPlainCosts(operands, options, product);
+  if (options.engine == MCPEngine::HU_SHING && isPlain) {
+    // the engine only yields the optimal splits, the other cells are unset.
+    runHuShing(tables.pVector, &tables.s);
+    solveTreeCells(tables, 1, n);
+    STATS_ADD(DP_CELLS, n - 1);
+    return;
+  }
+  if (options.engine == MCPEngine::APPROXIMATE && isPlain) {
+    // as above, but the cells describe the approximate tree.
+    runChin(tables.pVector, &tables.s);
+    solveTreeCells(tables, 1, n);
+    STATS_ADD(DP_CELLS, n - 1);
+    return;
+  }
+  // every sub-chain, and every split of each.
+  STATS_ADD(DP_CELLS, n * (n - 1) / 2);
+  STATS_ADD(SPLITS_EVALUATED, (n - 1) * n * (n + 1) / 6);
+  if (options.numThreads > 1) {
+    solveWavefront(tables, n, options.numThreads);
+  } else {
+    for (size_t l = 2; l <= n; l++)
+      for (size_t i = 1; i <= n - l + 1; i++)
+        solveCell(tables, i, i + l - 1);
+  }
+}
+
+/// Fill the cost and split tables of the chain, null leaves are `product`.
+static ResultMCP solveChain(const vector<Expr *> &operands,
+                            const vector<long> &pVector,
+                            const MCPOptions &options,
+                            const ChainSummary *product = nullptr) {
+  ResultMCP result;
+  MCPTables tables = {result.getCosts(), result.getSplits(), pVector,
+                      getCostModel(options)};
+  initTables(tables, operands, product);
+  solveTables(tables, operands, options, product);
+  return result;
+}
+
+/// Everything the solution of the chain depends on, see PlanCache. Null
+/// leaves are `product`, as an operand with its properties would be.
+static PlanCache::Signature getSignature(const vector<Expr *> &operands,
+                                         const vector<long> &pVector,
+                                         const MCPOptions &options,
+                                         const ChainSummary *product) {
+  PlanCache::Signature signature(pVector);
+  signature.reserve(pVector.size() + operands.size() + 2);
+  signature.push_back(static_cast<long>(options.engine));
+  signature.push_back(static_cast<long>(getCostModel(options).getHash()));
+  vector<size_t> mirrorRadius;
+  getMirrorRadius(operands, mirrorRadius);
+  for (size_t i = 0, e = operands.size(); i < e; i++) {
+    ChainSummary leaf = getLeafSummary(operands[i], product);
+    long word = leaf.properties;
+    if (auto unaryOp = llvm::dyn_cast_or_null<UnaryOp>(operands[i]))
+      word |= (1 + static_cast<long>(unaryOp->getKind())) << 8;
+    if (leaf.inverse)
+      word |= 1l << 12;
+    word |= static_cast<long>(mirrorRadius[i + 1]) << 16;
+    signature.push_back(word);
+  }
+  return signature;
+}
+
+/// Solution from the cache of `options`, solve the chain on a miss. Null
+/// leaves are `product`.
+static std::shared_ptr<const ResultMCP>
+getCachedPlan(const vector<Expr *> &operands, const vector<long> &pVector,
+              const MCPOptions &options,
+              const ChainSummary *product = nullptr) {
+  PlanCache::Signature signature =
+      getSignature(operands, pVector, options, product);
+  if (auto plan = options.cache->lookup(signature))
+    return plan;
+  auto plan = std::make_shared<const ResultMCP>(
+      solveChain(operands, pVector, options, product));
+  options.cache->insert(signature, plan);
+  return plan;
+}
+
+ResultMCP runMCP(Expr *expr, const MCPOptions &options) {
 #if DEBUG
   cout << "Starting point\n";
   walk(expr);
@@ -320,93 +813,758 @@ ResultMCP runMCP(Expr *expr) {
 #endif
   vector<Expr *> operands = collectOperands(expr);
   vector<long> pVector = getPVector(operands);
-  const size_t n = pVector.size();
-  vector<vector<long>> m(n, vector<long>(n, std::numeric_limits<long>::max()));
-  vector<vector<long>> s(n, vector<long>(n, std::numeric_limits<long>::max()));
-
-  // store symbolic temporary variables representing sub-chains.
-  vector<vector<Expr *>> tmps(n, vector<Expr *>(n, nullptr));
-
-  for (size_t i = 0; i < n - 1; i++)
-    tmps[i + 1][i + 1] = operands.at(i);
+  const size_t n = operands.size();
+  ResultMCP result = options.cache ? *getCachedPlan(operands, pVector, options)
+                                   : solveChain(operands, pVector, options);
+  const TriangularTable<long> &s = result.getSplits();
+  Expr *tree;
+  {
+    STATS_PHASE(BUILD_TREE);
+    tree = buildOptimalTree(s, 1, n, operands);
+  }
+  result.setOptimalTree(tree);
 
 #if DEBUG
-  cout << "\n\n-before-tmps-\n";
-  print(tmps, true);
+  cout << "\n\n-optimal-tree-\n";
+  walk(tree);
+  cout << "\n\n-----s------\n";
+  print(s);
+  cout << "\n-----m------\n";
+  print(result.getCosts());
+  cout << "\n";
+  printOptimalParens(s, 1, operands.size(), operands);
+  cout << "\n\n";
 #endif
+  return result;
+}
 
-  for (size_t i = 0; i < n; i++)
-    m[i][i] = 0;
+/// Flops of the products of the chain of `operands` along the splits
+/// `splits`, whichever cost model chose them.
+static long getPlanFlops(const vector<Expr *> &operands,
+                         const vector<long> &pVector,
+                         const TriangularTable<long> &splits) {
+  TriangularTable<long> m, s;
+  MCPTables tables = {m, s, pVector, FlopModel::get()};
+  initTables(tables, operands);
+  s = splits;
+  solveTreeCells(tables, 1, operands.size());
+  return m(1, operands.size());
+}
 
-  size_t j = 0;
-  long q = 0;
-  for (size_t l = 2; l < n; l++) {
-    for (size_t i = 1; i < n - l + 1; i++) {
-      j = i + l - 1;
-      m[i][j] = std::numeric_limits<long>::max();
-      for (size_t k = i; k <= j - 1; k++) {
+long getPlanFlops(Expr *expr, const ResultMCP &plan) {
+  vector<Expr *> operands = collectOperands(expr);
+  return getPlanFlops(operands, getPVector(operands), plan.getSplits());
+}
 
-        auto tmpexpr = binaryMul({tmps[i][k], tmps[k + 1][j]}, true);
+long getMCPFlops(Expr *expr, const MCPOptions &options) {
+  if (options.engine != MCPEngine::DYNAMIC_PROGRAMMING) {
+    vector<Expr *> operands = collectOperands(expr);
+    if (hasPlainCosts(operands, options)) {
+      STATS_PHASE(SOLVE);
+      if (options.engine == MCPEngine::HU_SHING)
+        return runHuShing(getPVector(operands), nullptr);
+      return runChin(getPVector(operands), nullptr);
+    }
+  }
+  // other models price the plan in their own unit.
+  const bool isFlopCount = getCostModel(options).isFlopCount();
+  if (options.cache) {
+    // skip the tree.
+    vector<Expr *> operands = collectOperands(expr);
+    vector<long> pVector = getPVector(operands);
+    auto plan = getCachedPlan(operands, pVector, options);
+    if (isFlopCount)
+      return plan->getOptimalCost();
+    return getPlanFlops(operands, pVector, plan->getSplits());
+  }
+  ResultMCP result = runMCP(expr, options);
+  long flops = isFlopCount ? result.getOptimalCost()
+                           : getPlanFlops(expr, result);
 #if DEBUG
-        cout << "---\n";
-        walk(tmpexpr);
-        cout << "\n---\n\n";
+  cout << "FLOPS: " << flops << "\n";
 #endif
-        long cost = 0;
-        getKernelCostTopLevelExpr(tmpexpr, cost);
-        q = m[i][k] + m[k + 1][j] + cost;
-        if (q < m[i][j]) {
-          tmps[i][j] = binaryMul({tmps[i][k], tmps[k + 1][j]}, true);
-          tmps[i][j]->inferProperties();
-          m[i][j] = q;
-          s[i][j] = k;
+  return flops;
+}
+
+/// A plan of a sub-chain on its (cost, peak bytes) frontier: the split and
+/// the frontier points of the two sides.
+struct ParetoPoint {
+  long cost;
+  long peakBytes;
+  size_t split;
+  size_t left;
+  size_t right;
+};
+
+/// Keep the points no other point beats on both coordinates, by increasing
+/// cost.
+static void prune(vector<ParetoPoint> &points) {
+  std::sort(points.begin(), points.end(),
+            [](const ParetoPoint &a, const ParetoPoint &b) {
+              return a.cost < b.cost ||
+                     (a.cost == b.cost && a.peakBytes < b.peakBytes);
+            });
+  size_t kept = 0;
+  for (const auto &point : points)
+    if (!kept || point.peakBytes < points[kept - 1].peakBytes)
+      points[kept++] = point;
+  points.resize(kept);
+}
+
+/// Set the cells of `result` along the plan of `point` for i..j, whose
+/// sides are plans in `cells`: point.left in the list cells(i, k) and
+/// point.right in cells(k + 1, j).
+template <class Cells, class Point>
+static void fillPlan(const Cells &cells, const Point &point, size_t i,
+                     size_t j, ResultMCP &result) {
+  result.getCosts()(i, j) = point.cost;
+  if (i == j)
+    return;
+  size_t k = point.split;
+  result.getSplits()(i, j) = k;
+  fillPlan(cells, cells(i, k)[point.left], i, k, result);
+  fillPlan(cells, cells(k + 1, j)[point.right], k + 1, j, result);
+}
+
+/// Set the summaries of every sub-chain, as the DP computes them, without
+/// solving it.
+static void fillSummaries(MCPTables &tables, size_t n) {
+  for (size_t l = 2; l <= n; l++)
+    for (size_t i = 1; i <= n - l + 1; i++) {
+      size_t j = i + l - 1;
+      tables.summaries(i, j) = getProductSummary(
+          tables.summaries(i, i), tables.summaries(i + 1, j),
+          isMirroredCell(tables, i, j));
+    }
+}
+
+/// Cost of the product at the split k of i..j alone. A SYRK does not
+/// compute its right side.
+static long getSplitCost(const MCPTables &tables, size_t i, size_t k,
+                         size_t j) {
+  if (isSyrkSplit(tables, i, k, j))
+    return getSyrkCost(tables.costModel, tables.summaries(i, k));
+  return getKernelCost(tables.costModel, tables.summaries(i, k),
+                       tables.summaries(k + 1, j));
+}
+
+vector<ParetoPlan> runMCPPareto(Expr *expr, const MCPOptions &options) {
+  vector<Expr *> operands = collectOperands(expr);
+  vector<long> pVector = getPVector(operands);
+  const size_t n = operands.size();
+  TriangularTable<long> m, s;
+  MCPTables tables = {m, s, pVector, getCostModel(options)};
+  initTables(tables, operands);
+  fillSummaries(tables, n);
+  // bytes of the product of i..j; leaves and the output do not count.
+  auto getBytes = [&](size_t i, size_t j) -> long {
+    if (i == j || (i == 1 && j == n))
+      return 0;
+    return pVector[i - 1] * pVector[j] * long(sizeof(double));
+  };
+
+  TriangularTable<vector<ParetoPoint>> frontiers(n, {});
+  for (size_t i = 1; i <= n; i++)
+    frontiers(i, i) = {{0, 0, 0, 0, 0}};
+  STATS_ADD(DP_CELLS, n * (n - 1) / 2);
+  for (size_t l = 2; l <= n; l++)
+    for (size_t i = 1; i <= n - l + 1; i++) {
+      size_t j = i + l - 1;
+      vector<ParetoPoint> points;
+      for (size_t k = i; k < j; k++) {
+        // a SYRK does not compute its right side: take any of its plans
+        // (the first) for the tree, at no cost.
+        const bool isSyrk = isSyrkSplit(tables, i, k, j);
+        long kernel = getSplitCost(tables, i, k, j);
+        long leftBytes = getBytes(i, k);
+        long rightBytes = isSyrk ? 0 : getBytes(k + 1, j);
+        long bytes = leftBytes + rightBytes + getBytes(i, j);
+        const auto &lefts = frontiers(i, k), &rights = frontiers(k + 1, j);
+        const size_t numRights = isSyrk ? 1 : rights.size();
+        for (size_t a = 0; a < lefts.size(); a++)
+          for (size_t b = 0; b < numRights; b++) {
+            long rightCost = isSyrk ? 0 : rights[b].cost;
+            long rightPeak = isSyrk ? 0 : rights[b].peakBytes;
+            // the left side is computed first and kept while the right
+            // side and then i..j are computed.
+            long peakBytes =
+                std::max({lefts[a].peakBytes, leftBytes + rightPeak, bytes});
+            points.push_back(
+                {lefts[a].cost + rightCost + kernel, peakBytes, k, a, b});
+          }
+      }
+      prune(points);
+      frontiers(i, j) = std::move(points);
+    }
+
+  vector<ParetoPlan> plans;
+  for (const auto &point : frontiers(1, n)) {
+    ResultMCP result(n);
+    fillPlan(frontiers, point, 1, n, result);
+    result.setOptimalTree(buildOptimalTree(result.getSplits(), 1, n,
+                                           operands));
+    plans.push_back({point.cost, point.peakBytes, std::move(result)});
+  }
+  return plans;
+}
+
+/// A plan of a sub-chain among its k cheapest: the split and the ranks of
+/// the plans of the two sides. Packed in 16 bytes, the tables hold k points
+/// per cell.
+struct RankedPoint {
+  long cost;
+  uint32_t split;
+  uint16_t left;
+  uint16_t right;
+};
+
+/// Ranking of the plans: by cost, ties by split then ranks of the sides.
+static bool operator<(const RankedPoint &a, const RankedPoint &b) {
+  if (a.cost != b.cost)
+    return a.cost < b.cost;
+  if (a.split != b.split)
+    return a.split < b.split;
+  if (a.left != b.left)
+    return a.left < b.left;
+  return a.right < b.right;
+}
+
+/// The `count` cheapest plans of every sub-chain, cheapest first, packed in
+/// one allocation. cells(i, j)[r] is the plan of rank r of i..j.
+class RankedCells {
+public:
+  RankedCells(size_t n, size_t count)
+      : n(n), count(count), points(n * (n + 1) / 2 * count),
+        sizes(n * (n + 1) / 2, 0) {}
+  RankedPoint *operator()(size_t i, size_t j) {
+    return &points[getOffset(i, j) * count];
+  }
+  const RankedPoint *operator()(size_t i, size_t j) const {
+    return &points[getOffset(i, j) * count];
+  }
+  size_t &size(size_t i, size_t j) { return sizes[getOffset(i, j)]; }
+
+private:
+  size_t getOffset(size_t i, size_t j) const {
+    return TriangularTable<long>::getOffset(n, i, j);
+  }
+
+  size_t n;
+  size_t count;
+  vector<RankedPoint> points;
+  vector<size_t> sizes;
+};
+
+vector<RankedPlan> runMCPTopK(Expr *expr, size_t count,
+                              const MCPOptions &options) {
+  assert(count > 0 && "expect at least one plan");
+  assert(count <= 65536 && "the ranks of the sides are 16 bits");
+  count = std::min<size_t>(count, 65536);
+  if (count == 1) {
+    ResultMCP plan = runMCP(expr, options);
+    long cost = plan.getOptimalCost();
+    vector<RankedPlan> plans;
+    plans.push_back({cost, std::move(plan)});
+    return plans;
+  }
+  vector<Expr *> operands = collectOperands(expr);
+  vector<long> pVector = getPVector(operands);
+  const size_t n = operands.size();
+  ResultMCP best;
+  MCPTables tables = {best.getCosts(), best.getSplits(), pVector,
+                      getCostModel(options)};
+  initTables(tables, operands);
+  fillSummaries(tables, n);
+
+  RankedCells ranked(n, count);
+  for (size_t i = 1; i <= n; i++) {
+    ranked(i, i)[0] = {0, 0, 0, 0};
+    ranked.size(i, i) = 1;
+  }
+  STATS_ADD(DP_CELLS, n * (n - 1) / 2);
+  // per split of the current cell: its kernel and its cheapest plan.
+  vector<long> kernels, bounds;
+  // splits of the current cell that may make the list.
+  vector<size_t> splits;
+  const unsigned triangular =
+      Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR) |
+      Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  const bool isFlopCount =
+      tables.costModel.isFlopCount() && !tables.hasMirrors;
+  for (size_t l = 2; l <= n; l++)
+    for (size_t i = 1; i <= n - l + 1; i++) {
+      size_t j = i + l - 1;
+      // the cheapest plans of the sides are in m, as in solveCell.
+      const long *left = tables.m.getRow(i);
+      const long *right = tables.mColumns.getColumn(j);
+      const ChainSummary *leftSummaries = tables.summaries.getRow(i);
+      // the best plans found so far, sorted, in place.
+      RankedPoint *best = ranked(i, j);
+      size_t &size = ranked.size(i, j);
+      // whether `point` is among the `count` best plans found so far.
+      auto isCandidate = [&](const RankedPoint &point) {
+        return size < count || point < best[size - 1];
+      };
+      // whether a split whose cheapest plan costs `bound` may add one.
+      auto isCandidateSplit = [&](long bound) {
+        return size < count || bound <= best[size - 1].cost;
+      };
+      // add the plans of split k to the list. The lists are sorted, and
+      // (a, b) has (a + 1) (b + 1) - 1 cheaper pairs of the same split: at
+      // most `count` of them matter.
+      auto merge = [&](size_t k, long kernel) {
+        const RankedPoint *lefts = ranked(i, k), *rights = ranked(k + 1, j);
+        const bool isSyrk = tables.hasMirrors && isSyrkSplit(tables, i, k, j);
+        // a SYRK takes the first plan of its right side, at no cost.
+        const size_t numLefts = ranked.size(i, k);
+        const size_t numRights = isSyrk ? 1 : ranked.size(k + 1, j);
+        for (size_t a = 0; a < numLefts; a++)
+          for (size_t b = 0; b < numRights && (a + 1) * (b + 1) <= count;
+               b++) {
+            long cost = lefts[a].cost + (isSyrk ? 0 : rights[b].cost) + kernel;
+            RankedPoint point = {cost, uint32_t(k), uint16_t(a),
+                                 uint16_t(b)};
+            if (!isCandidate(point)) {
+              // so are the dearer pairs (a', 0), a' > a.
+              if (b == 0)
+                return;
+              break;
+            }
+            // insertion into the short sorted list, dropping its last plan
+            // if it is full.
+            size_t position = size < count ? size++ : size - 1;
+            for (; position > 0 && point < best[position - 1]; position--)
+              best[position] = best[position - 1];
+            best[position] = point;
+          }
+      };
+      if (isFlopCount) {
+        // as in solveCell: the triangular prefix, and the last split that
+        // may invert leaf j, are priced by the model. The cheapest of the
+        // other splits, plain GEMMs, goes first so that the vectorized
+        // filter only keeps the splits whose cheapest plan beats the
+        // count-th plan found so far.
+        const long factor = 2 * pVector[i - 1] * pVector[j];
+        size_t k = i;
+        for (; k + 1 < j &&
+               (k == i || (leftSummaries[k - i].properties & triangular));
+             k++)
+          merge(k, getSplitCost(tables, i, k, j));
+        merge(j - 1, getSplitCost(tables, i, j - 1, j));
+        if (k + 1 < j) {
+          const size_t numSplits = j - 1 - k;
+          long cheapest;
+          size_t first = findMinSplit(left + (k - i), right + k, &pVector[k],
+                                      factor, numSplits, cheapest);
+          merge(k + first, factor * pVector[k + first]);
+          long bound = size < count ? std::numeric_limits<long>::max()
+                                    : best[size - 1].cost;
+          splits.resize(numSplits);
+          size_t found =
+              findSplitsBelow(left + (k - i), right + k, &pVector[k], factor,
+                              numSplits, bound, splits.data());
+          for (size_t f = 0; f < found; f++) {
+            size_t split = k + splits[f];
+            long kernel = factor * pVector[split];
+            if (split != k + first &&
+                isCandidateSplit(left[split - i] + right[split] + kernel))
+              merge(split, kernel);
+          }
         }
+      } else {
+        kernels.resize(j - i);
+        bounds.resize(j - i);
+        size_t first = 0;
+        for (size_t k = i; k < j; k++) {
+          kernels[k - i] = getSplitCost(tables, i, k, j);
+          // the right side of a SYRK is not computed.
+          long rightCost = tables.hasMirrors && isSyrkSplit(tables, i, k, j)
+                               ? 0
+                               : right[k];
+          bounds[k - i] = left[k - i] + rightCost + kernels[k - i];
+          if (bounds[k - i] < bounds[first])
+            first = k - i;
+        }
+        // the cheapest split first, it bounds the others.
+        merge(i + first, kernels[first]);
+        for (size_t t = 0; t < j - i; t++)
+          if (t != first && isCandidateSplit(bounds[t]))
+            merge(i + t, kernels[t]);
       }
+      tables.m(i, j) = best[0].cost;
+      tables.mColumns(i, j) = best[0].cost;
     }
+
+  vector<RankedPlan> plans;
+  for (size_t r = 0; r < ranked.size(1, n); r++) {
+    ResultMCP result(n);
+    fillPlan(ranked, ranked(1, n)[r], 1, n, result);
+    result.setOptimalTree(buildOptimalTree(result.getSplits(), 1, n,
+                                           operands));
+    plans.push_back({result.getOptimalCost(), std::move(result)});
   }
+  return plans;
+}
 
-#if DEBUG
-  cout << "\n\n-after-tmps-\n";
-  print(tmps, true);
-  cout << "\n";
-  walk(tmps[1][tmps.size() - 1]);
+BatchResultMCP runMCPBatch(const vector<Expr *> &chains,
+                           const MCPOptions &options) {
+  const size_t count = chains.size();
+  BatchResultMCP result;
+  result.costs.resize(count);
+  result.sizes.resize(count);
+  result.offsets.resize(count + 1);
+  ThreadPool pool(std::max(1u, options.numThreads));
+  const size_t grain =
+      std::max<size_t>(1, count / (8 * pool.getNumThreads()));
 
-  cout << "\n\n-----s------\n";
-  int rows = s.size();
-  int cols = s[0].size();
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      if (s[i][j] == std::numeric_limits<long>::max())
-        cout << "- ";
-      else
-        cout << s[i][j] << " ";
+  // normalizing interns expressions in the context, which is not thread
+  // safe: do it first.
+  vector<Expr *> normalForms(count);
+  {
+    STATS_PHASE(COLLECT_OPERANDS);
+    for (size_t c = 0; c < count; c++)
+      normalForms[c] = chains[c]->getNormalForm();
+  }
+
+  // size the flat split array first.
+  pool.parallelFor(0, count, grain, [&](size_t first, size_t last) {
+    vector<Expr *> operands;
+    for (size_t c = first; c < last; c++) {
+      operands.clear();
+      collectOperandsImpl(normalForms[c], operands);
+      result.sizes[c] = operands.size();
     }
-    cout << "\n";
+  });
+  result.offsets[0] = 0;
+  for (size_t c = 0; c < count; c++)
+    result.offsets[c + 1] =
+        result.offsets[c] + result.sizes[c] * (result.sizes[c] + 1) / 2;
+  result.splits.resize(result.offsets[count]);
+
+  // every chunk solves its chains one after the other in the same tables.
+  MCPOptions chainOptions = options;
+  chainOptions.numThreads = 1;
+  pool.parallelFor(0, count, grain, [&](size_t first, size_t last) {
+    vector<Expr *> operands;
+    vector<long> pVector;
+    TriangularTable<long> m, s;
+    MCPTables tables = {m, s, pVector, getCostModel(options)};
+    for (size_t c = first; c < last; c++) {
+      {
+        STATS_PHASE(COLLECT_OPERANDS);
+        operands.clear();
+        collectOperandsImpl(normalForms[c], operands);
+      }
+      getPVector(operands, pVector);
+      initTables(tables, operands);
+      solveTables(tables, operands, chainOptions);
+      const size_t n = operands.size();
+      result.costs[c] = m(1, n);
+      // same packed layout.
+      std::copy(s.getRow(1), s.getRow(1) + n * (n + 1) / 2,
+                result.splits.begin() + result.offsets[c]);
+    }
+  });
+  result.offsets.pop_back();
+  return result;
+}
+
+/// Optimal cost of the chain of `leaves` alone, zero for a single leaf.
+/// Null leaves are `product`, see getLeafSummary.
+static long getChainCost(const vector<Expr *> &leaves,
+                         const MCPOptions &options,
+                         const ChainSummary *product = nullptr) {
+  if (leaves.size() < 2)
+    return 0;
+  vector<long> pVector;
+  for (auto *leaf : leaves) {
+    ChainSummary summary = getLeafSummary(leaf, product);
+    if (pVector.empty())
+      pVector.push_back(summary.rows);
+    pVector.push_back(summary.cols);
   }
-  cout << "\n-----m------\n";
-  rows = m.size();
-  cols = m[0].size();
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      if (m[i][j] == std::numeric_limits<long>::max())
-        cout << "- ";
-      else
-        cout << m[i][j] << " ";
+  if (options.cache)
+    return getCachedPlan(leaves, pVector, options, product)
+        ->getOptimalCost();
+  return solveChain(leaves, pVector, options, product).getOptimalCost();
+}
+
+/// A leaf sequence that appears more than once in the sequences of
+/// runMCPShared, with the cost of computing it once.
+struct SharedCandidate {
+  vector<Expr *> leaves;
+  long cost;
+  // non-overlapping occurrences.
+  size_t count;
+  // the first occurrence, sequence and position.
+  size_t sequence;
+  size_t position;
+};
+
+/// Every leaf sequence of two or more leaves that appears at least twice
+/// without overlapping, most promising first: the cost of the repeats it
+/// saves.
+static vector<SharedCandidate>
+getSharedCandidates(const vector<vector<Expr *>> &sequences,
+                    const MCPOptions &options) {
+  // occurrences by sequence and position, in increasing order.
+  std::map<vector<Expr *>, vector<std::pair<size_t, size_t>>> occurrences;
+  for (size_t s = 0; s < sequences.size(); s++) {
+    const vector<Expr *> &leaves = sequences[s];
+    for (size_t i = 0; i < leaves.size(); i++)
+      for (size_t e = i + 2; e <= leaves.size(); e++)
+        occurrences[vector<Expr *>(leaves.begin() + i, leaves.begin() + e)]
+            .push_back({s, i});
+  }
+  vector<SharedCandidate> candidates;
+  for (const auto &entry : occurrences) {
+    const size_t length = entry.first.size();
+    size_t count = 0, lastSequence = 0, lastEnd = 0;
+    for (const auto &occurrence : entry.second) {
+      if (count && occurrence.first == lastSequence &&
+          occurrence.second < lastEnd)
+        continue;
+      count++;
+      lastSequence = occurrence.first;
+      lastEnd = occurrence.second + length;
     }
-    cout << "\n";
+    if (count < 2)
+      continue;
+    candidates.push_back({entry.first, getChainCost(entry.first, options),
+                          count, entry.second[0].first,
+                          entry.second[0].second});
   }
-  cout << "\n";
-  printOptimalParens(s, 1, operands.size(), operands);
-  cout << "\n\n";
-#endif
-  return {m, s};
+  // ties go to the first occurrence, then to the longest sequence, so that
+  // the order does not depend on addresses.
+  std::sort(candidates.begin(), candidates.end(),
+            [](const SharedCandidate &a, const SharedCandidate &b) {
+              long savedA = a.cost * long(a.count - 1);
+              long savedB = b.cost * long(b.count - 1);
+              if (savedA != savedB)
+                return savedA > savedB;
+              if (a.sequence != b.sequence)
+                return a.sequence < b.sequence;
+              if (a.position != b.position)
+                return a.position < b.position;
+              return a.leaves.size() > b.leaves.size();
+            });
+  return candidates;
 }
 
-long getMCPFlops(Expr *expr) {
-  ResultMCP result = runMCP(expr);
-  auto m = result.m;
-#if DEBUG
-  cout << "FLOPS: " << m[1][m.size() - 1] << "\n";
-#endif
-  return m[1][m.size() - 1];
+/// Summary of the operand standing for the product of `leaves`, with the
+/// properties the cost model would give it.
+static ChainSummary getSharedSummary(const vector<Expr *> &leaves) {
+  auto first = getLeafShape(leaves.front());
+  auto last = getLeafShape(leaves.back());
+  unsigned properties = 0;
+  if (std::all_of(leaves.begin(), leaves.end(),
+                  [](Expr *expr) { return expr->isLowerTriangular(); }))
+    properties |= Expr::getMask(Expr::ExprProperty::LOWER_TRIANGULAR);
+  if (std::all_of(leaves.begin(), leaves.end(),
+                  [](Expr *expr) { return expr->isUpperTriangular(); }))
+    properties |= Expr::getMask(Expr::ExprProperty::UPPER_TRIANGULAR);
+  if (isMirrored(leaves, 1, leaves.size()))
+    properties |= Expr::getMask(Expr::ExprProperty::SYMMETRIC);
+  return {first.first, last.second, properties, false};
 }
+
+/// The operand of the shared product `summary`, created once it is shared.
+static Operand *getSharedLeaf(const ChainSummary &summary, size_t index) {
+  auto *leaf = new Operand("cse" + std::to_string(index),
+                           {int(summary.rows), int(summary.cols)});
+  vector<Expr::ExprProperty> properties;
+  for (auto property : {Expr::ExprProperty::LOWER_TRIANGULAR,
+                        Expr::ExprProperty::UPPER_TRIANGULAR,
+                        Expr::ExprProperty::SYMMETRIC})
+    if (summary.properties & Expr::getMask(property))
+      properties.push_back(property);
+  leaf->setProperties(properties);
+  return leaf;
+}
+
+/// Replace the non-overlapping occurrences of `pattern` in `leaves`, left
+/// to right, by `leaf`. Returns how many were replaced.
+static size_t replaceOccurrences(vector<Expr *> &leaves,
+                                 const vector<Expr *> &pattern, Expr *leaf) {
+  vector<Expr *> replaced;
+  size_t count = 0;
+  for (size_t i = 0; i < leaves.size();) {
+    if (i + pattern.size() <= leaves.size() &&
+        std::equal(pattern.begin(), pattern.end(), leaves.begin() + i)) {
+      replaced.push_back(leaf);
+      i += pattern.size();
+      count++;
+    } else {
+      replaced.push_back(leaves[i++]);
+    }
+  }
+  leaves = std::move(replaced);
+  return count;
+}
+
+SharedPlanMCP runMCPShared(const vector<Expr *> &chains,
+                           const MCPOptions &options) {
+  const size_t numChains = chains.size();
+  // the leaves of the chains, then of the shared products; results[d]
+  // stands for sequences[numChains + d].
+  vector<vector<Expr *>> sequences;
+  vector<long> costs;
+  vector<Operand *> results;
+  for (auto *chain : chains) {
+    sequences.push_back(collectOperands(chain));
+    costs.push_back(getChainCost(sequences.back(), options));
+  }
+  SharedPlanMCP shared;
+  shared.independentCost = std::accumulate(costs.begin(), costs.end(), 0l);
+
+  // share the most promising candidate that lowers the total, until none
+  // does. Every step lowers the total, so this terminates.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto &candidate : getSharedCandidates(sequences, options)) {
+      // the rewritten sequences hold null leaves for the product until it
+      // is shared: rejected candidates add no node to the context.
+      const ChainSummary summary = getSharedSummary(candidate.leaves);
+      vector<std::pair<size_t, vector<Expr *>>> rewritten;
+      vector<long> newCosts;
+      long delta = candidate.cost;
+      for (size_t s = 0; s < sequences.size(); s++) {
+        // a shared product does not become an alias of another one.
+        if (s >= numChains && sequences[s] == candidate.leaves)
+          continue;
+        vector<Expr *> leaves = sequences[s];
+        if (!replaceOccurrences(leaves, candidate.leaves, nullptr))
+          continue;
+        newCosts.push_back(getChainCost(leaves, options, &summary));
+        delta += newCosts.back() - costs[s];
+        rewritten.push_back({s, std::move(leaves)});
+      }
+      if (delta >= 0)
+        continue;
+      Operand *leaf = getSharedLeaf(summary, results.size());
+      for (size_t r = 0; r < rewritten.size(); r++) {
+        vector<Expr *> &leaves = rewritten[r].second;
+        for (auto &expr : leaves)
+          if (!expr)
+            expr = leaf;
+        sequences[rewritten[r].first] = std::move(leaves);
+        costs[rewritten[r].first] = newCosts[r];
+      }
+      sequences.push_back(candidate.leaves);
+      costs.push_back(candidate.cost);
+      results.push_back(leaf);
+      changed = true;
+      break;
+    }
+  }
+
+  // a shared product may use the ones shared after it: order them by
+  // their uses.
+  std::map<Expr *, size_t> definitions;
+  for (size_t d = 0; d < results.size(); d++)
+    definitions[results[d]] = d;
+  vector<bool> visited(results.size(), false);
+  vector<size_t> order;
+  std::function<void(size_t)> visit = [&](size_t d) {
+    if (visited[d])
+      return;
+    visited[d] = true;
+    for (auto *leaf : sequences[numChains + d]) {
+      auto it = definitions.find(leaf);
+      if (it != definitions.end())
+        visit(it->second);
+    }
+    order.push_back(d);
+  };
+  for (size_t d = 0; d < results.size(); d++)
+    visit(d);
+  for (size_t c = 0; c < numChains; c++)
+    order.push_back(results.size() + c);
+
+  shared.cost = std::accumulate(costs.begin(), costs.end(), 0l);
+  for (size_t index : order) {
+    bool isChain = index >= results.size();
+    size_t s = isChain ? index - results.size() : numChains + index;
+    const vector<Expr *> &leaves = sequences[s];
+    Expr *expr = leaves.size() == 1 ? leaves[0] : binaryMul(leaves);
+    shared.products.push_back(
+        {isChain ? nullptr : results[index], expr, runMCP(expr, options)});
+  }
+  return shared;
+}
+
+/// Solve again the cells i..j with i <= a and j >= b, shortest first.
+/// Returns how many.
+static size_t solveCellsAround(MCPTables &tables, size_t n, size_t a,
+                               size_t b) {
+  size_t cells = 0;
+  for (size_t l = 2; l <= n; l++) {
+    // j = i + l - 1 >= b.
+    size_t first = b + 1 > l ? b + 1 - l : 1;
+    size_t last = std::min(a, n - l + 1);
+    for (size_t i = first; i <= last; i++, cells++)
+      solveCell(tables, i, i + l - 1);
+  }
+  STATS_ADD(DP_CELLS, cells);
+  return cells;
+}
+
+struct IncrementalMCP::State {
+  vector<Expr *> operands;
+  vector<long> pVector;
+  ResultMCP result;
+  MCPTables tables;
+  size_t solvedCells;
+
+  State(Expr *expr, const MCPOptions &options)
+      : operands(collectOperands(expr)), pVector(::getPVector(operands)),
+        tables{result.getCosts(), result.getSplits(), pVector,
+               getCostModel(options)} {
+    const size_t n = operands.size();
+    initTables(tables, operands);
+    // i <= n and j >= 1: all of them.
+    solvedCells = solveCellsAround(tables, n, n, 1);
+  }
+};
+
+IncrementalMCP::IncrementalMCP(Expr *expr, const MCPOptions &options)
+    : state(new State(expr, options)) {}
+
+IncrementalMCP::~IncrementalMCP() = default;
+
+void IncrementalMCP::setDimension(size_t t, long value) {
+  const size_t n = size();
+  assert(t <= n && "no such dimension");
+  state->pVector[t] = value;
+  MCPTables &tables = state->tables;
+  if (t >= 1)
+    tables.summaries(t, t).cols = value;
+  if (t < n)
+    tables.summaries(t + 1, t + 1).rows = value;
+  // p[t] is a dimension of i..j if i - 1 <= t <= j.
+  state->solvedCells = solveCellsAround(tables, n, t + 1, t);
+}
+
+void IncrementalMCP::setLeaf(size_t i, Expr *leaf) {
+  const size_t n = size();
+  assert(i >= 1 && i <= n && "no such leaf");
+  leaf = leaf->getNormalForm();
+  assert(!llvm::isa<NaryOp>(leaf) && "expect a leaf");
+  state->operands[i - 1] = leaf;
+  MCPTables &tables = state->tables;
+  tables.summaries(i, i).properties = getLeafProperties(leaf);
+  tables.summaries(i, i).inverse = hasInverse(leaf);
+  // the mirrors that change all contain leaf i.
+  setMirrors(tables, state->operands);
+  state->solvedCells = solveCellsAround(tables, n, i, i);
+}
+
+size_t IncrementalMCP::size() const { return state->operands.size(); }
+
+const vector<long> &IncrementalMCP::getPVector() const {
+  return state->pVector;
+}
+
+const ResultMCP &IncrementalMCP::getResult() const { return state->result; }
+
+size_t IncrementalMCP::getSolvedCells() const { return state->solvedCells; }
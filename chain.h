@@ -24,9 +24,17 @@ SOFTWARE.
 #ifndef MATRIX_CHAIN_UTILS_H
 #define MATRIX_CHAIN_UTILS_H
 
+#include "stats.h"
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace details {
@@ -38,6 +46,78 @@ class Expr;
 class NaryOp;
 class UnaryOp;
 
+/// Monotonic arena. Allocation bumps a pointer inside a slab, memory is
+/// released all at once when the arena dies.
+class Arena {
+public:
+  Arena() = default;
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t size, size_t alignment) {
+    uintptr_t ptr = reinterpret_cast<uintptr_t>(cur);
+    uintptr_t aligned = (ptr + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (cur && aligned + size <= reinterpret_cast<uintptr_t>(end)) {
+      cur = reinterpret_cast<char *>(aligned + size);
+      return reinterpret_cast<void *>(aligned);
+    }
+    return allocateSlow(size, alignment);
+  }
+  size_t getBytesReserved() const { return bytesReserved; }
+
+private:
+  void *allocateSlow(size_t size, size_t alignment);
+
+  static const size_t slabSize = 64 * 1024;
+  vector<char *> slabs;
+  char *cur = nullptr;
+  char *end = nullptr;
+  size_t bytesReserved = 0;
+};
+
+/// Upper triangle (1 <= i <= j <= n) of an n x n table packed in a single
+/// allocation, either row by row or column by column.
+template <class T, bool ColumnMajor = false> class TriangularTable {
+public:
+  TriangularTable() : n(0){};
+  TriangularTable(size_t n, T value) : n(n), data(n * (n + 1) / 2, value){};
+  size_t size() const { return n; }
+  /// Resize to n and fill with `value`, reusing the allocation if possible.
+  void reset(size_t size, T value) {
+    n = size;
+    data.assign(n * (n + 1) / 2, value);
+  }
+  T &operator()(size_t i, size_t j) { return data[getOffset(i, j)]; }
+  const T &operator()(size_t i, size_t j) const {
+    return data[getOffset(i, j)];
+  }
+  /// Contiguous cells (i, i), (i, i + 1), ..., (i, n).
+  T *getRow(size_t i) {
+    static_assert(!ColumnMajor, "rows are strided");
+    return &data[getOffset(i, i)];
+  }
+  /// Contiguous cells (1, j), (2, j), ..., (j, j).
+  T *getColumn(size_t j) {
+    static_assert(ColumnMajor, "columns are strided");
+    return &data[getOffset(1, j)];
+  }
+
+  /// Position of cell (i, j) in the packed storage of an n x n table.
+  static size_t getOffset(size_t n, size_t i, size_t j) {
+    assert(1 <= i && i <= j && j <= n && "out of bounds");
+    if (ColumnMajor)
+      return j * (j - 1) / 2 + (i - 1);
+    return (i - 1) * (2 * n - i + 2) / 2 + (j - i);
+  }
+
+private:
+  size_t getOffset(size_t i, size_t j) const { return getOffset(n, i, j); }
+
+  size_t n;
+  vector<T> data;
+};
+
 /// Scoped context to handle deallocation.
 class ScopedContext {
 public:
@@ -46,14 +126,41 @@ public:
   ScopedContext(const ScopedContext &) = delete;
   ScopedContext &operator=(const ScopedContext &) = delete;
 
-  void insert(Expr *expr) { liveRefs.insert(expr); }
+  /// Register a heap-allocated expression (i.e., `new Operand(...)`).
+  /// Expressions built with `create` are already owned by the arena.
+  void insert(Expr *expr) {
+    STATS_ADD(NODES_ALLOCATED, 1);
+    if (constructingInArena) {
+      constructingInArena = false;
+      return;
+    }
+    liveRefs.insert(expr);
+  }
+
+  /// Build an expression of type T in the context arena.
+  template <class T, class... Args> T *create(Args &&...args);
+
+  /// Like `create`, but hash-consed: return the existing node of type T
+  /// with the same kind and children if the context already has one.
+  template <class T, class... Args> T *intern(const Args &...args);
+
   void print();
   static ScopedContext *&getCurrentScopedContext();
 
 private:
   std::set<Expr *> liveRefs;
+  Arena arena;
+  vector<Expr *> arenaRefs;
+  bool constructingInArena = false;
+  // interned nodes by structural hash.
+  std::unordered_multimap<size_t, Expr *> interned;
 };
 
+/// Mix `value` into the hash `seed`.
+inline size_t hashCombine(size_t seed, size_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
 /// Generic expr of type BINARY, UNARY or OPERAND.
 class Expr {
 public:
@@ -69,33 +176,86 @@ public:
 
 private:
   const ExprKind kind;
+  friend class NaryOp;
+  friend class UnaryOp;
 
 protected:
-  vector<Expr::ExprProperty> inferredProperties;
+  // set once an operation is built on top of the expression.
+  bool hasUsers = false;
+  // bit p is property p: `properties` has the true ones, `knownProperties`
+  // the ones the inference rules can decide.
+  unsigned properties = 0;
+  unsigned knownProperties = 0;
+  size_t hash = 0;
+  // memoized getNormalForm, nodes are interned and immutable.
+  Expr *normalForm = nullptr;
+
+  /// Memoize `result` as the normal form of this expression, and of itself.
+  Expr *setNormalForm(Expr *result) {
+    normalForm = result;
+    result->normalForm = result;
+    return result;
+  }
+
+  void setProperty(ExprProperty property, bool known, bool value) {
+    if (known)
+      knownProperties |= getMask(property);
+    if (known && value)
+      properties |= getMask(property);
+  }
 
 public:
   ExprKind getKind() const { return kind; }
+  /// Structural hash: operands hash their identity, operations their kind
+  /// and children.
+  size_t getHash() const { return hash; }
+  /// Throws std::logic_error: only operands take properties.
   virtual void setProperties(vector<Expr::ExprProperty> properties) {
-    assert(0 && "can set properties only for operands");
+    throw std::logic_error("can set properties only for operands");
   };
 
   virtual ~Expr() = default;
+  /// Compute the properties from the children, once at construction.
   virtual void inferProperties() = 0;
+  /// The same matrix with transposes pushed down to the operands, double
+  /// transposes and inverses removed and products flattened: a product of
+  /// operands, transposed operands and inverses of either. Inverses of
+  /// products of square matrices are distributed too. Chains that only
+  /// differ in grouping or in where the transposes are written get the same
+  /// (interned) normal form.
   virtual Expr *getNormalForm() = 0;
 
-  virtual bool isUpperTriangular() const = 0;
-  virtual bool isLowerTriangular() const = 0;
-  virtual bool isSquare() const = 0;
-  virtual bool isSymmetric() const = 0;
-  virtual bool isFullRank() const = 0;
-  virtual bool isSPD() const = 0;
+  static unsigned getMask(ExprProperty property) {
+    return 1u << static_cast<unsigned>(property);
+  }
+  bool isKnown(ExprProperty property) const {
+    return knownProperties & getMask(property);
+  }
+  bool hasProperty(ExprProperty property) const {
+    STATS_ADD(PROPERTY_QUERIES, 1);
+    assert(isKnown(property) && "property cannot be inferred");
+    return properties & getMask(property);
+  }
 
+  bool isUpperTriangular() const {
+    return hasProperty(ExprProperty::UPPER_TRIANGULAR);
+  }
+  bool isLowerTriangular() const {
+    return hasProperty(ExprProperty::LOWER_TRIANGULAR);
+  }
+  bool isSquare() const { return hasProperty(ExprProperty::SQUARE); }
+  bool isSymmetric() const { return hasProperty(ExprProperty::SYMMETRIC); }
+  bool isFullRank() const { return hasProperty(ExprProperty::FULL_RANK); }
+  bool isSPD() const { return hasProperty(ExprProperty::SPD); }
+
+  /// Both are pointer comparisons: operations built with mul, trans and inv
+  /// are interned in their context.
   bool isTransposeOf(const Expr *right);
   bool isSame(const Expr *right);
 
 protected:
   Expr() = delete;
-  Expr(ExprKind kind) : kind(kind), inferredProperties({}){};
+  Expr(ExprKind kind) : kind(kind){};
 };
 
 /// ScopedExpr
@@ -124,20 +284,21 @@ private:
 public:
   NaryOp() = delete;
   NaryOp(vector<Expr *> children, NaryOpKind kind)
-      : ScopedExpr(ExprKind::BINARY), children(children), kind(kind){};
+      : ScopedExpr(ExprKind::BINARY), children(children), kind(kind) {
+    hash = getStructuralHash(children, kind);
+    inferProperties();
+  };
+  static size_t getStructuralHash(const vector<Expr *> &children,
+                                  NaryOpKind kind);
+  bool hasStructure(const vector<Expr *> &children, NaryOpKind kind) const {
+    return this->kind == kind && this->children == children;
+  }
   NaryOpKind getKind() const { return kind; };
   void inferProperties();
   Expr *getNormalForm();
 
   vector<Expr *> getChildren() const { return children; }
 
-  bool isUpperTriangular() const;
-  bool isLowerTriangular() const;
-  bool isSquare() const;
-  bool isSymmetric() const;
-  bool isFullRank() const;
-  bool isSPD() const;
-
   static bool classof(const Expr *expr) {
     return expr->getKind() == ExprKind::BINARY;
   };
@@ -155,20 +316,20 @@ private:
 public:
   UnaryOp() = delete;
   UnaryOp(Expr *child, UnaryOpKind kind)
-      : ScopedExpr(ExprKind::UNARY), child(child), kind(kind){};
+      : ScopedExpr(ExprKind::UNARY), child(child), kind(kind) {
+    hash = getStructuralHash(child, kind);
+    inferProperties();
+  };
+  static size_t getStructuralHash(const Expr *child, UnaryOpKind kind);
+  bool hasStructure(const Expr *child, UnaryOpKind kind) const {
+    return this->kind == kind && this->child == child;
+  }
   void inferProperties();
   Expr *getNormalForm();
 
   Expr *getChild() const { return child; };
   UnaryOpKind getKind() const { return kind; };
 
-  bool isSquare() const;
-  bool isSymmetric() const;
-  bool isUpperTriangular() const;
-  bool isLowerTriangular() const;
-  bool isFullRank() const;
-  bool isSPD() const;
-
   static bool classof(const Expr *expr) {
     return expr->getKind() == ExprKind::UNARY;
   };
@@ -176,6 +337,61 @@ public:
 
 Expr *binaryMul(vector<Expr *> children, bool binary = false);
 
+/// Leaves of the normal form of a chain (operands, possibly transposed or
+/// inverted), left to right.
+vector<Expr *> collectOperands(Expr *expr);
+
+/// Whether the leaves i..j (1-based) read the same as their transpose: leaf
+/// i + t is the transpose of leaf j - t. Their product is then symmetric:
+/// its left half times the transpose of that half.
+bool isMirrored(const vector<Expr *> &leaves, size_t i, size_t j);
+
+/// Hu-Shing solver for the plain GEMM cost model (2 * p * q * r flops per
+/// product), O(n log n) in the number of matrices. Return the optimal cost
+/// and, if `s` is not null, set the split of every sub-chain of the optimal
+/// parenthesization (other entries are left untouched).
+long runHuShing(const vector<long> &pVector, TriangularTable<long> *s);
+
+/// Instruction sets for the split-point kernel, from the least capable.
+enum class SIMDLevel { SCALAR, AVX2, AVX512 };
+
+/// Best level supported by the running CPU.
+SIMDLevel getSIMDLevel();
+
+/// First t in [0, size) minimizing left[t] + right[t] + factor * dims[t],
+/// the minimum goes in `best`.
+size_t findMinSplit(const long *left, const long *right, const long *dims,
+                    long factor, size_t size, long &best,
+                    SIMDLevel level = getSIMDLevel());
+
+/// The t in [0, size) with left[t] + right[t] + factor * dims[t] <= bound,
+/// in increasing order, written to `splits`. Returns how many there are.
+size_t findSplitsBelow(const long *left, const long *right, const long *dims,
+                       long factor, size_t size, long bound, size_t *splits,
+                       SIMDLevel level = getSIMDLevel());
+
+template <class T, class... Args> T *ScopedContext::create(Args &&...args) {
+  assert(getCurrentScopedContext() == this && "ctx must be the current one");
+  void *mem = arena.allocate(sizeof(T), alignof(T));
+  constructingInArena = true;
+  T *expr = new (mem) T(std::forward<Args>(args)...);
+  arenaRefs.push_back(expr);
+  return expr;
+}
+
+template <class T, class... Args>
+T *ScopedContext::intern(const Args &...args) {
+  size_t hash = T::getStructuralHash(args...);
+  auto range = interned.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it)
+    if (T::classof(it->second) &&
+        static_cast<T *>(it->second)->hasStructure(args...))
+      return static_cast<T *>(it->second);
+  T *expr = create<T>(args...);
+  interned.emplace(hash, expr);
+  return expr;
+}
+
 } // end namespace details.
 
 namespace matrixchain {
@@ -191,28 +407,173 @@ private:
 public:
   Operand() = delete;
   Operand(string name, vector<int> shape)
-      : ScopedExpr(ExprKind::OPERAND), name(name), shape(shape){};
-  string getName() const { return name; };
-  vector<int> getShape() const { return shape; };
-  vector<Expr::ExprProperty> getProperties() const {
-    return inferredProperties;
-  };
-  void setProperties(vector<Expr::ExprProperty> properties) {
-    inferredProperties = properties;
+      : ScopedExpr(ExprKind::OPERAND), name(name), shape(shape) {
+    hash = std::hash<const Expr *>()(this);
+    // all of them, false until set.
+    knownProperties = getMask(ExprProperty::SPD) * 2 - 1;
   };
+  string getName() const { return name; };
+  const vector<int> &getShape() const { return shape; };
+  vector<Expr::ExprProperty> getProperties() const;
+  /// Properties must be set before the operand is used in an expression,
+  /// operations infer theirs at construction: throws std::logic_error once
+  /// it is, as the interned parents, normal forms and cached plans would
+  /// keep the old ones.
+  void setProperties(vector<Expr::ExprProperty> properties);
   Expr *getNormalForm();
   void inferProperties(){};
-  bool isUpperTriangular() const;
-  bool isLowerTriangular() const;
-  bool isSquare() const;
-  bool isSymmetric() const;
-  bool isFullRank() const;
-  bool isSPD() const;
   static bool classof(const Expr *expr) {
     return expr->getKind() == ExprKind::OPERAND;
   };
 };
 
+/// Matrix chain solvers.
+enum class MCPEngine {
+  /// O(n^3) dynamic programming, handles every cost rule.
+  DYNAMIC_PROGRAMMING,
+  /// O(n log n) Hu-Shing polygon partitioning. Only valid for plain GEMM
+  /// flop counts: chains with triangular, symmetric, inverted or mirrored
+  /// (X X^T) factors, or another cost model, fall back to the DP.
+  HU_SHING,
+  /// O(n) approximation, at most ~15.5% above the optimal cost. The splits
+  /// and the cells along the tree describe the approximate ordering. Same
+  /// fallback as HU_SHING.
+  APPROXIMATE
+};
+
+class CostModel;
+class PlanCache;
+
+/// Options for the matrix chain optimization.
+struct MCPOptions {
+  /// Threads solving the DP. Cells on the same diagonal are independent and
+  /// are spread over a thread pool; 1 runs the serial solver.
+  unsigned numThreads = 1;
+  MCPEngine engine = MCPEngine::DYNAMIC_PROGRAMMING;
+  /// Reuse the solutions of chains with the same signature (see
+  /// plancache.h). Not owned.
+  PlanCache *cache = nullptr;
+  /// Price of the products (see costmodel.h), the flop count if null. Not
+  /// owned.
+  const CostModel *costModel = nullptr;
+};
+
+/// Result of the matrix chain optimization. Entry (i, j) of the cost
+/// and split tables describes the sub-chain i..j, 1 <= i <= j <= size().
+class ResultMCP {
+public:
+  ResultMCP() : tree(nullptr){};
+  ResultMCP(size_t n);
+  size_t size() const { return m.size(); }
+  long getCost(size_t i, size_t j) const { return m(i, j); }
+  long getSplit(size_t i, size_t j) const { return s(i, j); }
+  long getOptimalCost() const { return m(1, size()); }
+  Expr *getOptimalTree() const { return tree; }
+
+  TriangularTable<long> &getCosts() { return m; }
+  TriangularTable<long> &getSplits() { return s; }
+  const TriangularTable<long> &getSplits() const { return s; }
+  void setOptimalTree(Expr *optimalTree) { tree = optimalTree; }
+
+private:
+  TriangularTable<long> m;
+  TriangularTable<long> s;
+  Expr *tree;
+};
+
+/// Solutions of a batch of chains, packed in flat arrays. The split table
+/// of chain c is stored like a row-major TriangularTable at
+/// splits[offsets[c]].
+struct BatchResultMCP {
+  vector<long> costs;
+  vector<size_t> sizes;
+  vector<size_t> offsets;
+  vector<long> splits;
+
+  size_t size() const { return costs.size(); }
+  long getOptimalCost(size_t chain) const { return costs[chain]; }
+  long getSplit(size_t chain, size_t i, size_t j) const {
+    return splits[offsets[chain] +
+                  TriangularTable<long>::getOffset(sizes[chain], i, j)];
+  }
+};
+
+/// A plan on the frontier of runMCPPareto. The cells of its tables along
+/// the tree are set.
+struct ParetoPlan {
+  /// Cost in the model of the options.
+  long cost;
+  /// Most bytes of intermediates alive at once when the plan is evaluated
+  /// left sub-chain first (the output excluded).
+  long peakBytes;
+  ResultMCP plan;
+};
+
+/// A product of a SharedPlanMCP: `expr`, a chain of operands and of the
+/// results of earlier products, optimized with `plan`.
+struct SharedProduct {
+  /// Operand standing for the product in the chains that use it, null for
+  /// the input chains. Bind it to the output buffer of the product to
+  /// evaluate the ones after it.
+  Operand *result;
+  Expr *expr;
+  ResultMCP plan;
+};
+
+/// A plan of runMCPTopK. The cells of its tables along the tree are set.
+struct RankedPlan {
+  /// Cost in the model of the options.
+  long cost;
+  ResultMCP plan;
+};
+
+/// Optimal solution of a chain kept up to date as the chain changes. When a
+/// dimension or a leaf changes, only the DP cells of the sub-chains that
+/// contain it are solved again. For example, changing the last dimension of
+/// an n-chain (a batch size) solves its n - 1 cells ending at the last leaf,
+/// O(n^2) work instead of O(n^3). Always the dynamic programming, on one
+/// thread, without the plan cache.
+class IncrementalMCP {
+public:
+  IncrementalMCP(Expr *expr, const MCPOptions &options = MCPOptions());
+  ~IncrementalMCP();
+  IncrementalMCP(const IncrementalMCP &) = delete;
+  IncrementalMCP &operator=(const IncrementalMCP &) = delete;
+
+  /// Set p[t], 0 <= t <= size(): the columns of leaf t and the rows of leaf
+  /// t + 1.
+  void setDimension(size_t t, long value);
+  /// Replace leaf i (1-based), e.g. by an operand with other properties.
+  /// Only its properties and identity matter, its dimensions stay the ones
+  /// of the p-vector.
+  void setLeaf(size_t i, Expr *leaf);
+
+  size_t size() const;
+  const vector<long> &getPVector() const;
+  /// Cost and split tables, without the tree.
+  const ResultMCP &getResult() const;
+  long getOptimalCost() const { return getResult().getOptimalCost(); }
+  /// Cells solved by the last update (or by the construction).
+  size_t getSolvedCells() const;
+
+private:
+  struct State;
+  std::unique_ptr<State> state;
+};
+
+/// Solution of runMCPShared, a DAG of products.
+struct SharedPlanMCP {
+  /// The shared sub-products, each after the ones it uses, then the input
+  /// chains in order.
+  vector<SharedProduct> products;
+  /// Total cost, every product counted once.
+  long cost = 0;
+  /// Total cost of optimizing the chains independently.
+  long independentCost = 0;
+
+  long getSavings() const { return independentCost - cost; }
+};
+
 } // end namespace matrixchain
 
 using namespace std;
@@ -236,7 +597,41 @@ void walk(const Expr *node, int level = 0);
 Expr *collapseMuls(const Expr *tree);
 Expr *inv(Expr *child);
 Expr *trans(Expr *child);
-long getMCPFlops(Expr *expr);
+ResultMCP runMCP(Expr *expr, const MCPOptions &options = MCPOptions());
+/// Flops of the plan of runMCP, also under a cost model that prices
+/// something else (see costmodel.h).
+long getMCPFlops(Expr *expr, const MCPOptions &options = MCPOptions());
+/// Flops of evaluating `expr` with `plan`, whichever cost model chose it.
+long getPlanFlops(Expr *expr, const ResultMCP &plan);
+/// The plans no other plan beats on both cost and peak intermediate bytes,
+/// by increasing cost (and decreasing peak bytes): the first is the one of
+/// runMCP, callers under a memory cap take the first that fits. Dynamic
+/// programming over the frontiers of every sub-chain, so slower than runMCP
+/// by the square of the frontier sizes. The plan cache is not used.
+vector<ParetoPlan> runMCPPareto(Expr *expr,
+                                const MCPOptions &options = MCPOptions());
+/// The `count` cheapest distinct parenthesizations of the chain, cheapest
+/// first (fewer if the chain has fewer), so that a runtime can time the
+/// first few on live data and keep the fastest. The first plan is the one
+/// of runMCP. k-best dynamic programming: every sub-chain keeps its `count`
+/// cheapest plans, at most 65536 of them. A count of 1 is runMCP, the
+/// plan cache is not used otherwise.
+vector<RankedPlan> runMCPTopK(Expr *expr, size_t count,
+                              const MCPOptions &options = MCPOptions());
+/// Optimize independent chains on options.numThreads threads, without
+/// building the trees. The plan cache is not used.
+BatchResultMCP runMCPBatch(const vector<Expr *> &chains,
+                           const MCPOptions &options = MCPOptions());
+/// Optimize chains that repeat sub-products, within a chain (A B C A B D)
+/// or across chains, computing each repeat once. Greedy: the repeated leaf
+/// sequence that saves the most becomes a product of its own, standing as
+/// a new operand in the chains, for as long as the total cost goes down.
+/// Leaves are compared by identity, so equal leaves must be the same
+/// operands, transposed or inverted the same way. Every round prices each
+/// repeated sequence with the solver, so this is meant for chains of tens
+/// of leaves. Creates operands in the current context.
+SharedPlanMCP runMCPShared(const vector<Expr *> &chains,
+                           const MCPOptions &options = MCPOptions());
 
 // Exposed method: Variadic Mul.
 template <typename Arg, typename... Args> Expr *mul(Arg arg, Args... args) {
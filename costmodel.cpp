@@ -0,0 +1,315 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "costmodel.h"
+#include "kernels.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <random>
+
+using namespace matrixchain;
+
+namespace {
+
+/// Where a dimension falls on the grid: between grid[index] and
+/// grid[index + 1], with `weight` on the latter (in log2).
+struct Position {
+  size_t index;
+  double weight;
+};
+
+Position locate(const vector<long> &grid, long value) {
+  if (grid.size() == 1 || value <= grid.front())
+    return {0, 0.0};
+  if (value >= grid.back())
+    return {grid.size() - 2, 1.0};
+  size_t index =
+      std::upper_bound(grid.begin(), grid.end(), value) - grid.begin() - 1;
+  double low = std::log2(grid[index]), high = std::log2(grid[index + 1]);
+  return {index, (std::log2(value) - low) / (high - low)};
+}
+
+/// Multilinear interpolation in a row-major table over `rank` dimensions.
+double interpolate(const vector<double> &table, size_t gridSize,
+                   const Position *positions, size_t rank) {
+  double value = 0.0;
+  for (unsigned corner = 0; corner < (1u << rank); corner++) {
+    double weight = 1.0;
+    size_t offset = 0;
+    for (size_t d = 0; d < rank && weight != 0.0; d++) {
+      unsigned upper = (corner >> (rank - 1 - d)) & 1;
+      weight *= upper ? positions[d].weight : 1.0 - positions[d].weight;
+      offset = offset * gridSize + positions[d].index + upper;
+    }
+    if (weight != 0.0)
+      value += weight * table[offset];
+  }
+  return value;
+}
+
+/// Best time per call of `run`, in nanoseconds, over a few batches long
+/// enough for the clock.
+double getNanoseconds(const std::function<void()> &run) {
+  using Clock = std::chrono::steady_clock;
+  const double minBatch = 1e6;
+  run();
+  double best = std::numeric_limits<double>::max();
+  size_t repetitions = 1;
+  for (int batch = 0; batch < 5;) {
+    auto start = Clock::now();
+    for (size_t r = 0; r < repetitions; r++)
+      run();
+    double elapsed =
+        std::chrono::duration<double, std::nano>(Clock::now() - start)
+            .count();
+    if (elapsed < minBatch) {
+      repetitions *= 2;
+      continue;
+    }
+    best = std::min(best, elapsed / repetitions);
+    batch++;
+  }
+  return best;
+}
+
+const KernelKind kernelKinds[] = {KernelKind::GEMM, KernelKind::TRMM,
+                                  KernelKind::SYMM, KernelKind::SYRK,
+                                  KernelKind::TRSM, KernelKind::POSV,
+                                  KernelKind::GESV};
+const size_t numKernelKinds = sizeof(kernelKinds) / sizeof(kernelKinds[0]);
+
+const char *getKernelName(KernelKind kernel) {
+  switch (kernel) {
+  case KernelKind::GEMM:
+    return "gemm";
+  case KernelKind::TRMM:
+    return "trmm";
+  case KernelKind::SYMM:
+    return "symm";
+  case KernelKind::SYRK:
+    return "syrk";
+  case KernelKind::TRSM:
+    return "trsm";
+  case KernelKind::POSV:
+    return "posv";
+  case KernelKind::GESV:
+    return "gesv";
+  }
+  return "";
+}
+
+/// Whether the points of `grid` are strictly ascending: interpolating
+/// between two equal points would divide by zero.
+bool isAscending(const vector<long> &grid) {
+  return std::adjacent_find(grid.begin(), grid.end(),
+                            std::greater_equal<long>()) == grid.end();
+}
+
+/// Seed of the hashes of the models named `name`, combined with their
+/// parameters.
+size_t getModelHash(const char *name) {
+  return std::hash<std::string>()(name);
+}
+
+/// Entries of the table of `kernel` over a grid of size g.
+size_t getTableSize(KernelKind kernel, size_t g) {
+  return kernel == KernelKind::GEMM ? g * g * g : g * g;
+}
+
+} // end namespace
+
+const FlopModel &FlopModel::get() {
+  static const FlopModel model;
+  return model;
+}
+
+const TrafficModel &TrafficModel::get() {
+  static const TrafficModel model;
+  return model;
+}
+
+size_t FlopModel::getHash() const { return getModelHash("flops"); }
+
+size_t TrafficModel::getHash() const {
+  // its one parameter, the size of the elements.
+  return details::hashCombine(getModelHash("traffic"), sizeof(double));
+}
+
+MeasuredModel::MeasuredModel(vector<long> grid,
+                             vector<vector<double>> tables)
+    : grid(std::move(grid)), tables(std::move(tables)) {
+  assert(!this->grid.empty() && isAscending(this->grid) &&
+         "expect a strictly ascending grid");
+  assert(this->tables.size() == numKernelKinds && "expect a table per kernel");
+  for (size_t t = 0; t < numKernelKinds; t++)
+    assert(this->tables[t].size() ==
+               getTableSize(kernelKinds[t], this->grid.size()) &&
+           "tables do not match the grid");
+}
+
+vector<long> MeasuredModel::getDefaultGrid() {
+  return {1, 4, 16, 64, 256, 1024};
+}
+
+MeasuredModel MeasuredModel::calibrate(const vector<long> &grid) {
+  const size_t g = grid.size();
+  const long largest = grid.back();
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> dist(-1, 1);
+  vector<double> a(largest * largest), b(largest * largest),
+      c(largest * largest), workspace(largest * largest);
+  for (auto *buffer : {&a, &b})
+    for (auto &value : *buffer)
+      value = dist(rng);
+  const FlopModel &flops = FlopModel::get();
+  vector<vector<double>> tables;
+  for (KernelKind kernel : kernelKinds)
+    tables.emplace_back(getTableSize(kernel, g));
+  vector<double> &gemm = tables[static_cast<size_t>(KernelKind::GEMM)];
+  for (size_t im = 0; im < g; im++) {
+    long m = grid[im];
+    // diagonally dominant, so that the solves are well conditioned.
+    vector<double> dominant(a.begin(), a.begin() + m * m);
+    for (long i = 0; i < m; i++)
+      dominant[i * m + i] += m;
+    auto lhs = details::getRowMajor(dominant.data(), m, m);
+    vector<double> &syrk = tables[static_cast<size_t>(KernelKind::SYRK)];
+    for (size_t ik = 0; ik < g; ik++) {
+      long k = grid[ik];
+      auto left = details::getRowMajor(a.data(), m, k);
+      double time =
+          getNanoseconds([&]() { details::syrk(left, c.data(), m); });
+      syrk[im * g + ik] = flops.getCost(KernelKind::SYRK, m, k, m) / time;
+    }
+    for (size_t in = 0; in < g; in++) {
+      long n = grid[in];
+      auto rhs = details::getRowMajor(b.data(), m, n);
+      auto measure = [&](KernelKind kernel,
+                         const std::function<void()> &run) {
+        tables[static_cast<size_t>(kernel)][im * g + in] =
+            flops.getCost(kernel, m, m, n) / getNanoseconds(run);
+      };
+      measure(KernelKind::TRMM, [&]() {
+        details::trmm(details::Triangle::LOWER, lhs, rhs, c.data(), n);
+      });
+      measure(KernelKind::SYMM,
+              [&]() { details::symm(lhs, rhs, c.data(), n); });
+      measure(KernelKind::TRSM, [&]() {
+        details::trsm(details::Triangle::LOWER, lhs, rhs, c.data(), n);
+      });
+      measure(KernelKind::POSV, [&]() {
+        details::posv(lhs, rhs, c.data(), n, workspace.data());
+      });
+      measure(KernelKind::GESV, [&]() {
+        details::gesv(lhs, rhs, c.data(), n, workspace.data());
+      });
+      for (size_t ik = 0; ik < g; ik++) {
+        long k = grid[ik];
+        auto left = details::getRowMajor(a.data(), m, k);
+        auto right = details::getRowMajor(b.data(), k, n);
+        double time = getNanoseconds(
+            [&]() { details::gemm(left, right, c.data(), n); });
+        gemm[(im * g + ik) * g + in] =
+            flops.getCost(KernelKind::GEMM, m, k, n) / time;
+      }
+    }
+  }
+  return MeasuredModel(grid, std::move(tables));
+}
+
+bool MeasuredModel::save(const std::string &path) const {
+  std::ofstream file(path);
+  file.precision(std::numeric_limits<double>::max_digits10);
+  file << "matrixchain-costs 3\ngrid " << grid.size();
+  for (long dim : grid)
+    file << " " << dim;
+  for (size_t t = 0; t < numKernelKinds; t++) {
+    file << "\n" << getKernelName(kernelKinds[t]);
+    for (double throughput : tables[t])
+      file << " " << throughput;
+  }
+  file << "\n";
+  return bool(file);
+}
+
+bool MeasuredModel::load(const std::string &path) {
+  std::ifstream file(path);
+  std::string word;
+  int version = 0;
+  size_t g = 0;
+  if (!(file >> word >> version) || word != "matrixchain-costs" ||
+      version != 3 || !(file >> word >> g) || word != "grid" || g == 0)
+    return false;
+  vector<long> newGrid(g);
+  for (auto &dim : newGrid)
+    if (!(file >> dim) || dim <= 0)
+      return false;
+  if (!isAscending(newGrid))
+    return false;
+  vector<vector<double>> newTables;
+  for (KernelKind kernel : kernelKinds) {
+    if (!(file >> word) || word != getKernelName(kernel))
+      return false;
+    newTables.emplace_back(getTableSize(kernel, g));
+    for (auto &throughput : newTables.back())
+      if (!(file >> throughput) || !(throughput > 0.0))
+        return false;
+  }
+  grid = std::move(newGrid);
+  tables = std::move(newTables);
+  return true;
+}
+
+double MeasuredModel::getThroughput(KernelKind kernel, long m, long k,
+                                    long n) const {
+  assert(!grid.empty() && "the model is not calibrated");
+  const vector<double> &table = tables[static_cast<size_t>(kernel)];
+  if (kernel == KernelKind::GEMM) {
+    Position positions[] = {locate(grid, m), locate(grid, k),
+                            locate(grid, n)};
+    return interpolate(table, grid.size(), positions, 3);
+  }
+  Position positions[] = {locate(grid, m),
+                          locate(grid, kernel == KernelKind::SYRK ? k : n)};
+  return interpolate(table, grid.size(), positions, 2);
+}
+
+long MeasuredModel::getCost(KernelKind kernel, long m, long k,
+                            long n) const {
+  double flops = FlopModel::get().getCost(kernel, m, k, n);
+  return static_cast<long>(flops * 1e3 / getThroughput(kernel, m, k, n));
+}
+
+size_t MeasuredModel::getHash() const {
+  size_t hash = getModelHash("measured");
+  for (long dim : grid)
+    hash = details::hashCombine(hash, std::hash<long>()(dim));
+  for (const auto &table : tables)
+    for (double throughput : table)
+      hash = details::hashCombine(hash, std::hash<double>()(throughput));
+  return hash;
+}
@@ -0,0 +1,145 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_COSTMODEL_H
+#define MATRIX_CHAIN_COSTMODEL_H
+
+#include "chain.h"
+#include <string>
+
+namespace matrixchain {
+
+/// Kernel computing a binary product of the chain, after the properties of
+/// its left-hand side (see the evaluator in execute.cpp). With an inverse on
+/// the left, the product is a solve with the m x m matrix inverted: TRSM if
+/// it is triangular, else POSV (Cholesky) if it is SPD, else GESV (LU). The
+/// factorization is part of the cost. SYRK is the product of an m x k
+/// matrix by its own transpose, which it reads once.
+enum class KernelKind { GEMM, TRMM, SYMM, SYRK, TRSM, POSV, GESV };
+
+/// Price of the binary products, minimized by the solvers. Pass it through
+/// MCPOptions::costModel.
+class CostModel {
+public:
+  virtual ~CostModel() = default;
+
+  /// Cost of the m x k times k x n product computed with `kernel`.
+  virtual long getCost(KernelKind kernel, long m, long k, long n) const = 0;
+
+  /// Tells models apart in plan cache signatures: equal models, equal
+  /// hashes. Derived from the kind of model and its parameters.
+  virtual size_t getHash() const = 0;
+
+  /// True for FlopModel only. The solvers then take their flop-specific
+  /// paths: the vectorized split search, Hu-Shing and Chin.
+  virtual bool isFlopCount() const { return false; }
+};
+
+/// The flop count: 2 m k n, halved for TRMM, SYRK and TRSM. SYMM does the
+/// flops of GEMM, it only reads half of its left-hand side. POSV and GESV
+/// solve with 2 m m n flops after a factorization of m^3 / 3 and 2 m^3 / 3.
+/// The default model.
+class FlopModel final : public CostModel {
+public:
+  long getCost(KernelKind kernel, long m, long k, long n) const override {
+    long cost = 2 * m * k * n;
+    switch (kernel) {
+    case KernelKind::GEMM:
+    case KernelKind::SYMM:
+      return cost;
+    case KernelKind::POSV:
+      return cost + m * m * m / 3;
+    case KernelKind::GESV:
+      return cost + 2 * m * m * m / 3;
+    default:
+      return cost >> 1;
+    }
+  }
+  size_t getHash() const override;
+  bool isFlopCount() const override { return true; }
+
+  /// The instance used when MCPOptions::costModel is null.
+  static const FlopModel &get();
+};
+
+/// Bytes moved by a product of doubles: the operands are read and the
+/// result written once, a triangular or symmetric left-hand side as one
+/// triangle and the two sides of SYRK as one. The factorizations of POSV
+/// and GESV also write their factor.
+/// Prefers plans with small intermediates to plans with few flops.
+class TrafficModel final : public CostModel {
+public:
+  long getCost(KernelKind kernel, long m, long k, long n) const override {
+    long lhs = m * k;
+    if (kernel == KernelKind::SYRK)
+      return (lhs + m * n) * long(sizeof(double));
+    if (kernel == KernelKind::POSV || kernel == KernelKind::GESV)
+      lhs *= 2;
+    else if (kernel != KernelKind::GEMM)
+      lhs = m * (m + 1) / 2;
+    return (lhs + k * n + m * n) * long(sizeof(double));
+  }
+  size_t getHash() const override;
+
+  static const TrafficModel &get();
+};
+
+/// Runtime in picoseconds, predicted from the throughput of the kernels
+/// measured on this machine over a grid of shapes. Throughputs are in flops
+/// (as counted by FlopModel) per nanosecond and interpolated linearly in
+/// log2 of the dimensions; dimensions outside the grid are clamped to it.
+/// GEMM is tabulated over (m, k, n), SYRK over (m, k) and the other
+/// kernels, whose left-hand side is square, over (m, n).
+class MeasuredModel final : public CostModel {
+public:
+  MeasuredModel() = default;
+  /// From throughput tables, one per kernel in the order of KernelKind,
+  /// row-major over the grid (n fastest). The grid is strictly ascending.
+  MeasuredModel(vector<long> grid, vector<vector<double>> tables);
+
+  /// Time the kernels on every shape of the grid, on one thread.
+  static MeasuredModel calibrate(const vector<long> &grid = getDefaultGrid());
+  /// Powers of 4 from 1 to 1024.
+  static vector<long> getDefaultGrid();
+
+  /// Write the tables to `path` as text. False on I/O errors.
+  bool save(const std::string &path) const;
+  /// Read tables written by save. False, leaving the model untouched, if
+  /// the file is missing or malformed.
+  bool load(const std::string &path);
+
+  long getCost(KernelKind kernel, long m, long k, long n) const override;
+  size_t getHash() const override;
+
+  const vector<long> &getGrid() const { return grid; }
+  /// Interpolated flops per nanosecond of `kernel` on the shape.
+  double getThroughput(KernelKind kernel, long m, long k, long n) const;
+
+private:
+  vector<long> grid;
+  vector<vector<double>> tables;
+};
+
+} // end namespace matrixchain
+
+#endif
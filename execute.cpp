@@ -0,0 +1,1128 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "execute.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "llvm/Support/Casting.h"
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <string>
+
+using namespace matrixchain;
+using namespace details;
+
+namespace {
+
+bool hasKnownProperty(Expr *expr, Expr::ExprProperty property) {
+  return expr->isKnown(property) && expr->hasProperty(property);
+}
+
+/// Rows and columns of a leaf.
+std::pair<long, long> getShape(Expr *expr) {
+  if (auto operand = llvm::dyn_cast<Operand>(expr))
+    return {operand->getShape()[0], operand->getShape()[1]};
+  auto unaryOp = llvm::dyn_cast<UnaryOp>(expr);
+  assert(unaryOp && "leaves are operands, transposes or inverses");
+  auto shape = getShape(unaryOp->getChild());
+  if (unaryOp->getKind() == UnaryOp::UnaryOpKind::TRANSPOSE)
+    std::swap(shape.first, shape.second);
+  return shape;
+}
+
+bool hasInverse(Expr *expr) {
+  auto unaryOp = llvm::dyn_cast<UnaryOp>(expr);
+  if (!unaryOp)
+    return false;
+  return unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE ||
+         hasInverse(unaryOp->getChild());
+}
+
+/// Kernel for one binary product, after the properties of its operands.
+/// The solves multiply by the inverse of their left-hand side.
+enum class Kernel {
+  GEMM,
+  TRMM_LOWER,
+  TRMM_UPPER,
+  SYMM,
+  SYRK,
+  TRSM_LOWER,
+  TRSM_UPPER,
+  POSV,
+  GESV
+};
+
+/// The solve multiplying by the leaf `expr`, an inverse, after the same
+/// properties as the cost model (see getKernelKind in chain.cpp).
+Kernel getSolveKernel(Expr *expr) {
+  if (hasKnownProperty(expr, Expr::ExprProperty::LOWER_TRIANGULAR))
+    return Kernel::TRSM_LOWER;
+  if (hasKnownProperty(expr, Expr::ExprProperty::UPPER_TRIANGULAR))
+    return Kernel::TRSM_UPPER;
+  if (hasKnownProperty(expr, Expr::ExprProperty::SPD))
+    return Kernel::POSV;
+  return Kernel::GESV;
+}
+
+/// Whether `kernel` factors its left-hand side into an n x n workspace.
+bool isFactorization(Kernel kernel) {
+  return kernel == Kernel::POSV || kernel == Kernel::GESV;
+}
+
+/// C = A^-1 * B with the solve `kernel`.
+void solve(Kernel kernel, const MatrixRef &a, const MatrixRef &b, double *c,
+           long ldc, double *workspace) {
+  switch (kernel) {
+  case Kernel::TRSM_LOWER:
+    return trsm(Triangle::LOWER, a, b, c, ldc);
+  case Kernel::TRSM_UPPER:
+    return trsm(Triangle::UPPER, a, b, c, ldc);
+  case Kernel::POSV:
+    return posv(a, b, c, ldc, workspace);
+  default:
+    assert(kernel == Kernel::GESV && "not a solve");
+    return gesv(a, b, c, ldc, workspace);
+  }
+}
+
+/// The leaf `expr` over the operand buffers of `bindings`. An inverse is
+/// computed explicitly into `inverse` with the n x n `workspace`, by solving
+/// on the identity; if `inverse` is null, the matrix to invert is returned
+/// instead, for a product that solves with it.
+MatrixRef getLeaf(Expr *expr, const Bindings &bindings, double *inverse,
+                  double *workspace) {
+  if (auto operand = llvm::dyn_cast<Operand>(expr)) {
+    auto it = bindings.find(operand);
+    assert(it != bindings.end() && "operand without a buffer");
+    const auto &shape = operand->getShape();
+    return getRowMajor(it->second, shape[0], shape[1]);
+  }
+  auto unaryOp = llvm::dyn_cast<UnaryOp>(expr);
+  assert(unaryOp && "leaves are operands, transposes or inverses");
+  bool isInverse = unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE;
+  assert((!isInverse || !hasInverse(unaryOp->getChild())) &&
+         "at most one inverse per leaf");
+  MatrixRef child = getLeaf(unaryOp->getChild(), bindings, inverse,
+                            workspace);
+  if (!isInverse)
+    return child.transpose();
+  if (!inverse)
+    return child;
+  const long n = child.rows;
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < n; j++)
+      inverse[i * n + j] = i == j ? 1.0 : 0.0;
+  MatrixRef result = getRowMajor(inverse, n, n);
+  solve(getSolveKernel(expr), child, result, inverse, n, workspace);
+  return result;
+}
+
+/// C = lhs * rhs with `kernel`, for the columns [first, last) of C. The
+/// factorizations need all the columns and the n x n `workspace`.
+void multiply(Kernel kernel, const MatrixRef &lhs, const MatrixRef &rhs,
+              double *out, long ldc, long first, long last,
+              double *workspace) {
+  MatrixRef columns = rhs.block(0, first, rhs.rows, last - first);
+  double *c = out + first;
+  switch (kernel) {
+  case Kernel::GEMM:
+    return gemm(lhs, columns, c, ldc);
+  case Kernel::TRMM_LOWER:
+    return trmm(Triangle::LOWER, lhs, columns, c, ldc);
+  case Kernel::TRMM_UPPER:
+    return trmm(Triangle::UPPER, lhs, columns, c, ldc);
+  case Kernel::SYMM:
+    return symm(lhs, columns, c, ldc);
+  case Kernel::SYRK:
+    if (first == 0 && last == rhs.cols)
+      return syrk(lhs, out, ldc);
+    // the lower triangle of the columns, mirrored by the caller.
+    return gemm(lhs.block(first, 0, lhs.rows - first, lhs.cols),
+                lhs.block(first, 0, last - first, lhs.cols).transpose(),
+                c + first * ldc, ldc);
+  default:
+    assert((!isFactorization(kernel) || (first == 0 && last == rhs.cols)) &&
+           "a factorization does not split by columns");
+    return solve(kernel, lhs, columns, c, ldc, workspace);
+  }
+}
+
+/// Below this many flops a product is not split across threads.
+const double MIN_PARALLEL_FLOPS = 1 << 22;
+
+/// Whether the split k of i..j is X * X^T: the leaves i..j are mirrored and
+/// k is their middle. Only the left side is computed, as in the cost model.
+bool isSyrk(const vector<Expr *> &operands, size_t i, size_t k, size_t j) {
+  return k == (i + j - 1) / 2 && isMirrored(operands, i, j);
+}
+
+/// Whether the evaluator computes the two sub-chains of i..j, split at k,
+/// concurrently.
+bool isFork(const vector<Expr *> &operands, size_t i, size_t k, size_t j,
+            unsigned threads) {
+  return threads > 1 && i < k && k + 1 < j && !isSyrk(operands, i, k, j);
+}
+
+/// Whether every leaf in i..j has `property`, which the product of the
+/// leaves then has as well (triangular properties).
+bool isChain(const vector<Expr *> &operands, size_t i, size_t j,
+             Expr::ExprProperty property) {
+  for (size_t l = i; l <= j; l++)
+    if (!hasKnownProperty(operands[l - 1], property))
+      return false;
+  return true;
+}
+
+/// The kernel the cost model priced the product (i..k) * (k+1..j) with.
+Kernel getKernel(const vector<Expr *> &operands, size_t i, size_t k,
+                 size_t j) {
+  // the leaf is the matrix to invert, see getSolvedLeaves.
+  if (i == k && hasInverse(operands[i - 1]))
+    return getSolveKernel(operands[i - 1]);
+  // X * X^T: the rhs is the transpose of the lhs.
+  if (isSyrk(operands, i, k, j))
+    return Kernel::SYRK;
+  if (getShape(operands[i - 1]).first != getShape(operands[k - 1]).second)
+    return Kernel::GEMM;
+  if (isChain(operands, i, k, Expr::ExprProperty::LOWER_TRIANGULAR))
+    return Kernel::TRMM_LOWER;
+  if (isChain(operands, i, k, Expr::ExprProperty::UPPER_TRIANGULAR))
+    return Kernel::TRMM_UPPER;
+  if ((i == k &&
+       hasKnownProperty(operands[i - 1], Expr::ExprProperty::SYMMETRIC)) ||
+      isMirrored(operands, i, k))
+    return Kernel::SYMM;
+  return Kernel::GEMM;
+}
+
+/// Evaluate the split tree of a plan, with the intermediates at the offsets
+/// of the memory plan in `arena`. The tree is the dependency DAG of the
+/// sub-products: with a pool, the two sub-chains of a node are computed
+/// concurrently, each with half of the node's threads, and a node whose
+/// threads are not used by its children splits its own kernel by columns.
+class Evaluator {
+public:
+  Evaluator(const ResultMCP &plan, const vector<Expr *> &operands,
+            const vector<MatrixRef> &leaves, const MemoryPlan &memory,
+            double *arena, ThreadPool *pool)
+      : plan(plan), operands(operands), leaves(leaves), memory(memory),
+        arena(arena), pool(pool) {}
+
+  /// Write the product of leaves i..j (1-based, i < j) into `out` using up
+  /// to `threads` threads.
+  void run(size_t i, size_t j, double *out, unsigned threads) {
+    size_t k = plan.getSplit(i, j);
+    MatrixRef lhs, rhs;
+    if (isSyrk(operands, i, k, j)) {
+      lhs = get(i, k, threads);
+      rhs = lhs.transpose();
+    } else if (isFork(operands, i, k, j, threads)) {
+      unsigned half = threads / 2;
+      ThreadPool::TaskGroup group;
+      pool->async(group, [&]() { lhs = get(i, k, half); });
+      rhs = get(k + 1, j, threads - half);
+      pool->wait(group);
+    } else {
+      lhs = get(i, k, threads);
+      rhs = get(k + 1, j, threads);
+    }
+    Kernel kernel = getKernel(operands, i, k, j);
+    long ldc = getCols(j), cols = rhs.cols;
+    double flops = 2.0 * lhs.rows * lhs.cols * cols;
+    // the factor of a solve with leaf i is planned at (i, i).
+    double *workspace = arena + memory.offsets(i, i);
+    if (threads == 1 || flops < MIN_PARALLEL_FLOPS ||
+        isFactorization(kernel)) {
+      multiply(kernel, lhs, rhs, out, ldc, 0, cols, workspace);
+    } else {
+      // a few chunks per thread, in whole micro-kernel panels.
+      long chunk = (cols / (4 * threads) + 7) / 8 * 8;
+      pool->parallelFor(0, cols, std::max(8l, chunk),
+                        [&](size_t first, size_t last) {
+                          multiply(kernel, lhs, rhs, out, ldc, first, last,
+                                   workspace);
+                        });
+      if (kernel == Kernel::SYRK)
+        for (long r = 0; r < cols; r++)
+          for (long c = r + 1; c < cols; c++)
+            out[r * ldc + c] = out[c * ldc + r];
+    }
+  }
+
+  long getRows(size_t i) const { return leaves[i - 1].rows; }
+  long getCols(size_t j) const { return leaves[j - 1].cols; }
+
+private:
+  /// The leaf, or the sub-chain i..j computed into its planned buffer.
+  MatrixRef get(size_t i, size_t j, unsigned threads) {
+    if (i == j)
+      return leaves[i - 1];
+    double *buffer = arena + memory.offsets(i, j);
+    run(i, j, buffer, threads);
+    return getRowMajor(buffer, getRows(i), getCols(j));
+  }
+
+  const ResultMCP &plan;
+  const vector<Expr *> &operands;
+  const vector<MatrixRef> &leaves;
+  const MemoryPlan &memory;
+  double *arena;
+  ThreadPool *pool;
+};
+
+/// Mark the leaves of the subtree of i..j that are inverses on the left of
+/// a product: the product solves with them, the others are inverted
+/// explicitly. The cost model prices the chain the same way.
+void getSolvedLeaves(const ResultMCP &plan, const vector<Expr *> &operands,
+                     size_t i, size_t j, vector<bool> &solved) {
+  if (i == j)
+    return;
+  size_t k = plan.getSplit(i, j);
+  if (i == k && hasInverse(operands[i - 1]))
+    solved[i - 1] = true;
+  getSolvedLeaves(plan, operands, i, k, solved);
+  getSolvedLeaves(plan, operands, k + 1, j, solved);
+}
+
+vector<bool> getSolvedLeaves(const ResultMCP &plan,
+                             const vector<Expr *> &operands) {
+  vector<bool> solved(operands.size(), false);
+  getSolvedLeaves(plan, operands, 1, operands.size(), solved);
+  return solved;
+}
+
+/// A buffer of the memory plan: the product of leaves i..j (or, if i == j,
+/// the inverse of leaf i or the factor of a solve with it) and the
+/// evaluation steps during which it is alive.
+struct Lifetime {
+  size_t i, j;
+  size_t size;
+  size_t first, last;
+};
+
+/// Number the products of the subtree of i..j in the order the evaluator
+/// computes them and append their lifetimes. Returns the index of i..j.
+size_t getLifetimes(const ResultMCP &plan, const vector<Expr *> &operands,
+                    const vector<long> &pVector, size_t i, size_t j,
+                    unsigned threads, size_t &step,
+                    vector<Lifetime> &lifetimes) {
+  size_t k = plan.getSplit(i, j);
+  bool fork = isFork(operands, i, k, j, threads);
+  // a SYRK does not compute its right side.
+  bool hasRight = k + 1 < j && !isSyrk(operands, i, k, j);
+  unsigned leftThreads = fork ? threads / 2 : threads;
+  unsigned rightThreads = fork ? threads - leftThreads : threads;
+  size_t begin = lifetimes.size();
+  size_t left = i < k ? getLifetimes(plan, operands, pVector, i, k,
+                                     leftThreads, step, lifetimes)
+                      : 0;
+  size_t middle = lifetimes.size();
+  size_t right = hasRight ? getLifetimes(plan, operands, pVector, k + 1, j,
+                                          rightThreads, step, lifetimes)
+                           : 0;
+  size_t current = ++step;
+  if (i < k)
+    lifetimes[left].last = current;
+  if (hasRight)
+    lifetimes[right].last = current;
+  if (fork) {
+    // in steps of a serial evaluation, both sides may be alive from the
+    // first product of the left one to the last of the right one.
+    size_t firstLeft = lifetimes[begin].first;
+    size_t lastRight = lifetimes[right].first;
+    for (size_t l = begin; l < middle; l++)
+      lifetimes[l].last = std::max(lifetimes[l].last, lastRight);
+    for (size_t l = middle; l < lifetimes.size(); l++)
+      lifetimes[l].first = std::min(lifetimes[l].first, firstLeft);
+  }
+  if (i == k && hasInverse(operands[i - 1]) &&
+      isFactorization(getSolveKernel(operands[i - 1]))) {
+    size_t size = pVector[i - 1] * pVector[i];
+    lifetimes.push_back({i, i, size, current, current});
+  }
+  size_t size = pVector[i - 1] * pVector[j];
+  lifetimes.push_back({i, j, size, current, current});
+  return lifetimes.size() - 1;
+}
+
+} // end namespace
+
+MemoryPlan matrixchain::planMemory(Expr *expr, const ResultMCP &plan,
+                                   unsigned numThreads) {
+  vector<Expr *> operands = collectOperands(expr);
+  const size_t n = operands.size();
+  assert(plan.size() == n && "the plan is for another chain");
+  vector<long> pVector = {getShape(operands[0]).first};
+  for (auto operand : operands)
+    pVector.push_back(getShape(operand).second);
+  // explicit inverses are computed first (step 0) and live until the end,
+  // their workspace is dead afterwards.
+  const size_t end = std::numeric_limits<size_t>::max();
+  vector<Lifetime> lifetimes;
+  size_t scratch = 0;
+  vector<bool> solved = getSolvedLeaves(plan, operands);
+  for (size_t i = 1; i <= n; i++)
+    if (hasInverse(operands[i - 1]) && !solved[i - 1]) {
+      size_t size = pVector[i - 1] * pVector[i];
+      lifetimes.push_back({i, i, size, 0, end});
+      scratch = std::max(scratch, size);
+    }
+  if (scratch)
+    lifetimes.push_back({0, 0, scratch, 0, 0});
+  if (n > 1) {
+    size_t step = 0;
+    getLifetimes(plan, operands, pVector, 1, n, std::max(1u, numThreads),
+                 step, lifetimes);
+    // the root is written to the output.
+    lifetimes.pop_back();
+  }
+
+  // Interval graph coloring: in order of first step, every lifetime takes
+  // a buffer whose last occupant is dead, the smallest that fits or else
+  // the largest one, which grows.
+  std::stable_sort(lifetimes.begin(), lifetimes.end(),
+                   [](const Lifetime &a, const Lifetime &b) {
+                     return a.first < b.first;
+                   });
+  struct Buffer {
+    size_t size;
+    size_t last;
+  };
+  vector<Buffer> buffers;
+  vector<size_t> assignment;
+  for (const auto &lifetime : lifetimes) {
+    size_t best = buffers.size();
+    for (size_t b = 0; b < buffers.size(); b++) {
+      if (buffers[b].last >= lifetime.first)
+        continue;
+      if (best == buffers.size()) {
+        best = b;
+        continue;
+      }
+      bool fits = buffers[b].size >= lifetime.size;
+      bool bestFits = buffers[best].size >= lifetime.size;
+      if (fits ? !bestFits || buffers[b].size < buffers[best].size
+               : !bestFits && buffers[b].size > buffers[best].size)
+        best = b;
+    }
+    if (best == buffers.size())
+      buffers.push_back({0, 0});
+    buffers[best].size = std::max(buffers[best].size, lifetime.size);
+    buffers[best].last = lifetime.last;
+    assignment.push_back(best);
+  }
+
+  vector<size_t> bases;
+  MemoryPlan memory;
+  for (const auto &buffer : buffers) {
+    bases.push_back(memory.size);
+    memory.size += buffer.size;
+  }
+  memory.numBuffers = buffers.size();
+  memory.offsets.reset(n, 0);
+  for (size_t l = 0; l < lifetimes.size(); l++) {
+    if (lifetimes[l].i == 0)
+      memory.scratch = bases[assignment[l]];
+    else
+      memory.offsets(lifetimes[l].i, lifetimes[l].j) = bases[assignment[l]];
+  }
+  return memory;
+}
+
+PreparedChain::PreparedChain(Expr *expr, const ResultMCP &plan,
+                             unsigned numThreads)
+    : plan(plan), operands(collectOperands(expr)),
+      flops(getPlanFlops(expr, plan)),
+      memory(planMemory(expr, plan, numThreads)), arena(memory.size),
+      solved(getSolvedLeaves(plan, operands)),
+      numThreads(std::max(1u, numThreads)) {
+  leaves.resize(operands.size());
+  if (this->numThreads > 1)
+    pool.reset(new ThreadPool(this->numThreads));
+}
+
+PreparedChain::~PreparedChain() = default;
+
+void PreparedChain::run(const Bindings &bindings, double *out) {
+  const size_t n = operands.size();
+  for (size_t i = 1; i <= n; i++) {
+    double *inverse =
+        solved[i - 1] ? nullptr : arena.data() + memory.offsets(i, i);
+    leaves[i - 1] = getLeaf(operands[i - 1], bindings, inverse,
+                            arena.data() + memory.scratch);
+  }
+  for (size_t i = 1; i < n; i++)
+    assert(leaves[i - 1].cols == leaves[i].rows && "shape mismatch");
+  if (n == 1) {
+    const MatrixRef &ref = leaves[0];
+    for (long i = 0; i < ref.rows; i++)
+      for (long j = 0; j < ref.cols; j++)
+        out[i * ref.cols + j] = ref(i, j);
+    return;
+  }
+  Evaluator(plan, operands, leaves, memory, arena.data(), pool.get())
+      .run(1, n, out, numThreads);
+}
+
+void matrixchain::evaluate(Expr *expr, const ResultMCP &plan,
+                           const Bindings &bindings, double *out,
+                           unsigned numThreads) {
+  PreparedChain(expr, plan, numThreads).run(bindings, out);
+}
+
+void matrixchain::evaluate(Expr *expr, const Bindings &bindings, double *out,
+                           const MCPOptions &options) {
+  evaluate(expr, runMCP(expr, options), bindings, out, options.numThreads);
+}
+
+namespace {
+
+/// Kernels of the generated code, in order of definition: a kernel only
+/// calls the ones before it. They are naive loops over strided views, with
+/// the shapes as arguments, so that the file compiles on its own.
+struct GeneratedKernel {
+  const char *name;
+  const char *source;
+};
+
+const GeneratedKernel GENERATED_KERNELS[] = {
+    {"copy",
+     R"(/// C = B, for an m x n B (which may be C itself).
+void copy(long m, long n, Ref b, double *c, long ldc) {
+  for (long i = 0; i < m; i++)
+    for (long j = 0; j < n; j++)
+      c[i * ldc + j] = b(i, j);
+}
+)"},
+    {"identity",
+     R"(/// C = I, for an n x n C.
+void identity(long n, double *c) {
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < n; j++)
+      c[i * n + j] = i == j ? 1.0 : 0.0;
+}
+)"},
+    {"gemm",
+     R"(/// C = A * B, for an m x k A and a k x n B.
+void gemm(long m, long k, long n, Ref a, Ref b, double *c, long ldc) {
+  for (long i = 0; i < m; i++) {
+    double *row = c + i * ldc;
+    for (long j = 0; j < n; j++)
+      row[j] = 0.0;
+    for (long p = 0; p < k; p++) {
+      const double aip = a(i, p);
+      for (long j = 0; j < n; j++)
+        row[j] += aip * b(p, j);
+    }
+  }
+}
+)"},
+    {"trmmLower",
+     R"(/// C = L * B, only reading the lower triangle of the m x m L.
+void trmmLower(long m, long n, Ref l, Ref b, double *c, long ldc) {
+  for (long i = 0; i < m; i++) {
+    double *row = c + i * ldc;
+    for (long j = 0; j < n; j++)
+      row[j] = 0.0;
+    for (long p = 0; p <= i; p++) {
+      const double lip = l(i, p);
+      for (long j = 0; j < n; j++)
+        row[j] += lip * b(p, j);
+    }
+  }
+}
+)"},
+    {"trmmUpper",
+     R"(/// C = U * B, only reading the upper triangle of the m x m U.
+void trmmUpper(long m, long n, Ref u, Ref b, double *c, long ldc) {
+  for (long i = 0; i < m; i++) {
+    double *row = c + i * ldc;
+    for (long j = 0; j < n; j++)
+      row[j] = 0.0;
+    for (long p = i; p < m; p++) {
+      const double uip = u(i, p);
+      for (long j = 0; j < n; j++)
+        row[j] += uip * b(p, j);
+    }
+  }
+}
+)"},
+    {"symm",
+     R"(/// C = S * B, only reading the lower triangle of the m x m S.
+void symm(long m, long n, Ref s, Ref b, double *c, long ldc) {
+  for (long i = 0; i < m; i++) {
+    double *row = c + i * ldc;
+    for (long j = 0; j < n; j++)
+      row[j] = 0.0;
+    for (long p = 0; p < m; p++) {
+      const double sip = p <= i ? s(i, p) : s(p, i);
+      for (long j = 0; j < n; j++)
+        row[j] += sip * b(p, j);
+    }
+  }
+}
+)"},
+    {"syrk",
+     R"(/// C = A * A^T, for an m x k A: the lower triangle, mirrored.
+void syrk(long m, long k, Ref a, double *c, long ldc) {
+  for (long i = 0; i < m; i++)
+    for (long j = 0; j <= i; j++) {
+      double sum = 0.0;
+      for (long p = 0; p < k; p++)
+        sum += a(i, p) * a(j, p);
+      c[i * ldc + j] = sum;
+      c[j * ldc + i] = sum;
+    }
+}
+)"},
+    {"trsmLower",
+     R"(/// C = L^-1 * B by forward substitution, only reading the lower
+/// triangle of the m x m L. B may be C itself.
+void trsmLower(long m, long n, Ref l, Ref b, double *c, long ldc) {
+  copy(m, n, b, c, ldc);
+  for (long i = 0; i < m; i++) {
+    double *row = c + i * ldc;
+    for (long p = 0; p < i; p++) {
+      const double lip = l(i, p);
+      for (long j = 0; j < n; j++)
+        row[j] -= lip * c[p * ldc + j];
+    }
+    const double diagonal = l(i, i);
+    for (long j = 0; j < n; j++)
+      row[j] /= diagonal;
+  }
+}
+)"},
+    {"trsmUpper",
+     R"(/// C = U^-1 * B by backward substitution, only reading the upper
+/// triangle of the m x m U. B may be C itself.
+void trsmUpper(long m, long n, Ref u, Ref b, double *c, long ldc) {
+  copy(m, n, b, c, ldc);
+  for (long i = m - 1; i >= 0; i--) {
+    double *row = c + i * ldc;
+    for (long p = i + 1; p < m; p++) {
+      const double uip = u(i, p);
+      for (long j = 0; j < n; j++)
+        row[j] -= uip * c[p * ldc + j];
+    }
+    const double diagonal = u(i, i);
+    for (long j = 0; j < n; j++)
+      row[j] /= diagonal;
+  }
+}
+)"},
+    {"posv",
+     R"(/// C = A^-1 * B for an SPD A, by its Cholesky factor A = U^T U in the
+/// m x m workspace, only reading the upper triangle of A (as the library
+/// posv). B may be C itself.
+void posv(long m, long n, Ref a, Ref b, double *c, long ldc, double *w) {
+  for (long i = 0; i < m; i++) {
+    for (long j = i; j < m; j++) {
+      double sum = a(i, j);
+      for (long p = 0; p < i; p++)
+        sum -= w[p * m + i] * w[p * m + j];
+      w[i * m + j] = sum;
+    }
+    const double diagonal = std::sqrt(w[i * m + i]);
+    for (long j = i; j < m; j++)
+      w[i * m + j] /= diagonal;
+  }
+  trsmLower(m, n, Ref{w, 1, m}, b, c, ldc);
+  trsmUpper(m, n, Ref{w, m, 1}, Ref{c, ldc, 1}, c, ldc);
+}
+)"},
+    {"gesv",
+     R"(/// C = A^-1 * B by Gaussian elimination with partial pivoting of A
+/// in the m x m workspace. B may be C itself.
+void gesv(long m, long n, Ref a, Ref b, double *c, long ldc, double *w) {
+  copy(m, m, a, w, m);
+  copy(m, n, b, c, ldc);
+  for (long j = 0; j < m; j++) {
+    long pivot = j;
+    for (long i = j + 1; i < m; i++)
+      if (std::fabs(w[i * m + j]) > std::fabs(w[pivot * m + j]))
+        pivot = i;
+    for (long q = 0; q < m && pivot != j; q++) {
+      const double t = w[j * m + q];
+      w[j * m + q] = w[pivot * m + q];
+      w[pivot * m + q] = t;
+    }
+    for (long q = 0; q < n && pivot != j; q++) {
+      const double t = c[j * ldc + q];
+      c[j * ldc + q] = c[pivot * ldc + q];
+      c[pivot * ldc + q] = t;
+    }
+    for (long i = j + 1; i < m; i++) {
+      const double factor = w[i * m + j] / w[j * m + j];
+      for (long q = j + 1; q < m; q++)
+        w[i * m + q] -= factor * w[j * m + q];
+      for (long q = 0; q < n; q++)
+        c[i * ldc + q] -= factor * c[j * ldc + q];
+    }
+  }
+  trsmUpper(m, n, Ref{w, m, 1}, Ref{c, ldc, 1}, c, ldc);
+}
+)"},
+};
+
+/// Kernels called by each generated kernel.
+vector<string> getCallees(const string &name) {
+  if (name == "trsmLower" || name == "trsmUpper")
+    return {"copy"};
+  if (name == "posv")
+    return {"trsmLower", "trsmUpper"};
+  if (name == "gesv")
+    return {"copy", "trsmUpper"};
+  return {};
+}
+
+const char *getGeneratedName(Kernel kernel) {
+  switch (kernel) {
+  case Kernel::GEMM:
+    return "gemm";
+  case Kernel::TRMM_LOWER:
+    return "trmmLower";
+  case Kernel::TRMM_UPPER:
+    return "trmmUpper";
+  case Kernel::SYMM:
+    return "symm";
+  case Kernel::SYRK:
+    return "syrk";
+  case Kernel::TRSM_LOWER:
+    return "trsmLower";
+  case Kernel::TRSM_UPPER:
+    return "trsmUpper";
+  case Kernel::POSV:
+    return "posv";
+  default:
+    assert(kernel == Kernel::GESV && "unknown kernel");
+    return "gesv";
+  }
+}
+
+/// Helpers of the generated test: a deterministic generator, the properties
+/// of the inputs and a naive evaluation.
+const char *const GENERATED_REFERENCE = R"(namespace reference {
+
+/// Deterministic values in [-1, 1).
+std::vector<double> random(long rows, long cols, unsigned seed) {
+  std::vector<double> matrix(rows * cols);
+  for (auto &value : matrix) {
+    seed = seed * 1664525u + 1013904223u;
+    value = (seed >> 8) / double(1u << 23) - 1.0;
+  }
+  return matrix;
+}
+
+/// Diagonally dominant, so that it is well conditioned.
+void makeDominant(std::vector<double> &matrix, long n) {
+  for (long i = 0; i < n; i++)
+    matrix[i * n + i] += n;
+}
+
+void makeLower(std::vector<double> &matrix, long n) {
+  for (long i = 0; i < n; i++)
+    for (long j = i + 1; j < n; j++)
+      matrix[i * n + j] = 0.0;
+}
+
+void makeUpper(std::vector<double> &matrix, long n) {
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < i; j++)
+      matrix[i * n + j] = 0.0;
+}
+
+void makeSymmetric(std::vector<double> &matrix, long n) {
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < i; j++)
+      matrix[j * n + i] = matrix[i * n + j];
+}
+
+std::vector<double> transpose(const std::vector<double> &matrix, long rows,
+                              long cols) {
+  std::vector<double> result(rows * cols);
+  for (long i = 0; i < rows; i++)
+    for (long j = 0; j < cols; j++)
+      result[j * rows + i] = matrix[i * cols + j];
+  return result;
+}
+
+/// Gauss-Jordan elimination with partial pivoting.
+std::vector<double> inverse(std::vector<double> matrix, long n) {
+  std::vector<double> result(n * n, 0.0);
+  for (long i = 0; i < n; i++)
+    result[i * n + i] = 1.0;
+  for (long j = 0; j < n; j++) {
+    long pivot = j;
+    for (long i = j + 1; i < n; i++)
+      if (std::fabs(matrix[i * n + j]) > std::fabs(matrix[pivot * n + j]))
+        pivot = i;
+    for (long q = 0; q < n; q++) {
+      std::swap(matrix[j * n + q], matrix[pivot * n + q]);
+      std::swap(result[j * n + q], result[pivot * n + q]);
+    }
+    const double diagonal = matrix[j * n + j];
+    for (long q = 0; q < n; q++) {
+      matrix[j * n + q] /= diagonal;
+      result[j * n + q] /= diagonal;
+    }
+    for (long i = 0; i < n; i++) {
+      const double factor = matrix[i * n + j];
+      if (i == j || factor == 0.0)
+        continue;
+      for (long q = 0; q < n; q++) {
+        matrix[i * n + q] -= factor * matrix[j * n + q];
+        result[i * n + q] -= factor * result[j * n + q];
+      }
+    }
+  }
+  return result;
+}
+
+std::vector<double> product(const std::vector<double> &a,
+                            const std::vector<double> &b, long m, long k,
+                            long n) {
+  std::vector<double> result(m * n, 0.0);
+  for (long i = 0; i < m; i++)
+    for (long p = 0; p < k; p++)
+      for (long j = 0; j < n; j++)
+        result[i * n + j] += a[i * k + p] * b[p * n + j];
+  return result;
+}
+
+} // end namespace reference
+)";
+
+/// Whether `name` can name a parameter of the generated function.
+bool isIdentifier(const string &name) {
+  static const std::set<string> reserved = {
+      "Ref",   "auto",  "bool",   "char",      "class",  "const", "delete",
+      "do",    "double", "else",  "enum",      "false",  "float", "for",
+      "if",    "int",   "long",   "main",      "new",    "out",   "return",
+      "short", "std",   "struct", "reference", "this",   "true",  "void",
+      "while", "workspace"};
+  if (name.empty() || reserved.count(name) ||
+      std::isdigit(static_cast<unsigned char>(name[0])) || name[0] == '_')
+    return false;
+  for (char c : name)
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+      return false;
+  return !std::any_of(std::begin(GENERATED_KERNELS),
+                      std::end(GENERATED_KERNELS),
+                      [&](const GeneratedKernel &kernel) {
+                        return name == kernel.name;
+                      });
+}
+
+/// A leaf or an intermediate in the generated code: the C++ expression of
+/// its data, with its shape and strides.
+struct GeneratedRef {
+  string data;
+  long rows, cols;
+  long rowStride, colStride;
+
+  GeneratedRef transpose() const {
+    return {data, cols, rows, colStride, rowStride};
+  }
+  string str() const {
+    return "Ref{" + data + ", " + std::to_string(rowStride) + ", " +
+           std::to_string(colStride) + "}";
+  }
+};
+
+/// Emits the statements of a plan, in the order of a serial evaluation.
+class Emitter {
+public:
+  Emitter(const ResultMCP &plan, const vector<Expr *> &operands,
+          const MemoryPlan &memory,
+          const std::unordered_map<const Operand *, string> &parameters)
+      : plan(plan), operands(operands), memory(memory),
+        parameters(parameters) {}
+
+  /// The leaves, computing the explicit inverses (see PreparedChain::run).
+  void emitLeaves() {
+    vector<bool> solved = getSolvedLeaves(plan, operands);
+    for (size_t i = 1; i <= operands.size(); i++)
+      leaves.push_back(
+          getLeaf(operands[i - 1], solved[i - 1] ? "" : getBuffer(i, i)));
+  }
+
+  /// Write the product of leaves i..j (i < j) into `out` (see Evaluator).
+  void run(size_t i, size_t j, const string &out) {
+    size_t k = plan.getSplit(i, j);
+    Kernel kernel = getKernel(operands, i, k, j);
+    GeneratedRef lhs = get(i, k);
+    GeneratedRef rhs =
+        kernel == Kernel::SYRK ? lhs.transpose() : get(k + 1, j);
+    const string name = getGeneratedName(kernel);
+    use(name);
+    body << "  // " << getParens(i, j) << "\n  " << name << "(" << lhs.rows
+         << ", ";
+    if (kernel == Kernel::GEMM || kernel == Kernel::SYRK)
+      body << lhs.cols << ", ";
+    if (kernel != Kernel::SYRK)
+      body << rhs.cols << ", ";
+    body << lhs.str() << ", ";
+    if (kernel != Kernel::SYRK)
+      body << rhs.str() << ", ";
+    body << out << ", " << rhs.cols;
+    // the factor of a solve with leaf i is planned at (i, i).
+    if (isFactorization(kernel))
+      body << ", " << getBuffer(i, i);
+    body << ");\n";
+  }
+
+  /// Copy the single leaf of a chain into `out`.
+  void emitCopy(const string &out) {
+    const GeneratedRef &leaf = leaves[0];
+    use("copy");
+    body << "  // " << getParens(1, 1) << "\n  copy(" << leaf.rows << ", "
+         << leaf.cols << ", " << leaf.str() << ", " << out << ", "
+         << leaf.cols << ");\n";
+  }
+
+  const GeneratedRef &getLeaf(size_t i) const { return leaves[i - 1]; }
+  const std::set<string> &getUsed() const { return used; }
+  string getBody() const { return body.str(); }
+
+  /// The sub-chain i..j with its brackets.
+  string getParens(size_t i, size_t j) const {
+    if (i == j)
+      return getLeafName(operands[i - 1]);
+    size_t k = plan.getSplit(i, j);
+    auto side = [&](size_t first, size_t last) {
+      string parens = getParens(first, last);
+      return first < last ? "(" + parens + ")" : parens;
+    };
+    return side(i, k) + " " + side(k + 1, j);
+  }
+
+private:
+  /// Mark the kernel `name` and its callees as used.
+  void use(const string &name) {
+    if (!used.insert(name).second)
+      return;
+    for (const auto &callee : getCallees(name))
+      use(callee);
+  }
+
+  string getBuffer(size_t i, size_t j) const {
+    return "workspace + " + std::to_string(memory.offsets(i, j));
+  }
+
+  string getLeafName(Expr *expr) const {
+    if (auto operand = llvm::dyn_cast<Operand>(expr))
+      return parameters.at(operand);
+    auto unaryOp = llvm::cast<UnaryOp>(expr);
+    bool isInverse = unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE;
+    return getLeafName(unaryOp->getChild()) + (isInverse ? "^-1" : "^T");
+  }
+
+  /// The leaf `expr`, as getLeaf in the evaluator: an inverse is computed
+  /// into the buffer `inverse`, unless it is empty.
+  GeneratedRef getLeaf(Expr *expr, const string &inverse) {
+    if (auto operand = llvm::dyn_cast<Operand>(expr)) {
+      long rows = operand->getShape()[0], cols = operand->getShape()[1];
+      return {parameters.at(operand), rows, cols, cols, 1};
+    }
+    auto unaryOp = llvm::cast<UnaryOp>(expr);
+    GeneratedRef child = getLeaf(unaryOp->getChild(), inverse);
+    if (unaryOp->getKind() != UnaryOp::UnaryOpKind::INVERSE)
+      return child.transpose();
+    if (inverse.empty())
+      return child;
+    const long n = child.rows;
+    const GeneratedRef result = {inverse, n, n, n, 1};
+    Kernel kernel = getSolveKernel(expr);
+    const string name = getGeneratedName(kernel);
+    use("identity");
+    use(name);
+    body << "  // " << getLeafName(expr) << "\n  identity(" << n << ", "
+         << inverse << ");\n  " << name << "(" << n << ", " << n << ", "
+         << child.str() << ", " << result.str() << ", " << inverse << ", "
+         << n;
+    if (isFactorization(kernel))
+      body << ", workspace + " << memory.scratch;
+    body << ");\n";
+    return result;
+  }
+
+  /// The leaf, or the sub-chain i..j computed into its planned buffer.
+  GeneratedRef get(size_t i, size_t j) {
+    if (i == j)
+      return leaves[i - 1];
+    string buffer = getBuffer(i, j);
+    run(i, j, buffer);
+    long rows = leaves[i - 1].rows, cols = leaves[j - 1].cols;
+    return {buffer, rows, cols, cols, 1};
+  }
+
+  const ResultMCP &plan;
+  const vector<Expr *> &operands;
+  const MemoryPlan &memory;
+  const std::unordered_map<const Operand *, string> &parameters;
+  vector<GeneratedRef> leaves;
+  std::set<string> used;
+  std::ostringstream body;
+};
+
+/// The leaf `expr` in the reference evaluation of the generated test.
+string getReferenceLeaf(
+    Expr *expr,
+    const std::unordered_map<const Operand *, string> &parameters) {
+  if (auto operand = llvm::dyn_cast<Operand>(expr))
+    return parameters.at(operand);
+  auto unaryOp = llvm::cast<UnaryOp>(expr);
+  auto shape = getShape(unaryOp->getChild());
+  string child = getReferenceLeaf(unaryOp->getChild(), parameters);
+  if (unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE)
+    return "reference::inverse(" + child + ", " +
+           std::to_string(shape.first) + ")";
+  return "reference::transpose(" + child + ", " +
+         std::to_string(shape.first) + ", " + std::to_string(shape.second) +
+         ")";
+}
+
+} // end namespace
+
+void matrixchain::generateEvaluator(Expr *expr, const ResultMCP &plan,
+                                    std::ostream &os,
+                                    const CodegenOptions &options) {
+  vector<Expr *> operands = collectOperands(expr);
+  const size_t n = operands.size();
+  assert(plan.size() == n && "the plan is for another chain");
+  MemoryPlan memory = planMemory(expr, plan);
+
+  // the distinct operands, in order of appearance, name the parameters.
+  vector<Operand *> inputs;
+  std::unordered_map<const Operand *, string> parameters;
+  for (auto leaf : operands) {
+    while (auto unaryOp = llvm::dyn_cast<UnaryOp>(leaf))
+      leaf = unaryOp->getChild();
+    auto operand = llvm::cast<Operand>(leaf);
+    if (parameters.count(operand))
+      continue;
+    string name = operand->getName();
+    bool isTaken = std::any_of(
+        parameters.begin(), parameters.end(),
+        [&](const std::pair<const Operand *const, string> &parameter) {
+          return parameter.second == name;
+        });
+    if (!isIdentifier(name) || isTaken)
+      name = "operand" + std::to_string(inputs.size());
+    inputs.push_back(operand);
+    parameters[operand] = name;
+  }
+
+  Emitter emitter(plan, operands, memory, parameters);
+  emitter.emitLeaves();
+  if (n == 1)
+    emitter.emitCopy("out");
+  else
+    emitter.run(1, n, "out");
+  const long rows = emitter.getLeaf(1).rows, cols = emitter.getLeaf(n).cols;
+  const string parens = emitter.getParens(1, n);
+
+  os << "// Generated by generateEvaluator: out = " << parens
+     << ", at a cost of " << plan.getOptimalCost() << ".\n\n"
+     << "#include <cmath>\n#include <cstddef>\n";
+  if (options.emitTest)
+    os << "#include <cstdio>\n#include <utility>\n#include <vector>\n";
+  os << "\nnamespace {\n\n"
+     << "/// Strided view of a matrix: element (i, j) is\n"
+     << "/// data[i * rowStride + j * colStride].\n"
+     << "struct Ref {\n"
+     << "  const double *data;\n"
+     << "  long rowStride, colStride;\n\n"
+     << "  double operator()(long i, long j) const {\n"
+     << "    return data[i * rowStride + j * colStride];\n"
+     << "  }\n"
+     << "};\n";
+  for (const auto &kernel : GENERATED_KERNELS)
+    if (emitter.getUsed().count(kernel.name))
+      os << "\n" << kernel.source;
+  os << "\n} // end namespace\n\n"
+     << "/// Doubles in the workspace of " << options.name << ".\n"
+     << "const std::size_t " << options.name
+     << "WorkspaceSize = " << memory.size << ";\n\n"
+     << "/// out = " << parens << ", " << rows << " x " << cols
+     << " row-major.\n"
+     << "void " << options.name << "(";
+  for (auto input : inputs)
+    os << "const double *" << parameters[input] << ", ";
+  os << "double *out, double *workspace) {\n";
+  if (!memory.size)
+    os << "  (void)workspace;\n";
+  os << emitter.getBody() << "}\n";
+  if (!options.emitTest)
+    return;
+
+  os << "\n" << GENERATED_REFERENCE << "\nint main() {\n";
+  unsigned seed = 1;
+  for (auto input : inputs) {
+    const string &name = parameters[input];
+    long inputRows = input->getShape()[0], inputCols = input->getShape()[1];
+    os << "  std::vector<double> " << name << " = reference::random("
+       << inputRows << ", " << inputCols << ", " << seed++ << ");\n";
+    if (inputRows != inputCols)
+      continue;
+    // the inputs have the properties the plan relies on.
+    if (hasKnownProperty(input, Expr::ExprProperty::LOWER_TRIANGULAR))
+      os << "  reference::makeLower(" << name << ", " << inputRows << ");\n";
+    if (hasKnownProperty(input, Expr::ExprProperty::UPPER_TRIANGULAR))
+      os << "  reference::makeUpper(" << name << ", " << inputRows << ");\n";
+    if (hasKnownProperty(input, Expr::ExprProperty::SYMMETRIC) ||
+        hasKnownProperty(input, Expr::ExprProperty::SPD))
+      os << "  reference::makeSymmetric(" << name << ", " << inputRows
+         << ");\n";
+    os << "  reference::makeDominant(" << name << ", " << inputRows << ");\n";
+  }
+  os << "  std::vector<double> out(" << rows * cols << "), workspace("
+     << options.name << "WorkspaceSize);\n  " << options.name << "(";
+  for (auto input : inputs)
+    os << parameters[input] << ".data(), ";
+  os << "out.data(), workspace.data());\n\n"
+     << "  std::vector<double> expected = "
+     << getReferenceLeaf(operands[0], parameters) << ";\n";
+  for (size_t i = 2; i <= n; i++)
+    os << "  expected = reference::product(expected, "
+       << getReferenceLeaf(operands[i - 1], parameters) << ", " << rows
+       << ", " << emitter.getLeaf(i).rows << ", " << emitter.getLeaf(i).cols
+       << ");\n";
+  os << "  double scale = 1.0;\n"
+     << "  for (double value : expected)\n"
+     << "    scale = std::fmax(scale, std::fabs(value));\n"
+     << "  for (std::size_t e = 0; e < out.size(); e++)\n"
+     << "    if (!(std::fabs(out[e] - expected[e]) <= 1e-9 * scale)) {\n"
+     << "      std::printf(\"" << options.name
+     << ": out[%zu] is %g, expected %g\\n\", e, out[e],\n"
+     << "                  expected[e]);\n"
+     << "      return 1;\n"
+     << "    }\n"
+     << "  std::printf(\"" << options.name << ": ok\\n\");\n"
+     << "  return 0;\n"
+     << "}\n";
+}
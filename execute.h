@@ -0,0 +1,134 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_EXECUTE_H
+#define MATRIX_CHAIN_EXECUTE_H
+
+#include "chain.h"
+#include "kernels.h"
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+
+namespace details {
+class ThreadPool;
+} // end namespace details
+
+namespace matrixchain {
+
+/// Row-major buffer of every operand, shaped like the operand.
+using Bindings = std::unordered_map<const Operand *, const double *>;
+
+/// Evaluate the chain `expr` into the row-major buffer `out` following the
+/// split table of `plan` (from runMCP on the same chain). Leaves may be
+/// operands, transposes and inverses of operands. A product with an inverse
+/// leaf on its left is a solve (triangular, Cholesky or LU, after the
+/// properties of the leaf), the other inverses are computed explicitly.
+/// Intermediates share buffers after planMemory, use PreparedChain to
+/// evaluate a chain many times. With numThreads > 1 independent
+/// sub-products run concurrently and large products are split across the
+/// threads.
+void evaluate(Expr *expr, const ResultMCP &plan, const Bindings &bindings,
+              double *out, unsigned numThreads = 1);
+
+/// Placement of the intermediates of a plan in one arena of doubles. An
+/// intermediate lives from its computation to the one of its parent, and
+/// intermediates whose lifetimes do not overlap share a buffer (interval
+/// graph coloring), so the peak memory is known before evaluation starts.
+struct MemoryPlan {
+  /// Offset of the product of leaves i..j. At (i, i), the explicit inverse
+  /// of leaf i, or the factor of the solve with it.
+  TriangularTable<size_t> offsets;
+  /// Offset of the workspace of the inverses.
+  size_t scratch = 0;
+  /// Doubles in the arena.
+  size_t size = 0;
+  size_t numBuffers = 0;
+
+  size_t getPeakBytes() const { return size * sizeof(double); }
+};
+
+/// Plan the intermediates of evaluating `expr` with `plan` on numThreads
+/// threads. Products that may run concurrently never share a buffer.
+MemoryPlan planMemory(Expr *expr, const ResultMCP &plan,
+                      unsigned numThreads = 1);
+
+/// A chain ready to be evaluated repeatedly: its plan, memory plan and
+/// arena (and thread pool) are set up once, so that run() does not touch
+/// the heap on one thread.
+class PreparedChain {
+public:
+  PreparedChain(Expr *expr, const ResultMCP &plan, unsigned numThreads = 1);
+  ~PreparedChain();
+  PreparedChain(const PreparedChain &) = delete;
+  PreparedChain &operator=(const PreparedChain &) = delete;
+
+  /// Flops of the plan, whichever cost model chose it: the cost of the plan
+  /// is in the unit of its model.
+  long getFlops() const { return flops; }
+  size_t getPeakBytes() const { return memory.getPeakBytes(); }
+  const MemoryPlan &getMemoryPlan() const { return memory; }
+
+  /// Evaluate the chain into the row-major buffer `out`.
+  void run(const Bindings &bindings, double *out);
+
+private:
+  ResultMCP plan;
+  vector<Expr *> operands;
+  long flops;
+  MemoryPlan memory;
+  vector<double> arena;
+  vector<details::MatrixRef> leaves;
+  // leaves that are inverses solved with rather than computed.
+  vector<bool> solved;
+  unsigned numThreads;
+  std::unique_ptr<details::ThreadPool> pool;
+};
+
+/// Optimize the chain with `options`, then evaluate it on
+/// options.numThreads threads.
+void evaluate(Expr *expr, const Bindings &bindings, double *out,
+              const MCPOptions &options = MCPOptions());
+
+/// Options of generateEvaluator.
+struct CodegenOptions {
+  /// Name of the generated function.
+  string name = "evaluate";
+  /// Also generate main(), which runs the function on deterministic inputs
+  /// with the properties of the operands and checks it against a naive
+  /// evaluation of the chain (leaves formed explicitly, left to right).
+  bool emitTest = false;
+};
+
+/// Write to `os` a standalone C++11 source evaluating the chain `expr` with
+/// `plan`, for its shapes only: one kernel call per product of the split
+/// tree, the kernel chosen as in evaluate, with the intermediates at the
+/// offsets of planMemory in a caller-provided workspace. The function takes
+/// the row-major buffers of the distinct operands in order of appearance,
+/// then `out` and the workspace, of <name>WorkspaceSize doubles.
+void generateEvaluator(Expr *expr, const ResultMCP &plan, std::ostream &os,
+                       const CodegenOptions &options = CodegenOptions());
+
+} // end namespace matrixchain
+
+#endif
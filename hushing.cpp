@@ -0,0 +1,366 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Hu-Shing matrix chain ordering, see:
+// T. C. Hu and M. T. Shing, "Computation of Matrix Chain Products", Part I
+// and II, SIAM J. Comput. 1982/1984.
+//
+// A chain with dimensions p0, ..., pn is a convex polygon with vertex
+// weights p0, ..., pn; a parenthesization is a triangulation and multiplying
+// p * q by q * r costs the product of the triangle weights. Rotate the
+// polygon so that V0 is the lightest vertex. The only arcs that can appear
+// in an optimal triangulation besides fans are the "potential h-arcs": arcs
+// whose enclosed vertices are all heavier than both ends. They are nested,
+// so they form a tree rooted at the whole polygon, and an optimal
+// triangulation keeps a subset of them and fans every remaining region from
+// its lightest vertex.
+//
+// Whether an arc is kept depends on the weight w of the vertex fanning the
+// region around it: the contribution of the sub-polygon under the arc is
+// a concave piecewise-linear function of w, the arc is kept once w reaches
+// its "supporting weight". The functions are built bottom-up as a slope and
+// an intercept plus a mergeable heap of breakpoints, which gives
+// O(n log n) overall.
+
+#include "chain.h"
+#include <algorithm>
+
+using namespace details;
+
+namespace {
+
+__extension__ typedef __int128 int128;
+
+/// Breakpoint of a concave piecewise-linear function at num / den. Moving
+/// left across it adds (interceptDelta, slopeDelta) to the current piece.
+/// Breakpoints live in a leftist max-heap.
+struct Breakpoint {
+  long num;
+  long den;
+  long interceptDelta;
+  long slopeDelta;
+  int left;
+  int right;
+  int rank;
+};
+
+/// Potential h-arc between the vertices at sweep positions first < last.
+/// Position n + 1 is V0 again.
+struct Arc {
+  size_t first;
+  size_t last;
+};
+
+class HuShing {
+public:
+  HuShing(const vector<long> &pVector);
+  long solve(TriangularTable<long> *s);
+
+private:
+  size_t getVertex(size_t position) const { return position % weights.size(); }
+  long getWeight(size_t position) const {
+    return weights[getVertex(position)];
+  }
+  bool isLighter(size_t position, size_t other) const;
+  long getSideSum(size_t first, size_t last) const {
+    return sideSums[last] - sideSums[first];
+  }
+  size_t getFanVertex(size_t arc) const;
+  bool isIncident(size_t arc, size_t vertex) const {
+    return getVertex(arcs[arc].first) == vertex ||
+           getVertex(arcs[arc].last) == vertex;
+  }
+
+  void buildArcs();
+  void solveArc(size_t arc);
+  void addTriangles(TriangularTable<long> &s) const;
+  void addTriangle(TriangularTable<long> &s, size_t a, size_t b,
+                   size_t c) const;
+
+  int merge(int heap, int other);
+  int pop(int heap);
+  bool isGreater(int breakpoint, int other) const;
+
+  // polygon rotated so that weights[0] is the lightest vertex.
+  vector<long> weights;
+  size_t rotation;
+  // sideSums[k]: sum of the products of the sides before position k.
+  vector<long> sideSums;
+
+  // arcs[0] is the whole polygon, the others are in pre-order.
+  vector<Arc> arcs;
+  // children of arc i are children[childBegin[i] .. childBegin[i + 1]).
+  vector<size_t> childBegin;
+  vector<size_t> children;
+
+  // per arc: optimal cost of the sub-polygon fanned from its lightest end,
+  // the function of w, and the supporting weight.
+  vector<long> costs;
+  vector<long> intercepts;
+  vector<long> slopes;
+  vector<int> heaps;
+  vector<long> supportNum;
+  vector<long> supportDen;
+  vector<Breakpoint> breakpoints;
+};
+
+} // end namespace
+
+HuShing::HuShing(const vector<long> &pVector) {
+  const size_t size = pVector.size();
+  rotation = 0;
+  for (size_t i = 1; i < size; i++)
+    if (pVector[i] < pVector[rotation])
+      rotation = i;
+  for (size_t i = 0; i < size; i++)
+    weights.push_back(pVector[(rotation + i) % size]);
+  sideSums.assign(size + 1, 0);
+  for (size_t k = 0; k < size; k++)
+    sideSums[k + 1] = sideSums[k] + getWeight(k) * getWeight(k + 1);
+}
+
+bool HuShing::isLighter(size_t position, size_t other) const {
+  size_t vertex = getVertex(position);
+  size_t otherVertex = getVertex(other);
+  if (weights[vertex] != weights[otherVertex])
+    return weights[vertex] < weights[otherVertex];
+  return vertex < otherVertex;
+}
+
+size_t HuShing::getFanVertex(size_t arc) const {
+  if (isLighter(arcs[arc].first, arcs[arc].last))
+    return getVertex(arcs[arc].first);
+  return getVertex(arcs[arc].last);
+}
+
+/// One-sweep: walk the polygon from V0 back to V0 with a stack; popping a
+/// vertex heavier than both its neighbours on the stack exposes an arc.
+void HuShing::buildArcs() {
+  const size_t end = weights.size();
+  arcs.push_back({0, end});
+  vector<size_t> stack = {0};
+  for (size_t position = 1; position <= end; position++) {
+    while (stack.size() >= 2 && isLighter(position, stack.back())) {
+      stack.pop_back();
+      size_t first = stack.back();
+      // V0 - V0 and V1 - V0 are not arcs.
+      if (position == end && first <= 1)
+        continue;
+      arcs.push_back({first, position});
+    }
+    stack.push_back(position);
+  }
+  // pre-order: enclosing arcs first.
+  std::sort(arcs.begin() + 1, arcs.end(), [](const Arc &lhs, const Arc &rhs) {
+    if (lhs.first != rhs.first)
+      return lhs.first < rhs.first;
+    return lhs.last > rhs.last;
+  });
+  vector<size_t> parents(arcs.size(), 0);
+  vector<size_t> enclosing = {0};
+  for (size_t arc = 1; arc < arcs.size(); arc++) {
+    while (arcs[enclosing.back()].last < arcs[arc].last)
+      enclosing.pop_back();
+    parents[arc] = enclosing.back();
+    enclosing.push_back(arc);
+  }
+  childBegin.assign(arcs.size() + 1, 0);
+  for (size_t arc = 1; arc < arcs.size(); arc++)
+    childBegin[parents[arc] + 1]++;
+  for (size_t arc = 0; arc < arcs.size(); arc++)
+    childBegin[arc + 1] += childBegin[arc];
+  children.resize(arcs.size() - 1);
+  vector<size_t> next(childBegin.begin(), childBegin.end() - 1);
+  for (size_t arc = 1; arc < arcs.size(); arc++)
+    children[next[parents[arc]]++] = arc;
+}
+
+bool HuShing::isGreater(int breakpoint, int other) const {
+  const Breakpoint &lhs = breakpoints[breakpoint];
+  const Breakpoint &rhs = breakpoints[other];
+  return int128(lhs.num) * rhs.den > int128(rhs.num) * lhs.den;
+}
+
+int HuShing::merge(int heap, int other) {
+  if (heap < 0)
+    return other;
+  if (other < 0)
+    return heap;
+  if (isGreater(other, heap))
+    std::swap(heap, other);
+  int right = merge(breakpoints[heap].right, other);
+  breakpoints[heap].right = right;
+  int left = breakpoints[heap].left;
+  if (left < 0 || breakpoints[left].rank < breakpoints[right].rank)
+    std::swap(breakpoints[heap].left, breakpoints[heap].right);
+  right = breakpoints[heap].right;
+  breakpoints[heap].rank = right < 0 ? 1 : breakpoints[right].rank + 1;
+  return heap;
+}
+
+int HuShing::pop(int heap) {
+  return merge(breakpoints[heap].left, breakpoints[heap].right);
+}
+
+void HuShing::solveArc(size_t arc) {
+  const size_t first = arcs[arc].first;
+  const size_t last = arcs[arc].last;
+  const size_t fan = arc == 0 ? 0 : getFanVertex(arc);
+  const long fanWeight = weights[fan];
+  const size_t *begin = children.data() + childBegin[arc];
+  const size_t *end = children.data() + childBegin[arc + 1];
+
+  // sides of the sub-polygon not enclosed by a child arc.
+  long sides = getSideSum(first, last);
+  for (const size_t *child = begin; child != end; child++)
+    sides -= getSideSum(arcs[*child].first, arcs[*child].last);
+  // sides touching the fan vertex do not form a triangle with it.
+  long fanSides = 0;
+  if (getVertex(first) == fan && (begin == end || arcs[*begin].first != first))
+    fanSides += getWeight(first) * getWeight(first + 1);
+  if (getVertex(last) == fan &&
+      (begin == end || arcs[*(end - 1)].last != last))
+    fanSides += getWeight(last - 1) * getWeight(last);
+
+  long cost = fanWeight * (sides - fanSides);
+  long intercept = 0;
+  long slope = sides;
+  int heap = -1;
+  for (const size_t *child = begin; child != end; child++) {
+    // the parent region is fanned from a lighter vertex, drop the part of
+    // the child function above fanWeight.
+    while (heaps[*child] >= 0 &&
+           breakpoints[heaps[*child]].num >
+               int128(fanWeight) * breakpoints[heaps[*child]].den) {
+      intercepts[*child] += breakpoints[heaps[*child]].interceptDelta;
+      slopes[*child] += breakpoints[heaps[*child]].slopeDelta;
+      heaps[*child] = pop(heaps[*child]);
+    }
+    // an arc touching the fan vertex is part of the fan either way.
+    if (isIncident(*child, fan))
+      cost += costs[*child];
+    else
+      cost += intercepts[*child] + slopes[*child] * fanWeight;
+    intercept += intercepts[*child];
+    slope += slopes[*child];
+    heap = merge(heap, heaps[*child]);
+  }
+  costs[arc] = cost;
+  if (arc == 0)
+    return;
+
+  // keep the arc: w * weight(first) * weight(last) + cost. Walk down the
+  // breakpoints to where this line crosses the sub-polygon function.
+  const long arcWeight = getWeight(first) * getWeight(last);
+  assert(intercept + slope * fanWeight >= cost + arcWeight * fanWeight &&
+         "arc must be kept at its own fan weight");
+  while (heap >= 0) {
+    const Breakpoint &top = breakpoints[heap];
+    if (int128(intercept - cost) * top.den +
+            int128(slope - arcWeight) * top.num <
+        0)
+      break;
+    intercept += top.interceptDelta;
+    slope += top.slopeDelta;
+    heap = pop(heap);
+  }
+  assert(slope > arcWeight && "expect a crossing");
+  Breakpoint support = {cost - intercept, slope - arcWeight,
+                        intercept - cost, slope - arcWeight,
+                        -1,
+                        -1,
+                        1};
+  breakpoints.push_back(support);
+  supportNum[arc] = support.num;
+  supportDen[arc] = support.den;
+  heaps[arc] = merge(heap, breakpoints.size() - 1);
+  intercepts[arc] = cost;
+  slopes[arc] = arcWeight;
+}
+
+void HuShing::addTriangle(TriangularTable<long> &s, size_t a, size_t b,
+                          size_t c) const {
+  size_t vertices[] = {(a + rotation) % weights.size(),
+                       (b + rotation) % weights.size(),
+                       (c + rotation) % weights.size()};
+  std::sort(vertices, vertices + 3);
+  // the triangle under the side (x, z) of the sub-chain x + 1 .. z.
+  s(vertices[0] + 1, vertices[2]) = vertices[1];
+}
+
+/// Walk the arcs top-down: an arc is kept if the vertex fanning the region
+/// around it is at least as heavy as its supporting weight.
+void HuShing::addTriangles(TriangularTable<long> &s) const {
+  vector<pair<size_t, size_t>> worklist = {{0, 0}};
+  while (!worklist.empty()) {
+    size_t arc = worklist.back().first;
+    size_t fan = worklist.back().second;
+    worklist.pop_back();
+    size_t side = arcs[arc].first;
+    auto addSides = [&](size_t until) {
+      for (; side < until; side++)
+        if (getVertex(side) != fan && getVertex(side + 1) != fan)
+          addTriangle(s, fan, getVertex(side), getVertex(side + 1));
+    };
+    for (size_t i = childBegin[arc]; i < childBegin[arc + 1]; i++) {
+      size_t child = children[i];
+      addSides(arcs[child].first);
+      side = arcs[child].last;
+      if (isIncident(child, fan)) {
+        worklist.push_back({child, fan});
+      } else if (int128(supportNum[child]) <=
+                 int128(weights[fan]) * supportDen[child]) {
+        addTriangle(s, fan, getVertex(arcs[child].first),
+                    getVertex(arcs[child].last));
+        worklist.push_back({child, getFanVertex(child)});
+      } else {
+        worklist.push_back({child, fan});
+      }
+    }
+    addSides(arcs[arc].last);
+  }
+}
+
+long HuShing::solve(TriangularTable<long> *s) {
+  if (weights.size() < 3)
+    return 0;
+  buildArcs();
+  costs.assign(arcs.size(), 0);
+  intercepts.assign(arcs.size(), 0);
+  slopes.assign(arcs.size(), 0);
+  heaps.assign(arcs.size(), -1);
+  supportNum.assign(arcs.size(), 0);
+  supportDen.assign(arcs.size(), 1);
+  breakpoints.reserve(arcs.size());
+  // children come after their parent in pre-order.
+  for (size_t arc = arcs.size(); arc-- > 0;)
+    solveArc(arc);
+  if (s)
+    addTriangles(*s);
+  // a product costs 2 * p * q * r flops.
+  return costs[0] * 2;
+}
+
+long details::runHuShing(const vector<long> &pVector, TriangularTable<long> *s) {
+  return HuShing(pVector).solve(s);
+}
@@ -0,0 +1,455 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Dense kernels of the execution engine. The GEMM follows the usual
+// Goto/BLIS structure: B is packed by KC x NC blocks into NR-column panels,
+// A by MC x KC blocks into MR-row panels, and an MR x NR micro-kernel
+// accumulates C tiles in registers.
+
+#include "kernels.h"
+#include "chain.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_CHAIN_X86 1
+#endif
+
+using namespace details;
+
+namespace {
+
+// micro-tile: 6 x 8 doubles are 12 AVX2 accumulators.
+const long MR = 6;
+const long NR = 8;
+// blocks: a KC x NR panel of B stays in L1, MC x KC of A in L2.
+const long MC = 96;
+const long KC = 256;
+const long NC = 4096;
+// base case of the recursive triangular and symmetric kernels.
+const long TB = 64;
+
+/// C tile (mr x nr, at most MR x NR) += packed A panel * packed B panel.
+void microKernelScalar(long kc, const double *a, const double *b, double *c,
+                       long ldc, long mr, long nr) {
+  double tile[MR * NR] = {};
+  for (long p = 0; p < kc; p++, a += MR, b += NR)
+    for (long i = 0; i < MR; i++)
+      for (long j = 0; j < NR; j++)
+        tile[i * NR + j] += a[i] * b[j];
+  for (long i = 0; i < mr; i++)
+    for (long j = 0; j < nr; j++)
+      c[i * ldc + j] += tile[i * NR + j];
+}
+
+#if MATRIX_CHAIN_X86
+__attribute__((target("avx2,fma"))) void
+microKernelAVX2(long kc, const double *a, const double *b, double *c, long ldc,
+                long mr, long nr) {
+  __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+  __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+  __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+  __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+  __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+  __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+  for (long p = 0; p < kc; p++, a += MR, b += NR) {
+    __m256d b0 = _mm256_loadu_pd(b);
+    __m256d b1 = _mm256_loadu_pd(b + 4);
+    __m256d ai = _mm256_broadcast_sd(a);
+    c00 = _mm256_fmadd_pd(ai, b0, c00);
+    c01 = _mm256_fmadd_pd(ai, b1, c01);
+    ai = _mm256_broadcast_sd(a + 1);
+    c10 = _mm256_fmadd_pd(ai, b0, c10);
+    c11 = _mm256_fmadd_pd(ai, b1, c11);
+    ai = _mm256_broadcast_sd(a + 2);
+    c20 = _mm256_fmadd_pd(ai, b0, c20);
+    c21 = _mm256_fmadd_pd(ai, b1, c21);
+    ai = _mm256_broadcast_sd(a + 3);
+    c30 = _mm256_fmadd_pd(ai, b0, c30);
+    c31 = _mm256_fmadd_pd(ai, b1, c31);
+    ai = _mm256_broadcast_sd(a + 4);
+    c40 = _mm256_fmadd_pd(ai, b0, c40);
+    c41 = _mm256_fmadd_pd(ai, b1, c41);
+    ai = _mm256_broadcast_sd(a + 5);
+    c50 = _mm256_fmadd_pd(ai, b0, c50);
+    c51 = _mm256_fmadd_pd(ai, b1, c51);
+  }
+  alignas(32) double tile[MR * NR];
+  _mm256_store_pd(tile + 0, c00);
+  _mm256_store_pd(tile + 4, c01);
+  _mm256_store_pd(tile + 8, c10);
+  _mm256_store_pd(tile + 12, c11);
+  _mm256_store_pd(tile + 16, c20);
+  _mm256_store_pd(tile + 20, c21);
+  _mm256_store_pd(tile + 24, c30);
+  _mm256_store_pd(tile + 28, c31);
+  _mm256_store_pd(tile + 32, c40);
+  _mm256_store_pd(tile + 36, c41);
+  _mm256_store_pd(tile + 40, c50);
+  _mm256_store_pd(tile + 44, c51);
+  for (long i = 0; i < mr; i++)
+    for (long j = 0; j < nr; j++)
+      c[i * ldc + j] += tile[i * NR + j];
+}
+#endif
+
+typedef void (*MicroKernel)(long, const double *, const double *, double *,
+                            long, long, long);
+
+MicroKernel getMicroKernel() {
+#if MATRIX_CHAIN_X86
+  static const bool hasFMA = []() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("fma");
+  }();
+  if (getSIMDLevel() >= SIMDLevel::AVX2 && hasFMA)
+    return microKernelAVX2;
+#endif
+  return microKernelScalar;
+}
+
+/// Pack alpha times the mc x kc block of A at (ic, pc) into MR-row panels,
+/// zero-padded.
+void packA(const MatrixRef &a, long ic, long pc, long mc, long kc,
+           double alpha, double *packed) {
+  for (long ir = 0; ir < mc; ir += MR)
+    for (long p = 0; p < kc; p++)
+      for (long i = 0; i < MR; i++)
+        *packed++ = ir + i < mc ? alpha * a(ic + ir + i, pc + p) : 0.0;
+}
+
+/// Pack the kc x nc block of B at (pc, jc) into NR-column panels.
+void packB(const MatrixRef &b, long pc, long jc, long kc, long nc,
+           double *packed) {
+  for (long jr = 0; jr < nc; jr += NR)
+    for (long p = 0; p < kc; p++)
+      for (long j = 0; j < NR; j++)
+        *packed++ = jr + j < nc ? b(pc + p, jc + jr + j) : 0.0;
+}
+
+} // end namespace
+
+/// C += alpha * A * B.
+static void gemmUpdate(const MatrixRef &a, const MatrixRef &b, double *c,
+                       long ldc, double alpha) {
+  const long m = a.rows, n = b.cols, k = a.cols;
+  MicroKernel kernel = getMicroKernel();
+  // reused across calls, the blocks bound their size.
+  thread_local std::vector<double> packedA, packedB;
+  packedA.resize(MC * KC);
+  packedB.resize(KC * ((std::min(n, NC) + NR - 1) / NR * NR));
+  for (long jc = 0; jc < n; jc += NC) {
+    long nc = std::min(NC, n - jc);
+    for (long pc = 0; pc < k; pc += KC) {
+      long kc = std::min(KC, k - pc);
+      packB(b, pc, jc, kc, nc, packedB.data());
+      for (long ic = 0; ic < m; ic += MC) {
+        long mc = std::min(MC, m - ic);
+        packA(a, ic, pc, mc, kc, alpha, packedA.data());
+        for (long jr = 0; jr < nc; jr += NR)
+          for (long ir = 0; ir < mc; ir += MR)
+            kernel(kc, &packedA[ir * kc], &packedB[jr * kc],
+                   c + (ic + ir) * ldc + jc + jr, ldc,
+                   std::min(MR, mc - ir), std::min(NR, nc - jr));
+      }
+    }
+  }
+}
+
+void details::gemm(const MatrixRef &a, const MatrixRef &b, double *c, long ldc,
+                   bool accumulate) {
+  assert(a.cols == b.rows && "shape mismatch");
+  if (!accumulate)
+    for (long i = 0; i < a.rows; i++)
+      std::fill(c + i * ldc, c + i * ldc + b.cols, 0.0);
+  gemmUpdate(a, b, c, ldc, 1.0);
+}
+
+/// Copy the n x n matrix `a` into `out`, rebuilding the triangle that is
+/// not read: zeros for a triangular matrix, the mirror of the lower triangle
+/// for a symmetric one.
+static void copyTriangle(const MatrixRef &a, Triangle triangle,
+                         bool symmetric, double *out) {
+  const long n = a.rows;
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < n; j++) {
+      bool inTriangle = triangle == Triangle::LOWER ? j <= i : j >= i;
+      double value = 0.0;
+      if (inTriangle)
+        value = a(i, j);
+      else if (symmetric)
+        value = a(j, i);
+      out[i * n + j] = value;
+    }
+}
+
+/// Where the recursive kernels split an n x n matrix: half-way, rounded up
+/// to the base case size so that the leaves are full blocks.
+static long getHalf(long n) { return (n / 2 + TB - 1) / TB * TB; }
+
+/// C += T * B, recursing on the diagonal blocks of T so that almost all the
+/// work is in large gemm calls on its non-zero off-diagonal blocks.
+static void trmmRec(Triangle triangle, const MatrixRef &t, const MatrixRef &b,
+                    double *c, long ldc) {
+  const long n = t.rows, m = b.cols;
+  if (n <= TB) {
+    double diagonal[TB * TB];
+    copyTriangle(t, triangle, false, diagonal);
+    gemm(getRowMajor(diagonal, n, n), b, c, ldc, true);
+    return;
+  }
+  const long h = getHalf(n);
+  double *bottom = c + h * ldc;
+  trmmRec(triangle, t.block(0, 0, h, h), b.block(0, 0, h, m), c, ldc);
+  trmmRec(triangle, t.block(h, h, n - h, n - h), b.block(h, 0, n - h, m),
+          bottom, ldc);
+  if (triangle == Triangle::LOWER)
+    gemm(t.block(h, 0, n - h, h), b.block(0, 0, h, m), bottom, ldc, true);
+  else
+    gemm(t.block(0, h, h, n - h), b.block(h, 0, n - h, m), c, ldc, true);
+}
+
+/// C += S * B reading the lower triangle of S: S = [S11 S21^T; S21 S22].
+static void symmRec(const MatrixRef &s, const MatrixRef &b, double *c,
+                    long ldc) {
+  const long n = s.rows, m = b.cols;
+  if (n <= TB) {
+    double diagonal[TB * TB];
+    copyTriangle(s, Triangle::LOWER, true, diagonal);
+    gemm(getRowMajor(diagonal, n, n), b, c, ldc, true);
+    return;
+  }
+  const long h = getHalf(n);
+  double *bottom = c + h * ldc;
+  MatrixRef s21 = s.block(h, 0, n - h, h);
+  symmRec(s.block(0, 0, h, h), b.block(0, 0, h, m), c, ldc);
+  symmRec(s.block(h, h, n - h, n - h), b.block(h, 0, n - h, m), bottom, ldc);
+  gemm(s21.transpose(), b.block(h, 0, n - h, m), c, ldc, true);
+  gemm(s21, b.block(0, 0, h, m), bottom, ldc, true);
+}
+
+/// The lower triangle of C = A * A^T, diagonal blocks included in full.
+static void syrkRec(const MatrixRef &a, double *c, long ldc) {
+  const long n = a.rows, k = a.cols;
+  if (n <= TB)
+    return gemm(a, a.transpose(), c, ldc);
+  const long h = getHalf(n);
+  MatrixRef top = a.block(0, 0, h, k), bottom = a.block(h, 0, n - h, k);
+  syrkRec(top, c, ldc);
+  syrkRec(bottom, c + h * ldc + h, ldc);
+  gemm(bottom, top.transpose(), c + h * ldc, ldc);
+}
+
+/// Row-major view of the rows x cols block at `data`, with leading
+/// dimension ld.
+static MatrixRef getBlock(const double *data, long rows, long cols, long ld) {
+  return {data, rows, cols, ld, 1};
+}
+
+/// B = T^-1 * B in place for the n x m block B at `b`: substitution on the
+/// diagonal blocks of T, gemm updates with its off-diagonal ones. `unit`
+/// takes the diagonal of T as ones without reading it.
+static void trsmRec(Triangle triangle, bool unit, const MatrixRef &t,
+                    double *b, long m, long ldb) {
+  const long n = t.rows;
+  if (n <= TB) {
+    bool lower = triangle == Triangle::LOWER;
+    for (long r = 0; r < n; r++) {
+      long i = lower ? r : n - 1 - r;
+      double *row = b + i * ldb;
+      long first = lower ? 0 : i + 1, last = lower ? i : n;
+      for (long p = first; p < last; p++) {
+        double factor = t(i, p);
+        const double *solved = b + p * ldb;
+        for (long c = 0; c < m; c++)
+          row[c] -= factor * solved[c];
+      }
+      if (unit)
+        continue;
+      assert(t(i, i) != 0.0 && "singular triangular matrix");
+      double scale = 1.0 / t(i, i);
+      for (long c = 0; c < m; c++)
+        row[c] *= scale;
+    }
+    return;
+  }
+  const long h = getHalf(n);
+  double *bottom = b + h * ldb;
+  MatrixRef top = t.block(0, 0, h, h), end = t.block(h, h, n - h, n - h);
+  if (triangle == Triangle::LOWER) {
+    trsmRec(triangle, unit, top, b, m, ldb);
+    gemmUpdate(t.block(h, 0, n - h, h), getBlock(b, h, m, ldb), bottom, ldb,
+               -1.0);
+    trsmRec(triangle, unit, end, bottom, m, ldb);
+  } else {
+    trsmRec(triangle, unit, end, bottom, m, ldb);
+    gemmUpdate(t.block(0, h, h, n - h), getBlock(bottom, n - h, m, ldb), b,
+               ldb, -1.0);
+    trsmRec(triangle, unit, top, b, m, ldb);
+  }
+}
+
+/// Factor the SPD matrix in the upper triangle of the n x n block at `u` as
+/// U^T U, in place: U11, then U12 = U11^-T A12, then the Schur complement
+/// A22 - U12^T U12. The strictly lower triangle is left as it was.
+static void choleskyRec(double *u, long n, long ldu) {
+  if (n <= TB) {
+    for (long j = 0; j < n; j++) {
+      double *row = u + j * ldu;
+      for (long p = 0; p < j; p++) {
+        double factor = u[p * ldu + j];
+        for (long c = j; c < n; c++)
+          row[c] -= factor * u[p * ldu + c];
+      }
+      assert(row[j] > 0.0 && "matrix not positive definite");
+      double scale = 1.0 / std::sqrt(row[j]);
+      for (long c = j; c < n; c++)
+        row[c] *= scale;
+    }
+    return;
+  }
+  const long h = getHalf(n);
+  choleskyRec(u, h, ldu);
+  trsmRec(Triangle::LOWER, false, getBlock(u, h, h, ldu).transpose(), u + h,
+          n - h, ldu);
+  MatrixRef u12 = getBlock(u + h, h, n - h, ldu);
+  gemmUpdate(u12.transpose(), u12, u + h * ldu + h, ldu, -1.0);
+  choleskyRec(u + h * ldu + h, n - h, ldu);
+}
+
+/// Factor the n x n row-major `lu` as P A = L U in place (L with a unit
+/// diagonal), by panels of TB columns with partial pivoting. Every row swap
+/// is applied to the n x m block B at `b` as well, which becomes P B.
+static void luFactor(double *lu, long n, double *b, long m, long ldb) {
+  for (long j0 = 0; j0 < n; j0 += TB) {
+    const long nb = std::min(TB, n - j0), end = j0 + nb;
+    for (long j = j0; j < end; j++) {
+      long pivot = j;
+      for (long i = j + 1; i < n; i++)
+        if (std::fabs(lu[i * n + j]) > std::fabs(lu[pivot * n + j]))
+          pivot = i;
+      assert(lu[pivot * n + j] != 0.0 && "singular matrix");
+      if (pivot != j) {
+        std::swap_ranges(lu + j * n, lu + j * n + n, lu + pivot * n);
+        std::swap_ranges(b + j * ldb, b + j * ldb + m, b + pivot * ldb);
+      }
+      double scale = 1.0 / lu[j * n + j];
+      for (long i = j + 1; i < n; i++) {
+        double factor = lu[i * n + j] *= scale;
+        for (long c = j + 1; c < end; c++)
+          lu[i * n + c] -= factor * lu[j * n + c];
+      }
+    }
+    if (end == n)
+      continue;
+    // U12 = L11^-1 A12, then the Schur complement A22 - L21 U12.
+    trsmRec(Triangle::LOWER, true, getBlock(lu + j0 * n + j0, nb, nb, n),
+            lu + j0 * n + end, n - end, n);
+    gemmUpdate(getBlock(lu + end * n + j0, n - end, nb, n),
+               getBlock(lu + j0 * n + end, nb, n - end, n),
+               lu + end * n + end, n, -1.0);
+  }
+}
+
+/// Copy B into C, unless `b` is a view of C.
+static void copy(const MatrixRef &b, double *c, long ldc) {
+  if (b.data == c && b.rowStride == ldc && b.colStride == 1)
+    return;
+  for (long i = 0; i < b.rows; i++)
+    for (long j = 0; j < b.cols; j++)
+      c[i * ldc + j] = b(i, j);
+}
+
+static void zero(double *c, long rows, long cols, long ldc) {
+  for (long i = 0; i < rows; i++)
+    std::fill(c + i * ldc, c + i * ldc + cols, 0.0);
+}
+
+void details::trmm(Triangle triangle, const MatrixRef &t, const MatrixRef &b,
+                   double *c, long ldc) {
+  assert(t.rows == t.cols && t.cols == b.rows && "shape mismatch");
+  zero(c, t.rows, b.cols, ldc);
+  trmmRec(triangle, t, b, c, ldc);
+}
+
+void details::symm(const MatrixRef &s, const MatrixRef &b, double *c,
+                   long ldc) {
+  assert(s.rows == s.cols && s.cols == b.rows && "shape mismatch");
+  zero(c, s.rows, b.cols, ldc);
+  symmRec(s, b, c, ldc);
+}
+
+void details::syrk(const MatrixRef &a, double *c, long ldc) {
+  const long n = a.rows;
+  syrkRec(a, c, ldc);
+  for (long i = 0; i < n; i++)
+    for (long j = i + 1; j < n; j++)
+      c[i * ldc + j] = c[j * ldc + i];
+}
+
+void details::trsm(Triangle triangle, const MatrixRef &t, const MatrixRef &b,
+                   double *c, long ldc) {
+  assert(t.rows == t.cols && t.cols == b.rows && "shape mismatch");
+  copy(b, c, ldc);
+  trsmRec(triangle, false, t, c, b.cols, ldc);
+}
+
+void details::posv(const MatrixRef &a, const MatrixRef &b, double *c,
+                   long ldc, double *workspace) {
+  assert(a.rows == a.cols && a.cols == b.rows && "shape mismatch");
+  const long n = a.rows;
+  for (long i = 0; i < n; i++)
+    for (long j = i; j < n; j++)
+      workspace[i * n + j] = a(i, j);
+  choleskyRec(workspace, n, n);
+  copy(b, c, ldc);
+  MatrixRef u = getRowMajor(workspace, n, n);
+  trsmRec(Triangle::LOWER, false, u.transpose(), c, b.cols, ldc);
+  trsmRec(Triangle::UPPER, false, u, c, b.cols, ldc);
+}
+
+void details::gesv(const MatrixRef &a, const MatrixRef &b, double *c,
+                   long ldc, double *workspace) {
+  assert(a.rows == a.cols && a.cols == b.rows && "shape mismatch");
+  const long n = a.rows;
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < n; j++)
+      workspace[i * n + j] = a(i, j);
+  copy(b, c, ldc);
+  luFactor(workspace, n, c, b.cols, ldc);
+  MatrixRef lu = getRowMajor(workspace, n, n);
+  trsmRec(Triangle::LOWER, true, lu, c, b.cols, ldc);
+  trsmRec(Triangle::UPPER, false, lu, c, b.cols, ldc);
+}
+
+void details::invert(const MatrixRef &a, double *out, double *workspace) {
+  assert(a.rows == a.cols && "inverse of a non-square matrix");
+  const long n = a.rows;
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < n; j++)
+      out[i * n + j] = i == j ? 1.0 : 0.0;
+  gesv(a, getRowMajor(out, n, n), out, n, workspace);
+}
@@ -0,0 +1,104 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_KERNELS_H
+#define MATRIX_CHAIN_KERNELS_H
+
+#include <cstddef>
+
+namespace details {
+
+/// Read-only strided view of a dense matrix: element (i, j) is
+/// data[i * rowStride + j * colStride]. A row-major matrix has colStride 1,
+/// its transpose just swaps the strides.
+struct MatrixRef {
+  const double *data;
+  long rows;
+  long cols;
+  long rowStride;
+  long colStride;
+
+  double operator()(long i, long j) const {
+    return data[i * rowStride + j * colStride];
+  }
+  MatrixRef transpose() const {
+    return {data, cols, rows, colStride, rowStride};
+  }
+  /// The rows x cols block at (i, j).
+  MatrixRef block(long i, long j, long rows, long cols) const {
+    return {data + i * rowStride + j * colStride, rows, cols, rowStride,
+            colStride};
+  }
+};
+
+/// Row-major view of an r x c buffer.
+inline MatrixRef getRowMajor(const double *data, long rows, long cols) {
+  return {data, rows, cols, cols, 1};
+}
+
+/// C = A * B, or C += A * B if `accumulate`, with C row-major (leading
+/// dimension ldc). Blocked for the caches with packed panels and a SIMD
+/// micro-kernel when the CPU has one.
+void gemm(const MatrixRef &a, const MatrixRef &b, double *c, long ldc,
+          bool accumulate = false);
+
+enum class Triangle { LOWER, UPPER };
+
+/// C = T * B for a triangular T, only reading its `triangle`. Skips the zero
+/// blocks: about half the flops of gemm, as the cost model assumes.
+void trmm(Triangle triangle, const MatrixRef &t, const MatrixRef &b,
+          double *c, long ldc);
+
+/// C = S * B for a symmetric S, only reading its lower triangle. Same flops
+/// as gemm: the saving is in what S needs to store.
+void symm(const MatrixRef &s, const MatrixRef &b, double *c, long ldc);
+
+/// C = A * A^T, computing the lower triangle and mirroring it: about half
+/// the flops of gemm.
+void syrk(const MatrixRef &a, double *c, long ldc);
+
+/// The solves below compute C = A^-1 * B without forming the inverse. `b`
+/// may be a view of C itself, the right-hand side is then overwritten.
+
+/// C = T^-1 * B for a triangular T, only reading its `triangle`:
+/// substitution, with the same flops as trmm.
+void trsm(Triangle triangle, const MatrixRef &t, const MatrixRef &b,
+          double *c, long ldc);
+
+/// C = A^-1 * B for an SPD A, by its Cholesky factorization A = U^T U in the
+/// n x n `workspace`, only reading the upper triangle of A.
+void posv(const MatrixRef &a, const MatrixRef &b, double *c, long ldc,
+          double *workspace);
+
+/// C = A^-1 * B by LU factorization with partial pivoting of A in the n x n
+/// `workspace`. A must be invertible.
+void gesv(const MatrixRef &a, const MatrixRef &b, double *c, long ldc,
+          double *workspace);
+
+/// Explicit inverse of the n x n matrix `a` into the row-major `out`: gesv
+/// on the identity, with the same `workspace`.
+void invert(const MatrixRef &a, double *out, double *workspace);
+
+} // end namespace details.
+
+#endif
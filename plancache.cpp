@@ -0,0 +1,94 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "plancache.h"
+
+using namespace matrixchain;
+
+size_t PlanCache::Hash::operator()(const Signature &signature) const {
+  // 64-bit FNV-1a over the words.
+  uint64_t hash = 14695981039346656037ull;
+  for (long word : signature) {
+    hash ^= static_cast<uint64_t>(word);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::shared_ptr<const ResultMCP>
+PlanCache::lookup(const Signature &signature) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = index.find(signature);
+  if (it == index.end()) {
+    misses++;
+    STATS_ADD(PLAN_CACHE_MISSES, 1);
+    return nullptr;
+  }
+  hits++;
+  STATS_ADD(PLAN_CACHE_HITS, 1);
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->second;
+}
+
+void PlanCache::insert(const Signature &signature,
+                       std::shared_ptr<const ResultMCP> plan) {
+  if (!capacity)
+    return;
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = index.find(signature);
+  if (it != index.end()) {
+    // another thread solved the same chain meanwhile.
+    it->second->second = std::move(plan);
+    entries.splice(entries.begin(), entries, it->second);
+    return;
+  }
+  if (entries.size() == capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+  entries.emplace_front(signature, std::move(plan));
+  index.emplace(signature, entries.begin());
+}
+
+void PlanCache::clear() {
+  std::lock_guard<std::mutex> guard(lock);
+  entries.clear();
+  index.clear();
+  hits = 0;
+  misses = 0;
+}
+
+size_t PlanCache::size() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return entries.size();
+}
+
+size_t PlanCache::getHits() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return hits;
+}
+
+size_t PlanCache::getMisses() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return misses;
+}
@@ -0,0 +1,76 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_PLANCACHE_H
+#define MATRIX_CHAIN_PLANCACHE_H
+
+#include "chain.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace matrixchain {
+
+/// Thread-safe LRU cache of matrix chain solutions. Chains are looked up by
+/// signature: the dimensions, the cost-relevant properties and the unary
+/// wrapper of every operand, the engine and the hash of the cost model;
+/// operand names do not matter.
+/// Pass it through MCPOptions::cache to runMCP and getMCPFlops.
+class PlanCache {
+public:
+  using Signature = vector<long>;
+
+  /// Keep at most `capacity` plans, evicting the least recently used.
+  explicit PlanCache(size_t capacity = 1024) : capacity(capacity){};
+  PlanCache(const PlanCache &) = delete;
+  PlanCache &operator=(const PlanCache &) = delete;
+
+  /// The plan for `signature` or null. Cached plans carry no tree.
+  std::shared_ptr<const ResultMCP> lookup(const Signature &signature);
+  void insert(const Signature &signature,
+              std::shared_ptr<const ResultMCP> plan);
+  void clear();
+
+  size_t getCapacity() const { return capacity; }
+  size_t size() const;
+  size_t getHits() const;
+  size_t getMisses() const;
+
+private:
+  struct Hash {
+    size_t operator()(const Signature &signature) const;
+  };
+  using Entry = std::pair<Signature, std::shared_ptr<const ResultMCP>>;
+
+  const size_t capacity;
+  mutable std::mutex lock;
+  // most recently used first.
+  std::list<Entry> entries;
+  std::unordered_map<Signature, std::list<Entry>::iterator, Hash> index;
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+} // end namespace matrixchain
+
+#endif
@@ -22,149 +22,123 @@ SOFTWARE.
 */
 
 #include "chain.h"
-#include "llvm/Support/Casting.h"
-#include <algorithm>
 
-template <Expr::ExprProperty P> bool isX(const Operand *operand) {
-  auto inferredProperties = operand->getProperties();
-  return std::any_of(inferredProperties.begin(), inferredProperties.end(),
-                     [](Expr::ExprProperty p) { return p == P; });
-}
+namespace {
 
-bool Operand::isUpperTriangular() const {
-  return isX<ExprProperty::UPPER_TRIANGULAR>(this);
-}
+/// Value of a property as far as the rules can tell.
+struct Inferred {
+  bool known;
+  bool value;
+};
 
-bool Operand::isLowerTriangular() const {
-  return isX<ExprProperty::LOWER_TRIANGULAR>(this);
+Inferred query(const Expr *expr, Expr::ExprProperty property) {
+  bool known = expr->isKnown(property);
+  return {known, known && expr->hasProperty(property)};
 }
 
-bool Operand::isSquare() const { return isX<ExprProperty::SQUARE>(this); }
-
-bool Operand::isSymmetric() const { return isX<ExprProperty::SYMMETRIC>(this); }
-
-bool Operand::isFullRank() const { return isX<ExprProperty::FULL_RANK>(this); }
+Inferred getTrue() { return {true, true}; }
+Inferred getFalse() { return {true, false}; }
 
-bool Operand::isSPD() const { return isX<ExprProperty::SPD>(this); }
-
-// ----------------------------------------------------------------------
-
-bool UnaryOp::isUpperTriangular() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case UnaryOpKind::TRANSPOSE:
-    return child->isLowerTriangular();
-  default:
-    assert(0 && "UNK");
-  }
-  return false;
+/// Short-circuit `lhs || rhs`: rhs matters only if lhs is known to be false.
+Inferred inferOr(Inferred lhs, Inferred rhs) {
+  if (!lhs.known || lhs.value)
+    return lhs;
+  return rhs;
 }
 
-bool UnaryOp::isLowerTriangular() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case UnaryOpKind::TRANSPOSE:
-    return child->isUpperTriangular();
-  default:
-    assert(0 && "UNK");
-  }
-  return false;
+/// Short-circuit `lhs && rhs`.
+Inferred inferAnd(Inferred lhs, Inferred rhs) {
+  if (!lhs.known || !lhs.value)
+    return lhs;
+  return rhs;
 }
 
-bool UnaryOp::isSquare() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case UnaryOpKind::TRANSPOSE:
-    return child->isSquare();
-  default:
-    assert(0 && "UNK");
+/// True if the property holds for all the children, checked left to right.
+Inferred inferAll(const vector<Expr *> &children,
+                  Expr::ExprProperty property) {
+  for (auto *child : children) {
+    Inferred inferred = query(child, property);
+    if (!inferred.known || !inferred.value)
+      return inferred;
   }
-  return false;
+  return getTrue();
 }
 
-bool UnaryOp::isSymmetric() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case UnaryOpKind::TRANSPOSE:
-    return child->isSymmetric() || child->isSPD();
-  default:
-    assert(0 && "UNK");
-  }
-  return false;
-}
+} // end namespace
 
-bool UnaryOp::isFullRank() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case UnaryOpKind::TRANSPOSE:
-  case UnaryOpKind::INVERSE:
-    return child->isFullRank();
-  default:
-    assert(0 && "UNK");
-  }
-  return false;
+vector<Expr::ExprProperty> Operand::getProperties() const {
+  vector<Expr::ExprProperty> result;
+  for (unsigned p = 0; p <= static_cast<unsigned>(ExprProperty::SPD); p++)
+    if (properties & (1u << p))
+      result.push_back(static_cast<ExprProperty>(p));
+  return result;
 }
 
-bool UnaryOp::isSPD() const {
-  assert(0 && "no impl");
-  return false;
+void Operand::setProperties(vector<Expr::ExprProperty> newProperties) {
+  if (hasUsers)
+    throw std::logic_error("set the properties of " + name +
+                           " before using it");
+  properties = 0;
+  for (auto property : newProperties)
+    properties |= getMask(property);
 }
 
 // ----------------------------------------------------------------------
 
-bool NaryOp::isUpperTriangular() const {
-  auto kind = this->getKind();
+void UnaryOp::inferProperties() {
+  child->hasUsers = true;
+  auto set = [this](ExprProperty property, Inferred inferred) {
+    setProperty(property, inferred.known, inferred.value);
+  };
   switch (kind) {
-  case NaryOp::NaryOpKind::MUL: {
-    for (auto *child : this->getChildren()) {
-      if (!child->isUpperTriangular())
-        return false;
-    }
-    return true;
-  }
-  default:
-    assert(0 && "UNK");
+  case UnaryOpKind::TRANSPOSE: {
+    set(ExprProperty::UPPER_TRIANGULAR,
+        query(child, ExprProperty::LOWER_TRIANGULAR));
+    set(ExprProperty::LOWER_TRIANGULAR,
+        query(child, ExprProperty::UPPER_TRIANGULAR));
+    set(ExprProperty::SQUARE, query(child, ExprProperty::SQUARE));
+    set(ExprProperty::SYMMETRIC,
+        inferOr(query(child, ExprProperty::SYMMETRIC),
+                query(child, ExprProperty::SPD)));
+    set(ExprProperty::FULL_RANK, query(child, ExprProperty::FULL_RANK));
+    set(ExprProperty::SPD, query(child, ExprProperty::SPD));
+    break;
   }
-  return false;
-}
-
-bool NaryOp::isLowerTriangular() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case NaryOp::NaryOpKind::MUL: {
-    for (auto *child : this->getChildren()) {
-      if (!child->isLowerTriangular())
-        return false;
+  case UnaryOpKind::INVERSE: {
+    // the inverse of an invertible matrix is triangular (symmetric, SPD)
+    // exactly when the matrix is.
+    for (unsigned p = 0; p <= static_cast<unsigned>(ExprProperty::SPD); p++) {
+      auto property = static_cast<ExprProperty>(p);
+      set(property, query(child, property));
     }
-    return true;
+    break;
   }
-  default:
-    assert(0 && "UNK");
   }
-  return false;
 }
 
-bool NaryOp::isSquare() const { assert(0 && "no impl"); }
-
-bool NaryOp::isSymmetric() const {
-  return children[0]->isTransposeOf(children[1]);
-}
-
-bool NaryOp::isFullRank() const {
-  // assert(0 && "no impl");
-  return false;
-}
+// ----------------------------------------------------------------------
 
-// see:
-// https://github.com/HPAC/linnea/blob/c8fb5d1f64666bf63d35859484a5041ff75dbb90/linnea/algebra/property_inference.py#L109
-// TODO: miss check left.columns >= left.rows
-bool NaryOp::isSPD() const {
-  auto kind = this->getKind();
-  switch (kind) {
-  case NaryOp::NaryOpKind::MUL:
-    return children[0]->isFullRank() && this->isSymmetric();
-  default:
-    assert(0 && "UNK");
-  }
-  return false;
+void NaryOp::inferProperties() {
+  for (auto *child : children)
+    child->hasUsers = true;
+  assert(kind == NaryOpKind::MUL && "UNK");
+  auto set = [this](ExprProperty property, Inferred inferred) {
+    setProperty(property, inferred.known, inferred.value);
+  };
+  // the product of upper (lower) triangular matrices is upper (lower)
+  // triangular.
+  set(ExprProperty::UPPER_TRIANGULAR,
+      inferAll(children, ExprProperty::UPPER_TRIANGULAR));
+  set(ExprProperty::LOWER_TRIANGULAR,
+      inferAll(children, ExprProperty::LOWER_TRIANGULAR));
+  // SQUARE is not inferred for products.
+  Inferred symmetric =
+      children[0]->isTransposeOf(children[1]) ? getTrue() : getFalse();
+  set(ExprProperty::SYMMETRIC, symmetric);
+  set(ExprProperty::FULL_RANK, getFalse());
+  // see:
+  // https://github.com/HPAC/linnea/blob/c8fb5d1f64666bf63d35859484a5041ff75dbb90/linnea/algebra/property_inference.py#L109
+  // TODO: miss check left.columns >= left.rows
+  set(ExprProperty::SPD,
+      inferAnd(query(children[0], ExprProperty::FULL_RANK), symmetric));
 }
@@ -0,0 +1,115 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "stats.h"
+
+using namespace matrixchain;
+
+namespace {
+
+const char *getName(StatsCounter counter) {
+  switch (counter) {
+  case StatsCounter::NODES_ALLOCATED:
+    return "nodes_allocated";
+  case StatsCounter::DP_CELLS:
+    return "dp_cells";
+  case StatsCounter::SPLITS_EVALUATED:
+    return "splits_evaluated";
+  case StatsCounter::PROPERTY_QUERIES:
+    return "property_queries";
+  case StatsCounter::PLAN_CACHE_HITS:
+    return "plan_cache_hits";
+  case StatsCounter::PLAN_CACHE_MISSES:
+    return "plan_cache_misses";
+  default:
+    return "unknown";
+  }
+}
+
+const char *getName(StatsPhase phase) {
+  switch (phase) {
+  case StatsPhase::COLLECT_OPERANDS:
+    return "collect_operands";
+  case StatsPhase::SOLVE:
+    return "solve";
+  case StatsPhase::BUILD_TREE:
+    return "build_tree";
+  default:
+    return "unknown";
+  }
+}
+
+std::atomic<uint64_t> phaseCalls[size_t(StatsPhase::NUM_PHASES)];
+std::atomic<uint64_t> phaseNanoseconds[size_t(StatsPhase::NUM_PHASES)];
+
+} // end namespace
+
+std::atomic<uint64_t>
+    details::statsCounters[size_t(StatsCounter::NUM_COUNTERS)];
+
+void details::addPhaseTime(StatsPhase phase, uint64_t nanoseconds) {
+  phaseCalls[size_t(phase)].fetch_add(1, std::memory_order_relaxed);
+  phaseNanoseconds[size_t(phase)].fetch_add(nanoseconds,
+                                            std::memory_order_relaxed);
+}
+
+bool matrixchain::isStatsEnabled() {
+#if MATRIX_CHAIN_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+Stats matrixchain::getStats() {
+  Stats stats;
+  for (size_t i = 0; i < size_t(StatsCounter::NUM_COUNTERS); i++)
+    stats.counters[i] = details::statsCounters[i].load();
+  for (size_t i = 0; i < size_t(StatsPhase::NUM_PHASES); i++) {
+    stats.phaseCalls[i] = phaseCalls[i].load();
+    stats.phaseNanoseconds[i] = phaseNanoseconds[i].load();
+  }
+  return stats;
+}
+
+void matrixchain::resetStats() {
+  for (auto &counter : details::statsCounters)
+    counter.store(0);
+  for (size_t i = 0; i < size_t(StatsPhase::NUM_PHASES); i++) {
+    phaseCalls[i].store(0);
+    phaseNanoseconds[i].store(0);
+  }
+}
+
+void matrixchain::dumpStats(const Stats &stats, std::ostream &os) {
+  os << "{\n  \"counters\": {";
+  for (size_t i = 0; i < size_t(StatsCounter::NUM_COUNTERS); i++)
+    os << (i ? ",\n" : "\n") << "    \"" << getName(StatsCounter(i))
+       << "\": " << stats.counters[i];
+  os << "\n  },\n  \"phases\": {";
+  for (size_t i = 0; i < size_t(StatsPhase::NUM_PHASES); i++)
+    os << (i ? ",\n" : "\n") << "    \"" << getName(StatsPhase(i))
+       << "\": {\"calls\": " << stats.phaseCalls[i]
+       << ", \"nanoseconds\": " << stats.phaseNanoseconds[i] << "}";
+  os << "\n  }\n}\n";
+}
@@ -0,0 +1,132 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_STATS_H
+#define MATRIX_CHAIN_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Optimizer instrumentation, compiled in with -DSTATS=ON (which defines
+// MATRIX_CHAIN_STATS). Without it the macros expand to nothing and the
+// stats read as zero.
+
+namespace matrixchain {
+
+enum class StatsCounter {
+  /// Expressions registered in a ScopedContext.
+  NODES_ALLOCATED,
+  /// Sub-chains solved, by the DP or along a Hu-Shing/approximate tree.
+  DP_CELLS,
+  /// Split points priced by the DP.
+  SPLITS_EVALUATED,
+  /// Property queries reaching an operand.
+  PROPERTY_QUERIES,
+  PLAN_CACHE_HITS,
+  PLAN_CACHE_MISSES,
+  NUM_COUNTERS
+};
+
+enum class StatsPhase {
+  /// collectOperands and getPVector.
+  COLLECT_OPERANDS,
+  /// Filling the cost and split tables.
+  SOLVE,
+  /// Building the optimal tree from the splits.
+  BUILD_TREE,
+  NUM_PHASES
+};
+
+/// Snapshot of the counters and the time spent in each phase, summed over
+/// all threads since the last reset.
+struct Stats {
+  uint64_t counters[size_t(StatsCounter::NUM_COUNTERS)];
+  uint64_t phaseCalls[size_t(StatsPhase::NUM_PHASES)];
+  uint64_t phaseNanoseconds[size_t(StatsPhase::NUM_PHASES)];
+
+  uint64_t get(StatsCounter counter) const { return counters[size_t(counter)]; }
+  uint64_t getCalls(StatsPhase phase) const {
+    return phaseCalls[size_t(phase)];
+  }
+  uint64_t getNanoseconds(StatsPhase phase) const {
+    return phaseNanoseconds[size_t(phase)];
+  }
+};
+
+/// True if the library was built with the instrumentation.
+bool isStatsEnabled();
+Stats getStats();
+void resetStats();
+/// Write `stats` as a JSON object.
+void dumpStats(const Stats &stats, std::ostream &os);
+
+} // end namespace matrixchain
+
+namespace details {
+
+extern std::atomic<uint64_t>
+    statsCounters[size_t(matrixchain::StatsCounter::NUM_COUNTERS)];
+
+void addPhaseTime(matrixchain::StatsPhase phase, uint64_t nanoseconds);
+
+inline void addStat(matrixchain::StatsCounter counter, uint64_t value) {
+  statsCounters[size_t(counter)].fetch_add(value, std::memory_order_relaxed);
+}
+
+/// Add the lifetime of the timer to a phase.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(matrixchain::StatsPhase phase)
+      : phase(phase), start(std::chrono::steady_clock::now()) {}
+  ~PhaseTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    addPhaseTime(phase,
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                     .count());
+  }
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  matrixchain::StatsPhase phase;
+  std::chrono::steady_clock::time_point start;
+};
+
+} // end namespace details.
+
+#if MATRIX_CHAIN_STATS
+#define STATS_ADD(counter, value)                                              \
+  details::addStat(matrixchain::StatsCounter::counter, value)
+#define STATS_CONCAT_IMPL(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_IMPL(a, b)
+#define STATS_PHASE(phase)                                                     \
+  details::PhaseTimer STATS_CONCAT(phaseTimer, __LINE__)(                      \
+      matrixchain::StatsPhase::phase)
+#else
+#define STATS_ADD(counter, value)
+#define STATS_PHASE(phase)
+#endif
+
+#endif
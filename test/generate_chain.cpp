@@ -0,0 +1,84 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Writes the evaluator generated for one of the chains below, with its
+// test, to the file given on the command line (see CMakeLists.txt).
+
+#include "chain.h"
+#include "execute.h"
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+using namespace matrixchain;
+
+static Expr *getChain(const string &name) {
+  if (name == "plain") {
+    auto *A = new Operand("A", {30, 35});
+    auto *B = new Operand("B", {35, 15});
+    auto *C = new Operand("C", {15, 5});
+    auto *D = new Operand("D", {5, 10});
+    auto *E = new Operand("E", {10, 20});
+    auto *F = new Operand("F", {25, 20});
+    return mul(A, B, C, D, E, trans(F));
+  }
+  auto *L = new Operand("L", {40, 40});
+  auto *U = new Operand("U", {40, 40});
+  auto *S = new Operand("S", {40, 40});
+  auto *A = new Operand("A", {40, 40});
+  auto *X = new Operand("X", {40, 15});
+  auto *Y = new Operand("Y", {15, 40});
+  L->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  U->setProperties({Expr::ExprProperty::UPPER_TRIANGULAR});
+  S->setProperties({Expr::ExprProperty::SPD, Expr::ExprProperty::SYMMETRIC});
+  // TRMM, SYMM and a SYRK of (X^T L U X) (X^T L U X)^T.
+  if (name == "properties")
+    return mul(S, X, trans(X), L, U, X, trans(X), trans(U), trans(L), X, Y);
+  // the three solves and an explicit inverse.
+  if (name == "solves")
+    return mul(inv(S), X, Y, inv(trans(U)), inv(L), inv(A));
+  // one POSV, checked against the library (see test_generated_spd.cpp).
+  if (name == "spd")
+    return mul(inv(S), X);
+  return nullptr;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    cerr << "usage: " << argv[0]
+         << " plain|properties|solves|spd <output>\n";
+    return 1;
+  }
+  ScopedContext ctx;
+  Expr *chain = getChain(argv[1]);
+  if (!chain) {
+    cerr << "unknown chain " << argv[1] << "\n";
+    return 1;
+  }
+  ofstream os(argv[2]);
+  CodegenOptions options;
+  options.name = argv[1];
+  options.emitTest = string(argv[1]) != "spd";
+  generateEvaluator(chain, runMCP(chain), os, options);
+  return os ? 0 : 1;
+}
@@ -22,7 +22,19 @@ SOFTWARE.
 */
 
 #include "chain.h"
+#include "costmodel.h"
+#include "execute.h"
+#include "kernels.h"
+#include "plancache.h"
+#include "threadpool.h"
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 using namespace matrixchain;
@@ -73,6 +85,30 @@ TEST(Chain, CostWithProperty) {
   auto *M = mul(A, B);
   long result = getMCPFlops(M);
   EXPECT_EQ(result, (20 * 20 * 15));
+  // the evaluator runs upper triangular chains through TRMM as well, and a
+  // symmetric left-hand side through SYMM, at the flops of GEMM.
+  auto *U = new Operand("U", {20, 20});
+  auto *S = new Operand("S", {20, 20});
+  U->setProperties({Expr::ExprProperty::UPPER_TRIANGULAR});
+  S->setProperties({Expr::ExprProperty::SYMMETRIC});
+  EXPECT_EQ(getMCPFlops(mul(U, B)), 20 * 20 * 15);
+  EXPECT_EQ(getMCPFlops(mul(U, U, B)), 2 * 20 * 20 * 15);
+  EXPECT_EQ(getMCPFlops(mul(S, B)), (20 * 20 * 15) << 1);
+}
+
+// Parents infer their properties at construction: an operand already in
+// use keeps its properties, in release builds too.
+TEST(Chain, LateSetProperties) {
+  ScopedContext ctx;
+  auto *A = new Operand("A", {20, 20});
+  auto *B = new Operand("B", {20, 15});
+  auto *M = mul(A, B);
+  EXPECT_THROW(A->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR}),
+               std::logic_error);
+  EXPECT_FALSE(A->isLowerTriangular());
+  EXPECT_EQ(getMCPFlops(M), (20 * 20 * 15) << 1);
+  EXPECT_THROW(M->setProperties({Expr::ExprProperty::SQUARE}),
+               std::logic_error);
 }
 
 // The product of two upper (lower) triangular matrices is upper (lower)
@@ -149,6 +185,25 @@ TEST(Chain, PropagationRulesIsSPD) {
   EXPECT_EQ(SPD->isSPD(), true);
 }
 
+TEST(Chain, PropertyMasks) {
+  ScopedContext ctx;
+  auto *A = new Operand("A", {20, 20});
+  A->setProperties({Expr::ExprProperty::SPD, Expr::ExprProperty::FULL_RANK});
+  EXPECT_EQ(A->getProperties(),
+            (vector<Expr::ExprProperty>{Expr::ExprProperty::FULL_RANK,
+                                        Expr::ExprProperty::SPD}));
+  // transposing an SPD matrix gives a symmetric one.
+  EXPECT_TRUE(trans(A)->isSymmetric());
+  // inverting and transposing keep the properties.
+  EXPECT_FALSE(inv(A)->isUpperTriangular());
+  EXPECT_TRUE(inv(A)->isSPD());
+  EXPECT_TRUE(inv(A)->isFullRank());
+  EXPECT_TRUE(trans(A)->isSPD());
+  EXPECT_FALSE(mul(A, A)->isKnown(Expr::ExprProperty::SQUARE));
+  EXPECT_TRUE(mul(trans(A), A)->isSPD());
+  EXPECT_FALSE(mul(A, A)->isSPD());
+}
+
 TEST(Chain, kernelCostWhenSPD) {
   ScopedContext ctx;
   auto *A = new Operand("A", {20, 20});
@@ -157,7 +212,7 @@ TEST(Chain, kernelCostWhenSPD) {
   long cost = 0;
   auto E = mul(mul(trans(A), A), B);
   cost = getMCPFlops(E);
-  EXPECT_EQ(cost, 22000);
+  EXPECT_EQ(cost, 20000);
 }
 
 TEST(Chain, CountFlopsIsSPD) {
@@ -167,22 +222,24 @@ TEST(Chain, CountFlopsIsSPD) {
   A->setProperties({Expr::ExprProperty::FULL_RANK});
   auto E = mul(mul(trans(A), A), B);
   auto result = getMCPFlops(E);
-  EXPECT_EQ(result, 22000);
+  EXPECT_EQ(result, 20000);
 }
 
 TEST(Chain, CountFlopsIsSymmetric) {
   ScopedContext ctx;
   auto *A = new Operand("A", {20, 20});
   auto *B = new Operand("B", {20, 15});
+  // the SYRK A^T A, then a product with the symmetric result at the flops
+  // of GEMM: no SYMM discount on top of the SYRK one.
   auto E = mul(mul(trans(A), A), B);
   auto result = getMCPFlops(E);
-  EXPECT_EQ(result, 22000);
+  EXPECT_EQ(result, 20 * 20 * 20 + 2 * 20 * 20 * 15);
   auto F = mul(mul(A, trans(A)), B);
   result = getMCPFlops(F);
-  EXPECT_EQ(result, 22000);
+  EXPECT_EQ(result, 20000);
   auto G = mul(A, trans(A), B);
   result = getMCPFlops(G);
-  EXPECT_EQ(result, 22000);
+  EXPECT_EQ(result, 20000);
 }
 
 TEST(Chain, areSameTree) {
@@ -199,14 +256,1140 @@ TEST(Chain, areSameTree) {
   EXPECT_EQ(is, false);
 }
 
+TEST(Chain, HashConsing) {
+  ScopedContext ctx;
+  auto *A = new Operand("A", {20, 20});
+  auto *B = new Operand("B", {20, 20});
+  auto *C = new Operand("C", {20, 20});
+  EXPECT_EQ(mul(A, B), mul(A, B));
+  EXPECT_EQ(trans(mul(A, B)), trans(mul(A, B)));
+  // muls are flattened before interning.
+  EXPECT_EQ(mul(A, mul(B, C)), mul(mul(A, B), C));
+  EXPECT_NE(mul(A, B), mul(B, A));
+  EXPECT_NE(trans(A), inv(A));
+  EXPECT_FALSE(trans(A)->isSame(inv(A)));
+  EXPECT_EQ(inv(B)->getHash(), inv(B)->getHash());
+  EXPECT_TRUE(trans(mul(A, B))->isTransposeOf(mul(A, B)));
+  // same operands, same tree.
+  EXPECT_EQ(runMCP(mul(A, B, C)).getOptimalTree(),
+            runMCP(mul(A, B, C)).getOptimalTree());
+}
+
 TEST(Chain, NormalForm) {
   ScopedContext ctx;
   auto *A = new Operand("A", {20, 20});
   auto *B = new Operand("B", {20, 20});
   auto *C = new Operand("C", {20, 20});
   auto *expr = trans(mul(A, mul(B, C)));
-  walk(expr);
-  cout << "\n\n normal form --->\n\n";
-  auto *normalForm = expr->getNormalForm();
-  walk(normalForm);
+  EXPECT_EQ(expr->getNormalForm(), mul(trans(C), trans(B), trans(A)));
+  EXPECT_EQ(trans(trans(A))->getNormalForm(), A);
+  EXPECT_EQ(trans(mul(trans(A), B))->getNormalForm(), mul(trans(B), A));
+  EXPECT_EQ(trans(inv(A))->getNormalForm(), inv(trans(A)));
+  EXPECT_EQ(inv(mul(A, trans(B)))->getNormalForm(),
+            mul(inv(trans(B)), inv(A)));
+  // the inverse of a product of non-square matrices stays as it is.
+  auto *D = new Operand("D", {20, 10});
+  auto *E = new Operand("E", {10, 20});
+  EXPECT_EQ(inv(mul(D, E))->getNormalForm(), inv(mul(D, E)));
+  // (D (A D)^T)^T = A D D^T.
+  EXPECT_EQ(details::collectOperands(trans(mul(D, trans(mul(A, D))))),
+            (vector<Expr *>{A, D, trans(D)}));
+  // transposed leaves have the transposed shape.
+  EXPECT_EQ(getMCPFlops(mul(trans(D), trans(E))), 2 * 10 * 20 * 10);
+}
+
+TEST(Chain, MCPArena) {
+  ScopedContext ctx;
+  auto *A = ctx.create<Operand>("A1", vector<int>{30, 35});
+  auto *B = ctx.create<Operand>("A2", vector<int>{35, 15});
+  auto *C = ctx.create<Operand>("A3", vector<int>{15, 5});
+  auto *D = new Operand("A4", {5, 10});
+  auto *E = new Operand("A5", {10, 20});
+  auto *F = new Operand("A6", {20, 25});
+  auto G = mul(A, B, C, D, E, F);
+  long result = getMCPFlops(G);
+  EXPECT_EQ(result, 30250);
+}
+
+TEST(Chain, MCPSplits) {
+  ScopedContext ctx;
+  auto *A = new Operand("A1", {30, 35});
+  auto *B = new Operand("A2", {35, 15});
+  auto *C = new Operand("A3", {15, 5});
+  auto *D = new Operand("A4", {5, 10});
+  auto *E = new Operand("A5", {10, 20});
+  auto *F = new Operand("A6", {20, 25});
+  ResultMCP result = runMCP(mul(A, B, C, D, E, F));
+  EXPECT_EQ(result.size(), 6);
+  EXPECT_EQ(result.getOptimalCost(), 30250);
+  // ((A1 (A2 A3)) ((A4 A5) A6))
+  EXPECT_EQ(result.getSplit(1, 6), 3);
+  EXPECT_EQ(result.getSplit(1, 3), 1);
+  EXPECT_EQ(result.getSplit(4, 6), 5);
+  EXPECT_EQ(result.getCost(2, 3), 35 * 15 * 5 * 2);
+}
+
+// Chain of n operands with random shapes, with `withProperties` some of the
+// square ones are lower triangular.
+static Expr *getRandomChain(size_t n, unsigned seed,
+                            bool withProperties = true) {
+  std::mt19937 rng(seed);
+  vector<int> p(n + 1);
+  for (auto &dim : p)
+    dim = 1 + rng() % 10;
+  vector<Expr *> operands;
+  for (size_t i = 0; i < n; i++) {
+    auto *operand = new Operand("A" + to_string(i), {p[i], p[i + 1]});
+    if (withProperties && p[i] == p[i + 1] && rng() % 2)
+      operand->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+    operands.push_back(operand);
+  }
+  return details::binaryMul(operands);
+}
+
+TEST(Chain, MCPParallel) {
+  ScopedContext ctx;
+  auto *chain = getRandomChain(300, 42);
+  ResultMCP serial = runMCP(chain);
+  MCPOptions options;
+  options.numThreads = 4;
+  ResultMCP parallel = runMCP(chain, options);
+  ASSERT_EQ(serial.size(), parallel.size());
+  for (size_t i = 1; i <= serial.size(); i++) {
+    for (size_t j = i; j <= serial.size(); j++) {
+      EXPECT_EQ(serial.getCost(i, j), parallel.getCost(i, j));
+      EXPECT_EQ(serial.getSplit(i, j), parallel.getSplit(i, j));
+    }
+  }
+}
+
+// Tasks queued from the workers are stolen as soon as they are pushed, the
+// pools must still wind down.
+TEST(Chain, ThreadPool) {
+  for (int round = 0; round < 50; round++) {
+    details::ThreadPool pool(4);
+    std::atomic<size_t> sum(0);
+    pool.parallelFor(0, 64, 1, [&](size_t, size_t) {
+      pool.parallelFor(0, 64, 1,
+                       [&](size_t first, size_t last) { sum += last - first; });
+    });
+    EXPECT_EQ(sum, 64u * 64u);
+  }
+  // the first exception is rethrown once every chunk is done, on workers
+  // and on the waiting thread alike.
+  details::ThreadPool pool(4);
+  for (int round = 0; round < 20; round++) {
+    std::atomic<size_t> sum(0);
+    EXPECT_THROW(pool.parallelFor(0, 64, 1,
+                                  [&](size_t first, size_t last) {
+                                    if (first % 16 == 5)
+                                      throw std::runtime_error("chunk");
+                                    sum += last - first;
+                                  }),
+                 std::runtime_error);
+    EXPECT_EQ(sum, 60u);
+  }
+  std::atomic<size_t> sum(0);
+  pool.parallelFor(0, 64, 1,
+                   [&](size_t first, size_t last) { sum += last - first; });
+  EXPECT_EQ(sum, 64u);
+}
+
+TEST(Chain, HuShing) {
+  ScopedContext ctx;
+  MCPOptions options;
+  options.engine = MCPEngine::HU_SHING;
+  for (unsigned seed = 0; seed < 200; seed++) {
+    auto *chain = getRandomChain(2 + seed % 40, seed, false);
+    long expected = getMCPFlops(chain);
+    EXPECT_EQ(getMCPFlops(chain, options), expected);
+    // the splits must describe a parenthesization with the same cost.
+    EXPECT_EQ(runMCP(chain, options).getOptimalCost(), expected);
+  }
+}
+
+TEST(Chain, HuShingFallback) {
+  ScopedContext ctx;
+  MCPOptions options;
+  options.engine = MCPEngine::HU_SHING;
+  for (unsigned seed = 0; seed < 50; seed++) {
+    auto *chain = getRandomChain(2 + seed % 20, seed);
+    EXPECT_EQ(getMCPFlops(chain, options), getMCPFlops(chain));
+  }
+  auto *A = new Operand("A", {20, 20});
+  auto *B = new Operand("B", {20, 15});
+  EXPECT_EQ(getMCPFlops(mul(trans(A), A, B), options), 20000);
+}
+
+TEST(Chain, ApproximateMCP) {
+  ScopedContext ctx;
+  MCPOptions options;
+  options.engine = MCPEngine::APPROXIMATE;
+  double worst = 1;
+  for (unsigned seed = 0; seed < 200; seed++) {
+    auto *chain = getRandomChain(2 + seed % 40, seed, false);
+    long expected = getMCPFlops(chain);
+    long cost = getMCPFlops(chain, options);
+    EXPECT_EQ(runMCP(chain, options).getOptimalCost(), cost);
+    worst = std::max(worst, double(cost) / expected);
+  }
+  EXPECT_LE(worst, 2 / std::sqrt(3.0));
+  RecordProperty("worstRatio", std::to_string(worst));
+  // falls back to the DP.
+  auto *A = new Operand("A", {20, 20});
+  auto *B = new Operand("B", {20, 15});
+  EXPECT_EQ(getMCPFlops(mul(trans(A), A, B), options), 20000);
+}
+
+TEST(Chain, SplitKernel) {
+  std::mt19937 rng(42);
+  for (size_t size = 1; size < 70; size++) {
+    vector<long> left(size), right(size), dims(size);
+    for (size_t t = 0; t < size; t++) {
+      // few distinct values to exercise ties.
+      left[t] = rng() % 8;
+      right[t] = rng() % 8;
+      dims[t] = 1 + rng() % 4;
+    }
+    long expected;
+    size_t split = details::findMinSplit(left.data(), right.data(), dims.data(),
+                                         3, size, expected,
+                                         details::SIMDLevel::SCALAR);
+    for (auto level : {details::SIMDLevel::AVX2, details::SIMDLevel::AVX512}) {
+      if (level > details::getSIMDLevel())
+        continue;
+      long best;
+      EXPECT_EQ(details::findMinSplit(left.data(), right.data(), dims.data(), 3,
+                                      size, best, level),
+                split);
+      EXPECT_EQ(best, expected);
+    }
+    // the splits under a bound, in order.
+    for (long bound : {-1l, expected, expected + 5, 1000l}) {
+      vector<size_t> splits(size), expectedSplits;
+      for (size_t t = 0; t < size; t++)
+        if (left[t] + right[t] + 3 * dims[t] <= bound)
+          expectedSplits.push_back(t);
+      for (auto level : {details::SIMDLevel::SCALAR, details::SIMDLevel::AVX2,
+                         details::SIMDLevel::AVX512}) {
+        if (level > details::getSIMDLevel())
+          continue;
+        size_t found =
+            details::findSplitsBelow(left.data(), right.data(), dims.data(), 3,
+                                     size, bound, splits.data(), level);
+        EXPECT_EQ(vector<size_t>(splits.begin(), splits.begin() + found),
+                  expectedSplits);
+      }
+    }
+  }
+}
+
+TEST(Chain, PlanCache) {
+  ScopedContext ctx;
+  PlanCache cache(2);
+  MCPOptions options;
+  options.cache = &cache;
+  auto *A = new Operand("A", {30, 35});
+  auto *B = new Operand("B", {35, 15});
+  auto *C = new Operand("C", {15, 5});
+  auto *D = new Operand("D", {5, 10});
+  auto *E = new Operand("E", {10, 20});
+  auto *F = new Operand("F", {20, 25});
+  EXPECT_EQ(getMCPFlops(mul(A, B, C, D, E, F), options), 30250);
+  // same shapes, different names.
+  auto *G = new Operand("G", {30, 35});
+  auto *H = new Operand("H", {35, 15});
+  auto *I = new Operand("I", {15, 5});
+  auto *J = new Operand("J", {5, 10});
+  auto *K = new Operand("K", {10, 20});
+  auto *L = new Operand("L", {20, 25});
+  ResultMCP result = runMCP(mul(G, H, I, J, K, L), options);
+  EXPECT_EQ(result.getOptimalCost(), 30250);
+  EXPECT_EQ(result.getSplit(1, 6), 3);
+  EXPECT_TRUE(result.getOptimalTree()->isSame(
+      runMCP(mul(G, H, I, J, K, L)).getOptimalTree()));
+  EXPECT_EQ(cache.getHits(), 1u);
+  EXPECT_EQ(cache.getMisses(), 1u);
+
+  // properties are part of the signature.
+  auto *S = new Operand("S", {20, 20});
+  auto *T = new Operand("T", {20, 20});
+  auto *U = new Operand("U", {20, 15});
+  auto *LT = new Operand("LT", {20, 20});
+  LT->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  EXPECT_EQ(getMCPFlops(mul(S, T, U), options), 24000);
+  EXPECT_EQ(getMCPFlops(mul(S, LT, U), options), getMCPFlops(mul(S, LT, U)));
+  EXPECT_EQ(getMCPFlops(mul(trans(S), S, U), options), 20000);
+  EXPECT_EQ(cache.getMisses(), 4u);
+  EXPECT_EQ(cache.size(), 2u);
+  // the 6-chain was evicted.
+  getMCPFlops(mul(A, B, C, D, E, F), options);
+  EXPECT_EQ(cache.getMisses(), 5u);
+
+  cache.clear();
+  vector<std::thread> threads;
+  vector<long> costs(4);
+  for (size_t t = 0; t < costs.size(); t++)
+    threads.emplace_back([&, t]() {
+      ScopedContext threadCtx;
+      for (unsigned seed = 0; seed < 20; seed++)
+        costs[t] += getMCPFlops(getRandomChain(10, seed % 5), options);
+    });
+  for (auto &thread : threads)
+    thread.join();
+  for (long cost : costs)
+    EXPECT_EQ(cost, costs[0]);
+  EXPECT_EQ(cache.getHits() + cache.getMisses(), 80u);
+}
+
+TEST(Chain, MCPBatch) {
+  ScopedContext ctx;
+  vector<Expr *> chains;
+  for (unsigned seed = 0; seed < 100; seed++)
+    chains.push_back(getRandomChain(2 + seed % 30, seed));
+  MCPOptions options;
+  options.numThreads = 4;
+  BatchResultMCP batch = runMCPBatch(chains, options);
+  ASSERT_EQ(batch.size(), chains.size());
+  for (size_t c = 0; c < chains.size(); c++) {
+    ResultMCP result = runMCP(chains[c]);
+    ASSERT_EQ(batch.sizes[c], result.size());
+    EXPECT_EQ(batch.getOptimalCost(c), result.getOptimalCost());
+    for (size_t i = 1; i <= result.size(); i++)
+      for (size_t j = i; j <= result.size(); j++)
+        EXPECT_EQ(batch.getSplit(c, i, j), result.getSplit(i, j));
+  }
+  options.engine = MCPEngine::HU_SHING;
+  batch = runMCPBatch(chains, options);
+  for (size_t c = 0; c < chains.size(); c++)
+    EXPECT_EQ(batch.getOptimalCost(c), getMCPFlops(chains[c]));
+}
+
+TEST(Chain, Stats) {
+  ScopedContext ctx;
+  resetStats();
+  PlanCache cache;
+  MCPOptions options;
+  options.cache = &cache;
+  auto *A = new Operand("A", {30, 35});
+  auto *B = new Operand("B", {35, 15});
+  auto *C = new Operand("C", {15, 5});
+  auto *D = new Operand("D", {5, 10});
+  auto *E = new Operand("E", {10, 20});
+  auto *F = new Operand("F", {20, 25});
+  auto *chain = mul(A, B, C, D, E, F);
+  runMCP(chain, options);
+  runMCP(chain, options);
+  Stats stats = getStats();
+  if (!isStatsEnabled()) {
+    EXPECT_EQ(stats.get(StatsCounter::DP_CELLS), 0u);
+    return;
+  }
+  EXPECT_EQ(stats.get(StatsCounter::DP_CELLS), 15u);
+  EXPECT_EQ(stats.get(StatsCounter::SPLITS_EVALUATED), 35u);
+  EXPECT_EQ(stats.get(StatsCounter::PLAN_CACHE_HITS), 1u);
+  EXPECT_EQ(stats.get(StatsCounter::PLAN_CACHE_MISSES), 1u);
+  // the operands, the chain and the optimal tree, built once.
+  EXPECT_EQ(stats.get(StatsCounter::NODES_ALLOCATED), 12u);
+  EXPECT_GT(stats.get(StatsCounter::PROPERTY_QUERIES), 0u);
+  EXPECT_EQ(stats.getCalls(StatsPhase::COLLECT_OPERANDS), 2u);
+  EXPECT_EQ(stats.getCalls(StatsPhase::SOLVE), 1u);
+  EXPECT_EQ(stats.getCalls(StatsPhase::BUILD_TREE), 2u);
+  std::ostringstream json;
+  dumpStats(stats, json);
+  EXPECT_NE(json.str().find("\"dp_cells\": 15"), string::npos);
+}
+
+static vector<double> getRandomMatrix(long rows, long cols, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> dist(-1, 1);
+  vector<double> matrix(rows * cols);
+  for (auto &value : matrix)
+    value = dist(rng);
+  return matrix;
+}
+
+/// Random buffers for `operands`, appended to `buffers` in order and bound
+/// to the operands in `bindings`.
+static void bindRandom(const vector<Operand *> &operands, std::mt19937 &rng,
+                       vector<vector<double>> &buffers, Bindings &bindings) {
+  for (auto *operand : operands) {
+    buffers.push_back(getRandomMatrix(operand->getShape()[0],
+                                      operand->getShape()[1], rng));
+    bindings[operand] = buffers.back().data();
+  }
+}
+
+/// Row-major view of the buffer bound to `operand`.
+static details::MatrixRef getRef(const Bindings &bindings,
+                                 const Operand *operand) {
+  return details::getRowMajor(bindings.at(operand), operand->getShape()[0],
+                              operand->getShape()[1]);
+}
+
+static vector<double> multiply(const details::MatrixRef &a,
+                               const details::MatrixRef &b) {
+  vector<double> c(a.rows * b.cols, 0.0);
+  for (long i = 0; i < a.rows; i++)
+    for (long k = 0; k < a.cols; k++)
+      for (long j = 0; j < b.cols; j++)
+        c[i * b.cols + j] += a(i, k) * b(k, j);
+  return c;
+}
+
+static void expectNear(const vector<double> &actual,
+                       const vector<double> &expected) {
+  ASSERT_EQ(actual.size(), expected.size());
+  for (size_t i = 0; i < actual.size(); i++)
+    ASSERT_NEAR(actual[i], expected[i], 1e-9 * (1 + std::fabs(expected[i])));
+}
+
+TEST(Chain, Gemm) {
+  std::mt19937 rng(7);
+  for (long m : {1, 5, 6, 13, 100})
+    for (long n : {1, 7, 8, 17, 301})
+      for (long k : {1, 3, 257}) {
+        vector<double> a = getRandomMatrix(m, k, rng);
+        vector<double> b = getRandomMatrix(n, k, rng);
+        // B is stored transposed.
+        auto lhs = details::getRowMajor(a.data(), m, k);
+        auto rhs = details::getRowMajor(b.data(), n, k).transpose();
+        vector<double> c(m * n, 42.0);
+        details::gemm(lhs, rhs, c.data(), n);
+        expectNear(c, multiply(lhs, rhs));
+      }
+}
+
+TEST(Chain, EvaluateThreads) {
+  ScopedContext ctx;
+  std::mt19937 rng(19);
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  vector<Operand *> operands;
+  vector<int> p = {120, 200, 150, 150, 90, 180, 60, 250, 130};
+  for (size_t i = 0; i + 1 < p.size(); i++)
+    operands.push_back(new Operand("A" + std::to_string(i), {p[i], p[i + 1]}));
+  operands[2]->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  bindRandom(operands, rng, buffers, bindings);
+  // the lower triangular operand holds zeros above the diagonal.
+  for (long i = 0; i < 150; i++)
+    for (long j = i + 1; j < 150; j++)
+      buffers[2][i * 150 + j] = 0.0;
+  Expr *chain =
+      details::binaryMul(vector<Expr *>(operands.begin(), operands.end()));
+  vector<double> expected(120 * 130), out(120 * 130);
+  evaluate(chain, bindings, expected.data());
+  for (unsigned numThreads : {2, 3, 8}) {
+    MCPOptions options;
+    options.numThreads = numThreads;
+    std::fill(out.begin(), out.end(), 42.0);
+    evaluate(chain, bindings, out.data(), options);
+    expectNear(out, expected);
+  }
+  // X^T X, large enough to be split.
+  Expr *gram = mul(trans(operands[1]), operands[1]);
+  ResultMCP plan = runMCP(gram);
+  expected.resize(150 * 150);
+  out.resize(150 * 150);
+  evaluate(gram, plan, bindings, expected.data());
+  evaluate(gram, plan, bindings, out.data(), 4);
+  expectNear(out, expected);
+}
+
+TEST(Chain, MemoryPlan) {
+  ScopedContext ctx;
+  std::mt19937 rng(23);
+  vector<int> p = {10, 20, 30, 40, 50, 60, 70};
+  vector<vector<double>> buffers;
+  vector<Operand *> operands;
+  Bindings bindings;
+  for (size_t i = 0; i + 1 < p.size(); i++)
+    operands.push_back(new Operand("A" + std::to_string(i), {p[i], p[i + 1]}));
+  bindRandom(operands, rng, buffers, bindings);
+  Expr *chain =
+      details::binaryMul(vector<Expr *>(operands.begin(), operands.end()));
+  ResultMCP plan = runMCP(chain);
+  // ((((A1 A2) A3) A4) A5) A6: two buffers alive at a time, each sized for
+  // the larger of the products it holds.
+  for (size_t j = 2; j <= 6; j++)
+    plan.getSplits()(1, j) = j - 1;
+  for (unsigned numThreads : {1, 2}) {
+    MemoryPlan memory = planMemory(chain, plan, numThreads);
+    EXPECT_EQ(memory.numBuffers, 2);
+    EXPECT_EQ(memory.getPeakBytes(), (10 * 50 + 10 * 60) * sizeof(double));
+  }
+  vector<double> expected(10 * 70), out(10 * 70);
+  evaluate(chain, plan, bindings, expected.data());
+  // (A1 (A2 A3)) ((A4 A5) A6): A2 A3 and A4 A5 share a buffer when
+  // evaluated one after the other, not when the two sides run concurrently.
+  plan.getSplits()(1, 6) = 3;
+  plan.getSplits()(1, 3) = 1;
+  plan.getSplits()(2, 3) = 2;
+  plan.getSplits()(4, 6) = 5;
+  plan.getSplits()(4, 5) = 4;
+  EXPECT_EQ(planMemory(chain, plan).numBuffers, 3);
+  EXPECT_EQ(planMemory(chain, plan, 2).numBuffers, 4);
+  for (unsigned numThreads : {1, 2}) {
+    PreparedChain prepared(chain, plan, numThreads);
+    // the flops of the tree, the costs are the ones of the optimal plan.
+    EXPECT_EQ(prepared.getFlops(),
+              2 * (20 * 30 * 40 + 10 * 20 * 40 + 40 * 50 * 60 +
+                   40 * 60 * 70 + 10 * 40 * 70));
+    for (int run = 0; run < 2; run++) {
+      std::fill(out.begin(), out.end(), 0.0);
+      prepared.run(bindings, out.data());
+      expectNear(out, expected);
+    }
+  }
+}
+
+TEST(Chain, CostModel) {
+  ScopedContext ctx;
+  // GEMM runs at n flops per nanosecond: 2 m k n flops take 2 m k ns.
+  vector<long> grid = {1, 16, 256};
+  vector<double> gemm(27), square(9, 1.0);
+  for (size_t i = 0; i < gemm.size(); i++)
+    gemm[i] = grid[i % 3];
+  MeasuredModel model(grid,
+                      {gemm, square, square, square, square, square, square});
+  EXPECT_EQ(model.getCost(KernelKind::GEMM, 16, 256, 1), 2000 * 16 * 256);
+  EXPECT_EQ(model.getCost(KernelKind::TRMM, 16, 16, 256), 1000 * 16 * 16 * 256);
+  // halfway between 1 and 16 in log2, clamped above the grid.
+  EXPECT_DOUBLE_EQ(model.getThroughput(KernelKind::GEMM, 7, 7, 4), 8.5);
+  EXPECT_DOUBLE_EQ(model.getThroughput(KernelKind::GEMM, 7, 7, 4096), 256.0);
+
+  // A B C with A 256 x 16, B 16 x 1, C 1 x 256: (A B) C has the fewest
+  // flops, A (B C) the shortest predicted time.
+  auto *A = new Operand("A", {256, 16});
+  auto *B = new Operand("B", {16, 1});
+  auto *C = new Operand("C", {1, 256});
+  MCPOptions options;
+  ResultMCP flops = runMCP(mul(A, B, C), options);
+  EXPECT_EQ(flops.getSplit(1, 3), 2);
+  options.costModel = &FlopModel::get();
+  EXPECT_EQ(runMCP(mul(A, B, C), options).getOptimalCost(),
+            flops.getOptimalCost());
+  options.costModel = &model;
+  ResultMCP measured = runMCP(mul(A, B, C), options);
+  EXPECT_EQ(measured.getSplit(1, 3), 1);
+  EXPECT_EQ(measured.getOptimalCost(), 2000 * (16 * 1 + 256 * 16));
+  // getMCPFlops counts the flops of that plan, not its time.
+  const long measuredFlops = 2 * (16 * 1 * 256 + 256 * 16 * 256);
+  EXPECT_EQ(getPlanFlops(mul(A, B, C), measured), measuredFlops);
+  EXPECT_EQ(getMCPFlops(mul(A, B, C), options), measuredFlops);
+  // the plan cache tells the models apart.
+  PlanCache cache;
+  options.cache = &cache;
+  EXPECT_EQ(runMCP(mul(A, B, C), options).getSplit(1, 3), 1);
+  EXPECT_EQ(getMCPFlops(mul(A, B, C), options), measuredFlops);
+  options.costModel = nullptr;
+  EXPECT_EQ(runMCP(mul(A, B, C), options).getSplit(1, 3), 2);
+  EXPECT_EQ(cache.getMisses(), 2u);
+  options.costModel = &TrafficModel::get();
+  runMCP(mul(A, B, C), options);
+  EXPECT_EQ(cache.getMisses(), 3u);
+  vector<size_t> hashes = {FlopModel::get().getHash(),
+                           TrafficModel::get().getHash(),
+                           MeasuredModel().getHash(), model.getHash()};
+  std::sort(hashes.begin(), hashes.end());
+  EXPECT_EQ(std::unique(hashes.begin(), hashes.end()), hashes.end());
+  EXPECT_EQ(TrafficModel().getHash(), TrafficModel::get().getHash());
+
+  // round trip through a file, bad files are rejected.
+  std::string path = testing::TempDir() + "matrixchain_costs.txt";
+  ASSERT_TRUE(model.save(path));
+  MeasuredModel loaded;
+  ASSERT_TRUE(loaded.load(path));
+  EXPECT_EQ(loaded.getHash(), model.getHash());
+  EXPECT_EQ(loaded.getCost(KernelKind::GEMM, 100, 3, 50),
+            model.getCost(KernelKind::GEMM, 100, 3, 50));
+  std::ofstream(path) << "matrixchain-costs 1\ngrid 2 1 4\ngemm 1 2\n";
+  EXPECT_FALSE(loaded.load(path));
+  EXPECT_EQ(loaded.getHash(), model.getHash());
+  // well-formed tables on a grid with a repeated point.
+  ASSERT_TRUE(model.save(path));
+  std::stringstream saved;
+  saved << std::ifstream(path).rdbuf();
+  std::string text = saved.str();
+  const std::string gridLine = "grid 3 1 16 256";
+  ASSERT_NE(text.find(gridLine), std::string::npos);
+  text.replace(text.find(gridLine), gridLine.size(), "grid 3 1 16 16");
+  std::ofstream(path) << text;
+  EXPECT_FALSE(loaded.load(path));
+  EXPECT_EQ(loaded.getGrid(), grid);
+  std::remove(path.c_str());
+
+  MeasuredModel calibrated = MeasuredModel::calibrate({1, 8});
+  EXPECT_EQ(calibrated.getGrid().size(), 2u);
+  for (KernelKind kernel :
+       {KernelKind::GEMM, KernelKind::TRMM, KernelKind::SYMM, KernelKind::SYRK,
+        KernelKind::TRSM, KernelKind::POSV, KernelKind::GESV})
+    EXPECT_GT(calibrated.getThroughput(kernel, 8, 8, 8), 0.0);
+}
+
+TEST(Chain, ParetoMCP) {
+  ScopedContext ctx;
+  vector<int> p = {10, 100, 5, 50, 1, 100};
+  vector<Expr *> operands;
+  for (size_t i = 0; i + 1 < p.size(); i++)
+    operands.push_back(new Operand("A" + std::to_string(i), {p[i], p[i + 1]}));
+  Expr *chain = details::binaryMul(operands);
+  vector<ParetoPlan> plans = runMCPPareto(chain);
+  ASSERT_EQ(plans.size(), 2u);
+  EXPECT_EQ(plans[0].cost, runMCP(chain).getOptimalCost());
+  EXPECT_EQ(plans[0].cost, 5500);
+  EXPECT_EQ(plans[0].peakBytes, 110 * long(sizeof(double)));
+  EXPECT_EQ(plans[1].cost, 12600);
+  EXPECT_EQ(plans[1].peakBytes, 65 * long(sizeof(double)));
+  for (const auto &plan : plans) {
+    EXPECT_EQ(plan.plan.getOptimalCost(), plan.cost);
+    EXPECT_NE(plan.plan.getOptimalTree(), nullptr);
+    // buffers are sized for their largest occupant.
+    EXPECT_GE(long(planMemory(chain, plan.plan).getPeakBytes()),
+              plan.peakBytes);
+  }
+
+  // (A1 A2) A3 moves 1550 + 800 doubles.
+  MCPOptions options;
+  options.costModel = &TrafficModel::get();
+  ResultMCP traffic = runMCP(mul(operands[0], operands[1], operands[2]),
+                             options);
+  EXPECT_EQ(traffic.getSplit(1, 3), 2);
+  EXPECT_EQ(traffic.getOptimalCost(), 2350 * long(sizeof(double)));
+  PreparedChain prepared(mul(operands[0], operands[1], operands[2]), traffic);
+  EXPECT_EQ(prepared.getFlops(), 2 * (10 * 100 * 5 + 10 * 5 * 50));
+  EXPECT_FALSE(runMCPPareto(chain, options).empty());
+}
+
+TEST(Chain, TopKMCP) {
+  ScopedContext ctx;
+  std::mt19937 rng(31);
+  const size_t n = 8;
+  vector<long> p(n + 1);
+  for (auto &dim : p)
+    dim = 1 + rng() % 30;
+  vector<Expr *> operands;
+  for (size_t i = 0; i < n; i++)
+    operands.push_back(new Operand("A", {int(p[i]), int(p[i + 1])}));
+  Expr *chain = details::binaryMul(operands);
+  // the costs of every parenthesization of i..j.
+  std::function<vector<long>(size_t, size_t)> getAllCosts =
+      [&](size_t i, size_t j) -> vector<long> {
+    if (i == j)
+      return {0};
+    vector<long> costs;
+    for (size_t k = i; k < j; k++)
+      for (long left : getAllCosts(i, k))
+        for (long right : getAllCosts(k + 1, j))
+          costs.push_back(left + right + 2 * p[i - 1] * p[k] * p[j]);
+    return costs;
+  };
+  vector<long> costs = getAllCosts(1, n);
+  std::sort(costs.begin(), costs.end());
+  vector<RankedPlan> plans = runMCPTopK(chain, 8);
+  ASSERT_EQ(plans.size(), 8u);
+  EXPECT_EQ(plans[0].plan.getOptimalTree(), runMCP(chain).getOptimalTree());
+  std::set<Expr *> trees;
+  for (size_t r = 0; r < plans.size(); r++) {
+    EXPECT_EQ(plans[r].cost, costs[r]);
+    EXPECT_EQ(plans[r].plan.getOptimalCost(), plans[r].cost);
+    trees.insert(plans[r].plan.getOptimalTree());
+  }
+  EXPECT_EQ(trees.size(), plans.size());
+  // A B C has two parenthesizations.
+  EXPECT_EQ(runMCPTopK(mul(operands[0], operands[1], operands[2]), 8).size(),
+            2u);
+
+  // the vectorized filter of the flop count keeps the plans that pricing
+  // every split finds.
+  struct PricedFlops : public CostModel {
+    long getCost(KernelKind kernel, long m, long k, long n) const override {
+      return FlopModel::get().getCost(kernel, m, k, n);
+    }
+    size_t getHash() const override { return 42; }
+  } pricedFlops;
+  MCPOptions priced;
+  priced.costModel = &pricedFlops;
+  for (unsigned seed = 0; seed < 10; seed++) {
+    Expr *random = getRandomChain(10 + 5 * seed, seed);
+    for (size_t count : {2, 5, 8}) {
+      vector<RankedPlan> fast = runMCPTopK(random, count);
+      vector<RankedPlan> slow = runMCPTopK(random, count, priced);
+      ASSERT_EQ(fast.size(), slow.size());
+      for (size_t r = 0; r < fast.size(); r++) {
+        EXPECT_EQ(fast[r].cost, slow[r].cost);
+        EXPECT_EQ(fast[r].plan.getOptimalTree(),
+                  slow[r].plan.getOptimalTree());
+      }
+      EXPECT_EQ(fast[0].cost, getMCPFlops(random));
+    }
+  }
+
+  // the rankings follow the pricing of runMCP: X X^T is a SYRK, then a
+  // SYMM with Y, at the flops of a GEMM.
+  auto *X = new Operand("X", {20, 10});
+  auto *Y = new Operand("Y", {20, 5});
+  Expr *gram = mul(X, trans(X), Y);
+  plans = runMCPTopK(gram, 2);
+  ASSERT_EQ(plans.size(), 2u);
+  EXPECT_EQ(plans[0].cost, getMCPFlops(gram));
+  EXPECT_EQ(plans[0].cost, 2 * 10 * 20 * 5 + 2 * 20 * 10 * 5);
+  EXPECT_EQ(plans[1].cost, 20 * 10 * 20 + 2 * 20 * 20 * 5);
+  EXPECT_EQ(plans[1].plan.getSplit(1, 3), 2);
+}
+
+TEST(Chain, PropertyKernels) {
+  std::mt19937 rng(13);
+  for (long n : {1, 63, 64, 150})
+    for (long m : {1, 9, 70}) {
+      // the triangle the kernels must not read holds garbage.
+      vector<double> t = getRandomMatrix(n, n, rng);
+      vector<double> lower(n * n), upper(n * n), symmetric(n * n);
+      for (long i = 0; i < n; i++)
+        for (long j = 0; j < n; j++) {
+          lower[i * n + j] = j <= i ? t[i * n + j] : 0.0;
+          upper[i * n + j] = j >= i ? t[i * n + j] : 0.0;
+          symmetric[i * n + j] = j <= i ? t[i * n + j] : t[j * n + i];
+        }
+      vector<double> b = getRandomMatrix(n, m, rng);
+      auto lhs = details::getRowMajor(t.data(), n, n);
+      auto rhs = details::getRowMajor(b.data(), n, m);
+      vector<double> c(n * m, 42.0);
+      details::trmm(details::Triangle::LOWER, lhs, rhs, c.data(), m);
+      expectNear(c, multiply(details::getRowMajor(lower.data(), n, n), rhs));
+      details::trmm(details::Triangle::UPPER, lhs, rhs, c.data(), m);
+      expectNear(c, multiply(details::getRowMajor(upper.data(), n, n), rhs));
+      details::symm(lhs, rhs, c.data(), m);
+      expectNear(c,
+                 multiply(details::getRowMajor(symmetric.data(), n, n), rhs));
+      // A^T * A through a transposed view, A * A^T directly.
+      vector<double> square(m * m, 42.0);
+      details::syrk(rhs.transpose(), square.data(), m);
+      expectNear(square, multiply(rhs.transpose(), rhs));
+      c.assign(n * n, 42.0);
+      details::syrk(rhs, c.data(), n);
+      expectNear(c, multiply(rhs, rhs.transpose()));
+    }
+}
+
+TEST(Chain, SolveKernels) {
+  std::mt19937 rng(17);
+  for (long n : {1, 63, 64, 150})
+    for (long m : {1, 9, 70}) {
+      // diagonally dominant, the triangle a kernel must not read holds
+      // garbage.
+      vector<double> a = getRandomMatrix(n, n, rng);
+      for (long i = 0; i < n; i++)
+        a[i * n + i] += n;
+      vector<double> lower(n * n), upper(n * n), spd(n * n);
+      for (long i = 0; i < n; i++)
+        for (long j = 0; j < n; j++) {
+          lower[i * n + j] = j <= i ? a[i * n + j] : 0.0;
+          upper[i * n + j] = j >= i ? a[i * n + j] : 0.0;
+          spd[i * n + j] = j >= i ? a[i * n + j] : a[j * n + i];
+        }
+      vector<double> b = getRandomMatrix(n, m, rng);
+      auto lhs = details::getRowMajor(a.data(), n, n);
+      auto rhs = details::getRowMajor(b.data(), n, m);
+      // A * (A^-1 * B) = B.
+      auto check = [&](const vector<double> &matrix, const vector<double> &c) {
+        expectNear(multiply(details::getRowMajor(matrix.data(), n, n),
+                            details::getRowMajor(c.data(), n, m)),
+                   b);
+      };
+      vector<double> c(n * m, 42.0), workspace(n * n);
+      details::trsm(details::Triangle::LOWER, lhs, rhs, c.data(), m);
+      check(lower, c);
+      details::trsm(details::Triangle::UPPER, lhs, rhs, c.data(), m);
+      check(upper, c);
+      details::posv(lhs, rhs, c.data(), m, workspace.data());
+      check(spd, c);
+      details::gesv(lhs, rhs, c.data(), m, workspace.data());
+      check(a, c);
+      // in place.
+      c = b;
+      details::gesv(lhs, details::getRowMajor(c.data(), n, m), c.data(), m,
+                    workspace.data());
+      check(a, c);
+      vector<double> inverse(n * n), identity(n * n, 0.0);
+      for (long i = 0; i < n; i++)
+        identity[i * n + i] = 1.0;
+      details::invert(lhs, inverse.data(), workspace.data());
+      vector<double> product =
+          multiply(lhs, details::getRowMajor(inverse.data(), n, n));
+      for (size_t i = 0; i < product.size(); i++)
+        ASSERT_NEAR(product[i], identity[i], 1e-12);
+    }
+}
+
+TEST(Chain, InverseSolves) {
+  ScopedContext ctx;
+  std::mt19937 rng(19);
+  auto *L = new Operand("L", {100, 100});
+  auto *S = new Operand("S", {100, 100});
+  auto *A = new Operand("A", {100, 100});
+  auto *X = new Operand("X", {100, 20});
+  auto *Y = new Operand("Y", {20, 100});
+  L->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  S->setProperties({Expr::ExprProperty::SPD, Expr::ExprProperty::SYMMETRIC});
+  EXPECT_TRUE(inv(L)->isLowerTriangular());
+  EXPECT_FALSE(inv(A)->isUpperTriangular());
+  EXPECT_TRUE(inv(trans(S))->isSPD());
+  // triangular solve, Cholesky, LU.
+  EXPECT_EQ(getMCPFlops(mul(inv(L), X)), 100 * 100 * 20);
+  EXPECT_EQ(getMCPFlops(mul(inv(S), X)), 2 * 100 * 100 * 20 + 1000000 / 3);
+  const long lu = 2 * 100 * 100 * 20 + 2000000 / 3;
+  EXPECT_EQ(getMCPFlops(mul(inv(A), X)), lu);
+  // Y (A^-1 X) solves, (Y A^-1) X would have to form A^-1.
+  Expr *chain = mul(Y, inv(A), X);
+  ResultMCP plan = runMCP(chain);
+  EXPECT_EQ(plan.getSplit(1, 3), 1);
+  EXPECT_EQ(plan.getOptimalCost(), lu + 2 * 20 * 100 * 20);
+  ResultMCP explicitPlan = plan;
+  explicitPlan.getSplits()(1, 3) = 2;
+  // only the LU factor of A is planned.
+  EXPECT_EQ(planMemory(chain, plan).getPeakBytes(),
+            (100 * 100 + 100 * 20) * sizeof(double));
+  EXPECT_EQ(planMemory(mul(inv(L), X), runMCP(mul(inv(L), X))).size, 0u);
+
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  bindRandom({L, S, A, X, Y}, rng, buffers, bindings);
+  // L, S and A are diagonally dominant, L lower triangular and S symmetric.
+  for (size_t t = 0; t < 3; t++) {
+    vector<double> &buffer = buffers[t];
+    for (long i = 0; i < 100; i++) {
+      buffer[i * 100 + i] += 100;
+      for (long j = i + 1; j < 100; j++) {
+        if (t == 0)
+          buffer[i * 100 + j] = 0.0;
+        if (t == 1)
+          buffer[i * 100 + j] = buffer[j * 100 + i];
+      }
+    }
+  }
+  vector<double> out(100 * 20);
+  for (auto *matrix : {L, S, A}) {
+    evaluate(mul(inv(matrix), X), bindings, out.data());
+    expectNear(multiply(getRef(bindings, matrix),
+                        details::getRowMajor(out.data(), 100, 20)),
+               buffers[3]);
+  }
+  // solving and inverting explicitly agree.
+  vector<double> solved(20 * 20), inverted(20 * 20);
+  for (unsigned numThreads : {1, 2}) {
+    evaluate(chain, plan, bindings, solved.data(), numThreads);
+    evaluate(chain, explicitPlan, bindings, inverted.data(), numThreads);
+    expectNear(solved, inverted);
+  }
+}
+
+TEST(Chain, MirroredChains) {
+  ScopedContext ctx;
+  std::mt19937 rng(21);
+  auto *A = new Operand("A", {30, 20});
+  auto *B = new Operand("B", {20, 10});
+  auto *C = new Operand("C", {30, 25});
+  // A B B^T A^T: (A B) (A B)^T is a SYRK from A B alone.
+  Expr *gram = mul(mul(A, B), trans(mul(A, B)));
+  EXPECT_TRUE(details::isMirrored(details::collectOperands(gram), 1, 4));
+  const long cost = 2 * 30 * 20 * 10 + 30 * 10 * 30;
+  ResultMCP plan = runMCP(gram);
+  EXPECT_EQ(plan.getOptimalCost(), cost);
+  EXPECT_EQ(plan.getSplit(1, 4), 2);
+  EXPECT_EQ(runMCPPareto(gram)[0].cost, cost);
+  EXPECT_EQ(runMCPBatch({gram}).costs[0], cost);
+  MCPOptions options;
+  options.engine = MCPEngine::HU_SHING;
+  EXPECT_EQ(getMCPFlops(gram, options), cost);
+
+  // times C, the SYRK is a symmetric left-hand side (SYMM), which is not
+  // cheaper than GEMM: evaluate that tree with a forced plan.
+  Expr *chain = mul(gram, C);
+  EXPECT_FALSE(details::isMirrored(details::collectOperands(chain), 1, 5));
+  EXPECT_LT(runMCP(chain).getOptimalCost(), cost + 2 * 30 * 30 * 25);
+  plan = runMCP(chain);
+  plan.getSplits()(1, 5) = 4;
+  plan.getSplits()(1, 4) = 2;
+  plan.getSplits()(1, 2) = 1;
+  plan.getSplits()(3, 4) = 3;
+  // B^T A^T is not computed: A B and its SYRK only.
+  EXPECT_EQ(planMemory(chain, plan).getPeakBytes(),
+            (30 * 10 + 30 * 30) * sizeof(double));
+
+  Bindings bindings;
+  vector<vector<double>> buffers;
+  bindRandom({A, B, C}, rng, buffers, bindings);
+  vector<double> ab = multiply(getRef(bindings, A), getRef(bindings, B));
+  auto abRef = details::getRowMajor(ab.data(), 30, 10);
+  vector<double> product = multiply(abRef, abRef.transpose());
+  vector<double> expected = multiply(
+      details::getRowMajor(product.data(), 30, 30), getRef(bindings, C));
+  vector<double> out(30 * 25);
+  for (unsigned numThreads : {1, 2}) {
+    evaluate(chain, plan, bindings, out.data(), numThreads);
+    expectNear(out, expected);
+  }
+}
+
+TEST(Chain, SharedMCP) {
+  ScopedContext ctx;
+  std::mt19937 rng(23);
+  // A B is computed once in A B C A B D.
+  auto *A = new Operand("A", {10, 100});
+  auto *B = new Operand("B", {100, 10});
+  auto *C = new Operand("C", {10, 10});
+  auto *D = new Operand("D", {10, 10});
+  SharedPlanMCP shared = runMCPShared({mul(A, B, C, A, B, D)});
+  EXPECT_EQ(shared.independentCost, getMCPFlops(mul(A, B, C, A, B, D)));
+  EXPECT_EQ(shared.cost, 2 * 10 * 100 * 10 + 3 * 2 * 10 * 10 * 10);
+  ASSERT_EQ(shared.products.size(), 2u);
+  EXPECT_EQ(shared.products[0].expr, mul(A, B));
+  Operand *ab = shared.products[0].result;
+  ASSERT_NE(ab, nullptr);
+  EXPECT_EQ(shared.products[1].result, nullptr);
+  EXPECT_EQ(shared.products[1].expr, mul(ab, C, ab, D));
+
+  // trans(X) W is shared by wide chains, whose own plans compute it first,
+  // not by narrow ones, which are cheaper right to left.
+  auto *X = new Operand("X", {200, 20});
+  auto *W = new Operand("W", {200, 30});
+  vector<Expr *> wide, narrow;
+  for (int c = 0; c < 3; c++) {
+    wide.push_back(mul(trans(X), W, new Operand("Y", {30, 50})));
+    narrow.push_back(mul(trans(X), W, new Operand("Z", {30, 1})));
+  }
+  shared = runMCPShared(wide);
+  EXPECT_EQ(shared.independentCost, 3 * (2 * 20 * 200 * 30 + 2 * 20 * 30 * 50));
+  EXPECT_EQ(shared.cost, 2 * 20 * 200 * 30 + 3 * 2 * 20 * 30 * 50);
+  EXPECT_EQ(shared.products.size(), 4u);
+  shared = runMCPShared(narrow);
+  EXPECT_EQ(shared.getSavings(), 0);
+  EXPECT_EQ(shared.products.size(), 3u);
+  // the candidates are priced without building nodes: nothing is shared,
+  // so solving again allocates none.
+  resetStats();
+  runMCPShared(narrow);
+  if (isStatsEnabled()) {
+    EXPECT_EQ(getStats().get(StatsCounter::NODES_ALLOCATED), 0u);
+  }
+
+  // evaluate the DAG, binding the shared results to their buffers. Nested
+  // repeats: P Q is shared, and so is (P Q) R.
+  auto *P = new Operand("P", {10, 40});
+  auto *Q = new Operand("Q", {40, 30});
+  auto *R = new Operand("R", {30, 10});
+  vector<Expr *> chains = {mul(P, Q, R, P, Q, R), mul(C, trans(C), P, Q)};
+  vector<vector<int>> shapes = {{10, 10}, {10, 30}};
+  shared = runMCPShared(chains);
+  EXPECT_GT(shared.getSavings(), 0);
+  EXPECT_EQ(shared.products.size(), 4u);
+  long total = 0;
+  for (const auto &product : shared.products)
+    total += product.plan.getOptimalCost();
+  EXPECT_EQ(total, shared.cost);
+  Bindings bindings;
+  vector<vector<double>> buffers;
+  bindRandom({C, P, Q, R}, rng, buffers, bindings);
+  vector<vector<double>> outs;
+  size_t c = 0;
+  for (const auto &product : shared.products) {
+    const vector<int> &shape =
+        product.result ? product.result->getShape() : shapes[c++];
+    outs.emplace_back(shape[0] * shape[1]);
+    evaluate(product.expr, product.plan, bindings, outs.back().data());
+    if (product.result)
+      bindings[product.result] = outs.back().data();
+  }
+  for (c = 0; c < chains.size(); c++) {
+    const vector<double> &out = outs[outs.size() - chains.size() + c];
+    vector<double> expected(out.size());
+    evaluate(chains[c], bindings, expected.data());
+    expectNear(out, expected);
+  }
+}
+
+TEST(Chain, IncrementalMCP) {
+  ScopedContext ctx;
+  std::mt19937 rng(29);
+  const size_t n = 24;
+  vector<int> p(n + 1);
+  for (auto &dim : p)
+    dim = 1 + rng() % 50;
+  p[5] = p[6] = p[7] = 20;
+  vector<Expr *> leaves;
+  for (size_t i = 1; i <= n; i++)
+    leaves.push_back(new Operand("A", {p[i - 1], p[i]}));
+  // the same tables as solving the current chain from scratch.
+  auto expectSolved = [&](const IncrementalMCP &incremental) {
+    ResultMCP expected = runMCP(details::binaryMul(leaves));
+    const ResultMCP &result = incremental.getResult();
+    for (size_t i = 1; i <= n; i++)
+      for (size_t j = i + 1; j <= n; j++) {
+        EXPECT_EQ(result.getCost(i, j), expected.getCost(i, j));
+        EXPECT_EQ(result.getSplit(i, j), expected.getSplit(i, j));
+      }
+  };
+  auto setDimension = [&](IncrementalMCP &incremental, size_t t, int value) {
+    p[t] = value;
+    if (t >= 1)
+      leaves[t - 1] = new Operand("A", {p[t - 1], p[t]});
+    if (t < n)
+      leaves[t] = new Operand("A", {p[t], p[t + 1]});
+    incremental.setDimension(t, value);
+  };
+
+  IncrementalMCP incremental(details::binaryMul(leaves));
+  EXPECT_EQ(incremental.size(), n);
+  EXPECT_EQ(incremental.getSolvedCells(), n * (n - 1) / 2);
+  expectSolved(incremental);
+  // the batch dimension at either end: one row or column of cells.
+  setDimension(incremental, n, 64);
+  EXPECT_EQ(incremental.getSolvedCells(), n - 1);
+  expectSolved(incremental);
+  setDimension(incremental, 0, 3);
+  EXPECT_EQ(incremental.getSolvedCells(), n - 1);
+  expectSolved(incremental);
+  // in the middle, the cells i..j with i - 1 <= 12 <= j and i < j.
+  setDimension(incremental, 12, 9);
+  EXPECT_EQ(incremental.getSolvedCells(), 13u * 13u - 3);
+  EXPECT_EQ(incremental.getPVector()[12], 9);
+  expectSolved(incremental);
+
+  // properties, then a mirror.
+  auto *L = new Operand("L", {20, 20});
+  L->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  leaves[5] = L;
+  incremental.setLeaf(6, L);
+  EXPECT_EQ(incremental.getSolvedCells(), 6u * (n - 6 + 1) - 1);
+  expectSolved(incremental);
+  leaves[6] = trans(L);
+  incremental.setLeaf(7, trans(L));
+  expectSolved(incremental);
+}
+
+TEST(Chain, EvaluateProperties) {
+  ScopedContext ctx;
+  std::mt19937 rng(17);
+  auto *L = new Operand("L", {90, 90});
+  auto *U = new Operand("U", {90, 90});
+  auto *S = new Operand("S", {90, 90});
+  auto *X = new Operand("X", {90, 40});
+  L->setProperties({Expr::ExprProperty::LOWER_TRIANGULAR});
+  U->setProperties({Expr::ExprProperty::UPPER_TRIANGULAR});
+  S->setProperties({Expr::ExprProperty::SYMMETRIC});
+  vector<double> l = getRandomMatrix(90, 90, rng);
+  vector<double> u = l, s = l;
+  for (long i = 0; i < 90; i++)
+    for (long j = 0; j < 90; j++) {
+      if (j > i)
+        l[i * 90 + j] = 0.0;
+      if (j < i)
+        u[i * 90 + j] = 0.0;
+      s[i * 90 + j] = s[j * 90 + i];
+    }
+  vector<double> x = getRandomMatrix(90, 40, rng);
+  Bindings bindings = {
+      {L, l.data()}, {U, u.data()}, {S, s.data()}, {X, x.data()}};
+  auto ref = [&](Operand *operand) { return getRef(bindings, operand); };
+  vector<double> out(90 * 40);
+  for (auto *left : {L, U, S}) {
+    evaluate(mul(left, X), bindings, out.data());
+    expectNear(out, multiply(ref(left), ref(X)));
+  }
+  vector<double> lu = multiply(ref(L), ref(U));
+  evaluate(mul(L, U, X), bindings, out.data());
+  expectNear(out, multiply(details::getRowMajor(lu.data(), 90, 90), ref(X)));
+  vector<double> gram(40 * 40);
+  evaluate(mul(trans(X), X), bindings, gram.data());
+  expectNear(gram, multiply(ref(X).transpose(), ref(X)));
+}
+
+TEST(Chain, Evaluate) {
+  ScopedContext ctx;
+  std::mt19937 rng(11);
+  vector<vector<double>> buffers;
+  Bindings bindings;
+  auto getOperand = [&](string name, long rows, long cols) {
+    auto *operand = new Operand(name, {int(rows), int(cols)});
+    buffers.push_back(getRandomMatrix(rows, cols, rng));
+    if (rows == cols)
+      // diagonally dominant, so that it is well conditioned.
+      for (long i = 0; i < rows; i++)
+        buffers.back()[i * cols + i] += rows;
+    bindings[operand] = buffers.back().data();
+    return operand;
+  };
+  auto *A = getOperand("A", 30, 35);
+  auto *B = getOperand("B", 35, 15);
+  auto *C = getOperand("C", 15, 5);
+  auto *D = getOperand("D", 5, 10);
+  auto *E = getOperand("E", 10, 20);
+  auto *F = getOperand("F", 20, 25);
+  auto *S = getOperand("S", 25, 25);
+  auto ref = [&](Operand *operand) { return getRef(bindings, operand); };
+  auto product = [&](const vector<double> &lhs, long rows, Operand *rhs) {
+    return multiply(details::getRowMajor(lhs.data(), rows, ref(rhs).rows),
+                    ref(rhs));
+  };
+  vector<double> expected = multiply(ref(A), ref(B));
+  for (auto *operand : {C, D, E, F})
+    expected = product(expected, 30, operand);
+  vector<double> out(30 * 25);
+  evaluate(mul(A, B, C, D, E, F), bindings, out.data());
+  expectNear(out, expected);
+  MCPOptions options;
+  options.engine = MCPEngine::HU_SHING;
+  evaluate(mul(A, B, C, D, E, F), bindings, out.data(), options);
+  expectNear(out, expected);
+
+  // S * inv(S) * F^T = F^T.
+  out.assign(25 * 20, 0.0);
+  evaluate(mul(S, inv(S), trans(F)), bindings, out.data());
+  vector<double> transposed(25 * 20);
+  for (long i = 0; i < 25; i++)
+    for (long j = 0; j < 20; j++)
+      transposed[i * 20 + j] = ref(F)(j, i);
+  for (size_t i = 0; i < out.size(); i++)
+    EXPECT_NEAR(out[i], transposed[i], 1e-9);
+}
+
+TEST(Chain, GenerateEvaluator) {
+  ScopedContext ctx;
+  auto *X = new Operand("X", {40, 15});
+  auto *Y = new Operand("Y", {15, 30});
+  Expr *gram = mul(trans(X), X, Y);
+  ResultMCP plan = runMCP(gram);
+  std::ostringstream os;
+  generateEvaluator(gram, plan, os);
+  string source = os.str();
+  // one kernel call per product, the intermediates at their planned
+  // offsets, and only the kernels called.
+  EXPECT_NE(source.find("void evaluate(const double *X, const double *Y, "
+                        "double *out, double *workspace)"),
+            string::npos);
+  EXPECT_NE(source.find("syrk(15, 40, Ref{X, 1, 15}, workspace + 0, 15);"),
+            string::npos);
+  EXPECT_NE(source.find("symm(15, 30, Ref{workspace + 0, 15, 1}, "
+                        "Ref{Y, 30, 1}, out, 30);"),
+            string::npos);
+  EXPECT_NE(source.find("evaluateWorkspaceSize = " +
+                        std::to_string(planMemory(gram, plan).size)),
+            string::npos);
+  EXPECT_EQ(source.find("void gemm("), string::npos);
+  EXPECT_EQ(source.find("int main()"), string::npos);
+
+  // operands that cannot name a parameter are numbered.
+  auto *gemm = new Operand("gemm", {15, 15});
+  auto *other = new Operand("X", {15, 15});
+  Expr *chain = mul(X, gemm, other);
+  CodegenOptions options;
+  options.name = "product";
+  options.emitTest = true;
+  os.str("");
+  generateEvaluator(chain, runMCP(chain), os, options);
+  source = os.str();
+  EXPECT_NE(source.find("void product(const double *X, const double "
+                        "*operand1, const double *operand2, double *out"),
+            string::npos);
+  EXPECT_NE(source.find("int main()"), string::npos);
 }
@@ -0,0 +1,72 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// The generated evaluator of inv(S) X (see generate_chain.cpp) against the
+// library, on an SPD S stored in its upper triangle only: both POSV read
+// that triangle.
+
+#include "chain.h"
+#include "execute.h"
+#include "gtest/gtest.h"
+#include <cmath>
+#include <limits>
+#include <random>
+
+using namespace matrixchain;
+
+// generated_spd.cpp.
+void spd(const double *S, const double *X, double *out, double *workspace);
+
+TEST(Generated, PosvUpperTriangle) {
+  ScopedContext ctx;
+  const long m = 40, n = 15;
+  // as in generate_chain.cpp.
+  auto *S = new Operand("S", {int(m), int(m)});
+  auto *X = new Operand("X", {int(m), int(n)});
+  S->setProperties({Expr::ExprProperty::SPD, Expr::ExprProperty::SYMMETRIC});
+  Expr *chain = mul(inv(S), X);
+
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> dist(-1, 1);
+  vector<double> full(m * m), upper(m * m), x(m * n);
+  for (long i = 0; i < m; i++)
+    for (long j = i; j < m; j++)
+      full[i * m + j] = full[j * m + i] = dist(rng) + (i == j ? m : 0.0);
+  for (auto &value : x)
+    value = dist(rng);
+  for (long i = 0; i < m; i++)
+    for (long j = 0; j < m; j++)
+      upper[i * m + j] =
+          j < i ? std::numeric_limits<double>::quiet_NaN() : full[i * m + j];
+
+  ResultMCP plan = runMCP(chain);
+  vector<double> expected(m * n), library(m * n), generated(m * n);
+  vector<double> workspace(planMemory(chain, plan).size);
+  evaluate(chain, plan, {{S, full.data()}, {X, x.data()}}, expected.data());
+  evaluate(chain, plan, {{S, upper.data()}, {X, x.data()}}, library.data());
+  spd(upper.data(), x.data(), generated.data(), workspace.data());
+  for (long e = 0; e < m * n; e++) {
+    EXPECT_NEAR(library[e], expected[e], 1e-12);
+    EXPECT_NEAR(generated[e], library[e], 1e-12);
+  }
+}
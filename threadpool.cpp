@@ -0,0 +1,156 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "threadpool.h"
+#include <algorithm>
+#include <cassert>
+
+using namespace details;
+
+namespace {
+// pool and deque of the current thread, if it belongs to a pool.
+thread_local const ThreadPool *currentPool = nullptr;
+thread_local size_t currentQueue = 0;
+} // end namespace
+
+ThreadPool::ThreadPool(unsigned numThreads) : queued(0), done(false) {
+  assert(numThreads >= 1 && "expect at least one thread");
+  for (unsigned i = 0; i < numThreads; i++)
+    queues.emplace_back(new Queue());
+  for (unsigned i = 1; i < numThreads; i++)
+    threads.emplace_back([this, i]() {
+      currentPool = this;
+      currentQueue = i;
+      work(i);
+    });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    done = true;
+  }
+  wakeUp.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+}
+
+size_t ThreadPool::getCurrentQueue() const {
+  return currentPool == this ? currentQueue : 0;
+}
+
+void ThreadPool::async(TaskGroup &group, std::function<void()> task) {
+  group.pending++;
+  // counted before it is published: a thief may run it, and decrement
+  // `queued`, as soon as it is in the deque.
+  {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    queued++;
+  }
+  Queue &queue = *queues[getCurrentQueue()];
+  {
+    std::lock_guard<std::mutex> guard(queue.lock);
+    queue.tasks.push_back({std::move(task), &group});
+  }
+  wakeUp.notify_one();
+}
+
+bool ThreadPool::runOne(size_t self) {
+  Task task;
+  bool found = false;
+  {
+    Queue &queue = *queues[self];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      found = true;
+    }
+  }
+  for (size_t i = 1, e = queues.size(); !found && i < e; i++) {
+    Queue &victim = *queues[(self + i) % e];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      found = true;
+    }
+  }
+  if (!found)
+    return false;
+  queued--;
+  // the task is done even if it throws, the group may then go out of scope.
+  struct Finish {
+    TaskGroup *group;
+    ~Finish() { group->pending--; }
+  } finish = {task.group};
+  try {
+    task.run();
+  } catch (...) {
+    std::lock_guard<std::mutex> guard(task.group->errorLock);
+    if (!task.group->error)
+      task.group->error = std::current_exception();
+  }
+  return true;
+}
+
+void ThreadPool::work(size_t self) {
+  while (true) {
+    if (runOne(self))
+      continue;
+    std::unique_lock<std::mutex> guard(sleepLock);
+    wakeUp.wait(guard, [this]() { return done || queued > 0; });
+    if (done && queued == 0)
+      return;
+  }
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+  size_t self = getCurrentQueue();
+  while (group.pending != 0) {
+    if (!runOne(self))
+      std::this_thread::yield();
+  }
+  if (group.error) {
+    std::exception_ptr error = group.error;
+    group.error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain,
+                             const std::function<void(size_t, size_t)> &body) {
+  assert(grain > 0 && "grain must be positive");
+  TaskGroup group;
+  try {
+    for (size_t first = begin; first < end; first += grain) {
+      size_t last = std::min(end, first + grain);
+      async(group, [&body, first, last]() { body(first, last); });
+    }
+  } catch (...) {
+    // the queued chunks refer to `body` and `group`.
+    wait(group);
+    throw;
+  }
+  wait(group);
+}
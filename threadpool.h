@@ -0,0 +1,105 @@
+/*
+Copyright 2021 Lorenzo Chelini <l.chelini@icloud.com> or
+<lorenzo.chelini@huawei.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MATRIX_CHAIN_THREADPOOL_H
+#define MATRIX_CHAIN_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace details {
+
+/// Work-stealing thread pool. Every thread owns a deque of tasks: it pops
+/// from the back of its own and steals from the front of the others when it
+/// runs out of work. Threads outside the pool share deque 0.
+class ThreadPool {
+public:
+  /// Set of tasks that can be waited on together.
+  class TaskGroup {
+  public:
+    TaskGroup() : pending(0){};
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+  private:
+    friend class ThreadPool;
+    std::atomic<size_t> pending;
+    // the first exception thrown by a task, rethrown by wait.
+    std::mutex errorLock;
+    std::exception_ptr error;
+  };
+
+  /// Spawn numThreads - 1 workers, the thread calling `wait` is the last one.
+  explicit ThreadPool(unsigned numThreads);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned getNumThreads() const { return queues.size(); }
+
+  void async(TaskGroup &group, std::function<void()> task);
+
+  /// Block until every task in `group` is done. The calling thread keeps
+  /// running (or stealing) tasks meanwhile, so waiting from a task is fine.
+  /// Then rethrows the first exception a task of the group threw, if any.
+  void wait(TaskGroup &group);
+
+  /// Run body(first, last) on chunks of at most `grain` indices covering
+  /// [begin, end) and wait for all of them, even if some throw.
+  void parallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)> &body);
+
+private:
+  struct Task {
+    std::function<void()> run;
+    TaskGroup *group;
+  };
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  size_t getCurrentQueue() const;
+  bool runOne(size_t self);
+  void work(size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> threads;
+  std::mutex sleepLock;
+  std::condition_variable wakeUp;
+  // tasks in the deques, counted before they are pushed so that it never
+  // goes below zero.
+  std::atomic<size_t> queued;
+  bool done;
+};
+
+} // end namespace details.
+
+#endif
@@ -23,6 +23,7 @@ SOFTWARE.
 
 #include "chain.h"
 #include "llvm/Support/Casting.h"
+#include <algorithm>
 #include <iostream>
 
 bool Expr::isTransposeOf(const Expr *right) {
@@ -41,65 +42,92 @@ bool Expr::isTransposeOf(const Expr *right) {
   return false;
 }
 
-static bool isSameImpl(const Expr *tree1, const Expr *tree2) {
-  if (!tree1 && !tree2)
-    return true;
+size_t NaryOp::getStructuralHash(const vector<Expr *> &children,
+                                 NaryOpKind kind) {
+  size_t hash = hashCombine(static_cast<size_t>(ExprKind::BINARY),
+                            static_cast<size_t>(kind));
+  for (auto child : children)
+    hash = hashCombine(hash, child->getHash());
+  return hash;
+}
 
-  if (tree1 && tree2) {
-    if (tree1->getKind() != tree2->getKind())
-      return false;
-    // pt comparison for operands.
-    if (llvm::isa<Operand>(tree1)) {
-      return tree1 == tree2;
-    }
-    // unary.
-    if (llvm::isa<UnaryOp>(tree1) && llvm::isa<UnaryOp>(tree2)) {
-      const UnaryOp *tree1Op = llvm::dyn_cast_or_null<UnaryOp>(tree1);
-      const UnaryOp *tree2Op = llvm::dyn_cast_or_null<UnaryOp>(tree2);
-      return isSameImpl(tree1Op->getChild(), tree2Op->getChild());
-    }
-    // binary.
-    if (llvm::isa<NaryOp>(tree1) && llvm::isa<NaryOp>(tree2)) {
-      const NaryOp *tree1Op = llvm::dyn_cast_or_null<NaryOp>(tree1);
-      const NaryOp *tree2Op = llvm::dyn_cast_or_null<NaryOp>(tree2);
-      // TODO: fix
-      return isSameImpl(tree1Op->getChildren()[0], tree2Op->getChildren()[0]) &&
-             isSameImpl(tree1Op->getChildren()[1], tree2Op->getChildren()[1]);
-    }
-  }
-  return false;
+size_t UnaryOp::getStructuralHash(const Expr *child, UnaryOpKind kind) {
+  size_t hash = hashCombine(static_cast<size_t>(ExprKind::UNARY),
+                            static_cast<size_t>(kind));
+  return hashCombine(hash, child->getHash());
 }
 
 Expr *Operand::getNormalForm() { return this; }
 
-Expr *NaryOp::getNormalForm() {
-  // TODO: What is the normal form for mul?
-  assert(0 && "not available");
-  return nullptr;
+/// Whether the leaf `expr` of a normal form is square.
+static bool isSquareLeaf(Expr *expr) {
+  while (auto unaryOp = llvm::dyn_cast<UnaryOp>(expr))
+    expr = unaryOp->getChild();
+  auto operand = llvm::dyn_cast<Operand>(expr);
+  return operand && operand->getShape()[0] == operand->getShape()[1];
 }
 
-Expr *UnaryOp::getNormalForm() {
-  Expr *child = this->getChild();
-  if (NaryOp *maybeMul = llvm::dyn_cast_or_null<NaryOp>(child)) {
-    vector<Expr *> normalFormOperands;
-    auto children = maybeMul->getChildren();
-    int size = children.size();
-    for (int i = size - 1; i >= 0; i--)
-      normalFormOperands.push_back(trans(children.at(i)->getNormalForm()));
-    return binaryMul(normalFormOperands);
+/// Normal form of the transpose of the normal form `expr`.
+static Expr *getTranspose(Expr *expr) {
+  if (auto unaryOp = llvm::dyn_cast<UnaryOp>(expr)) {
+    if (unaryOp->getKind() == UnaryOp::UnaryOpKind::TRANSPOSE)
+      return unaryOp->getChild();
+    return inv(getTranspose(unaryOp->getChild()));
+  }
+  if (auto product = llvm::dyn_cast<NaryOp>(expr)) {
+    auto children = product->getChildren();
+    vector<Expr *> transposed;
+    for (auto it = children.rbegin(); it != children.rend(); ++it)
+      transposed.push_back(getTranspose(*it));
+    return binaryMul(transposed);
+  }
+  return trans(expr);
+}
+
+/// Normal form of the inverse of the normal form `expr`.
+static Expr *getInverse(Expr *expr) {
+  if (auto unaryOp = llvm::dyn_cast<UnaryOp>(expr))
+    if (unaryOp->getKind() == UnaryOp::UnaryOpKind::INVERSE)
+      return unaryOp->getChild();
+  if (auto product = llvm::dyn_cast<NaryOp>(expr)) {
+    auto children = product->getChildren();
+    // (A B)^-1 = B^-1 A^-1 only holds for square factors.
+    if (std::all_of(children.begin(), children.end(), isSquareLeaf)) {
+      vector<Expr *> inverted;
+      for (auto it = children.rbegin(); it != children.rend(); ++it)
+        inverted.push_back(getInverse(*it));
+      return binaryMul(inverted);
+    }
   }
-  assert(0 && "unreachable");
-  return nullptr;
+  return inv(expr);
 }
 
-// return a brand new expr.
-static Expr *getCanonicalForm(const Expr *tree) { return nullptr; }
+Expr *NaryOp::getNormalForm() {
+  if (normalForm)
+    return normalForm;
+  vector<Expr *> normalChildren;
+  for (auto *child : children)
+    normalChildren.push_back(child->getNormalForm());
+  return setNormalForm(binaryMul(normalChildren));
+}
 
-bool Expr::isSame(const Expr *right) {
-  if (isSameImpl(this, right))
-    return true;
-  Expr *canonicalForm = getCanonicalForm(this);
-  if (isSameImpl(canonicalForm, right))
-    return true;
-  return false;
+Expr *UnaryOp::getNormalForm() {
+  if (normalForm)
+    return normalForm;
+  Expr *normalChild = child->getNormalForm();
+  return setNormalForm(kind == UnaryOpKind::TRANSPOSE
+                           ? getTranspose(normalChild)
+                           : getInverse(normalChild));
 }
+
+bool details::isMirrored(const vector<Expr *> &leaves, size_t i, size_t j) {
+  if ((j - i + 1) % 2)
+    return false;
+  for (; i < j; i++, j--)
+    if (!leaves[i - 1]->isTransposeOf(leaves[j - 1]))
+      return false;
+  return true;
+}
+
+// operations are interned, see ScopedContext::intern.
+bool Expr::isSame(const Expr *right) { return this == right; }